@@ -38,11 +38,22 @@
 #include <errno.h>
 #include <math.h>
 #include "ntp-protocol.h"
+#include "ntp-select.h"
+#include "ntp-fixed.h"
+#include "ntp-discipline.h"
+#include "ntp-server.h"
+#include "ntp-loadgen.h"
+#include "ntp-resolve.h"
+#include "ntp-rxtime.h"
 
 // Default NTP servers - you can test with different ones!
 #define DEFAULT_NTP_SERVER "pool.ntp.org"
 #define TIMEOUT_SECONDS 5
 
+static int resolve_server(const char* hostname, char* ip_str, ntp_peer_t* raced);
+static int report_ntp_exchange(const char* server_name, const ntp_packet_t* request,
+                               const ntp_packet_t* response, const ntp_timestamp_t* recv_time);
+
 /*
  * =============================================================================
  * PROVIDED FUNCTIONS - NETWORKING AND PROGRAM STRUCTURE
@@ -54,13 +65,73 @@
 // Main function - handles command line arguments and starts the NTP query
 int main(int argc, char* argv[]) {
     char* ntp_server = DEFAULT_NTP_SERVER;
+    char* servers[NTP_MAX_PEERS];
+    int nservers = 0;
+    int burst = 0;
+    int daemon_mode = 0;
+    int dry_run = 0;
+    const char* drift_file = NTP_DRIFT_FILE;
+    int server_mode = 0;
+    int port = NTP_PORT;
+    int nthreads = 0;
+    int stratum = NTP_SERVER_STRATUM;
+    const char* refid = NULL;
+    long load_rate = 0;
+    int load_seconds = NTP_LOAD_SECONDS;
+    int load_sockets = NTP_LOAD_SOCKETS;
+    char* suffix;
     
     // Parse command line arguments
     int opt;
-    while ((opt = getopt(argc, argv, "s:hd")) != -1) {
+    while ((opt = getopt(argc, argv, "s:H:f:p:t:r:u:L:T:N:hdiDnS")) != -1) {
         switch (opt) {
             case 's':
                 ntp_server = optarg;
+                if (nservers < NTP_MAX_PEERS) {
+                    servers[nservers++] = optarg;
+                }
+                break;
+            case 'i':
+                burst = 1;
+                break;
+            case 'H':
+                set_rx_timestamp_iface(optarg);
+                break;
+            case 'D':
+                daemon_mode = 1;
+                break;
+            case 'n':
+                daemon_mode = 1;
+                dry_run = 1;
+                break;
+            case 'f':
+                drift_file = optarg;
+                break;
+            case 'S':
+                server_mode = 1;
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 't':
+                nthreads = atoi(optarg);
+                break;
+            case 'r':
+                stratum = atoi(optarg);
+                break;
+            case 'u':
+                refid = optarg;
+                break;
+            case 'L':
+                // Requests per second, k and m suffixes allowed
+                load_rate = strtol(optarg, &suffix, 10);
+                load_rate *= *suffix == 'k' ? 1000 : *suffix == 'm' ? 1000000 : 1;
+                break;
+            case 'T':
+                load_seconds = atoi(optarg);
+                break;
+            case 'N':
+                load_sockets = atoi(optarg);
                 break;
             case 'd':
                 // Debug mode - demonstrate epoch conversion
@@ -77,16 +148,74 @@ int main(int argc, char* argv[]) {
         }
     }
     
+    // Server mode: answer requests instead of sending them
+    if (server_mode) {
+        return run_ntp_server(port, nthreads, stratum, refid);
+    }
+
+    // Load mode: measure what a server can take, never against a default
+    if (load_rate > 0) {
+        if (nservers == 0) {
+            fprintf(stderr, "Load mode needs the server under test (-s), please do not\n"
+                            "load test public NTP servers\n");
+            return 1;
+        }
+        return run_ntp_loadgen(servers[0], port, load_rate, load_seconds, load_sockets);
+    }
+
+    // Daemon mode: keep polling and steer the clock
+    if (daemon_mode) {
+        if (nservers == 0) {
+            servers[nservers++] = ntp_server;
+        }
+        return run_ntp_daemon(servers, nservers, drift_file, dry_run);
+    }
+
+    // Burst mode: several samples per server through the clock filter
+    if (burst) {
+        if (nservers == 0) {
+            servers[nservers++] = ntp_server;
+        }
+        return query_ntp_pool(servers, nservers, NTP_BURST_COUNT);
+    }
+
+    // More than one server, or a pool name with several addresses: ask
+    // them all at once and select the best.  One address of each family
+    // is a single dual-stack server
+    ntp_dns_result_t dns;
+    int naddrs4 = 0, naddrs6 = 0;
+    if (nservers <= 1 && ntp_resolve_names((const char* const*)&ntp_server, 1, &dns,
+                                           NTP_DNS_TIMEOUT_MS) == 1) {
+        for (int i = 0; i < dns.count; i++) {
+            naddrs4 += dns.addrs[i].ss_family == AF_INET;
+            naddrs6 += dns.addrs[i].ss_family == AF_INET6;
+        }
+    }
+    if (nservers > 1 || naddrs4 > 1 || naddrs6 > 1) {
+        if (nservers == 0) {
+            servers[nservers++] = ntp_server;
+        }
+        return query_ntp_pool(servers, nservers, 1);
+    }
+
     printf("Querying NTP server: %s\n", ntp_server);
     
     // Resolve hostname to IP address
-    char server_ip[INET_ADDRSTRLEN];
-    if (resolve_hostname(ntp_server, server_ip) < 0) {
+    char server_ip[NTP_ADDRSTRLEN];
+    ntp_peer_t raced;
+    if (resolve_server(ntp_server, server_ip, &raced) < 0) {
         fprintf(stderr, "Failed to resolve hostname: %s\n", ntp_server);
         return 1;
     }
     
     printf("Server IP: %s\n", server_ip);
+
+    // A dual-stack race already made the exchange, report that one
+    if (raced.replied) {
+        printf("Connecting to %s (%s) on port %d\n", ntp_server, server_ip, NTP_PORT);
+        return report_ntp_exchange(ntp_server, &raced.request, &raced.response,
+                                   &raced.recv_time);
+    }
     
     // Query the NTP server
     int result = query_ntp_server(ntp_server, server_ip);
@@ -95,35 +224,108 @@ int main(int argc, char* argv[]) {
 
 // Print usage information
 void usage(const char* progname) {
-    printf("Usage: %s [-s server] [-d] [-h]\n", progname);
+    printf("Usage: %s [-s server] [-i] [-H iface] [-D] [-n] [-f file]\n"
+           "       [-S] [-p port] [-t threads] [-r stratum] [-u refid]\n"
+           "       [-L rate] [-T seconds] [-N sockets]\n"
+           "       [-d] [-h]\n", progname);
     printf("\nOptions:\n");
     printf("  -s server    NTP server to query (default: %s)\n", DEFAULT_NTP_SERVER);
+    printf("               Repeat -s (up to %d) to query several servers at once and\n", NTP_MAX_PEERS);
+    printf("               combine them with the RFC 5905 selection algorithms\n");
+    printf("  -i           Burst mode - %d requests per server, %d ms apart, through the\n",
+           NTP_BURST_COUNT, NTP_BURST_GAP_MS);
+    printf("               8-stage clock filter (lowest delay wins)\n");
+    printf("  -H iface     Take T4 from the hardware timestamps of this NIC, needs\n");
+    printf("               CAP_NET_ADMIN and the NIC clock synced to the system clock\n");
+    printf("  -D           Daemon mode - keep polling and discipline the system clock\n");
+    printf("               with adjtimex() (PLL/FLL, needs CAP_SYS_TIME) until Ctrl-C\n");
+    printf("  -n           Dry run of daemon mode, only log the corrections\n");
+    printf("  -f file      Drift file of daemon mode (default: %s)\n", NTP_DRIFT_FILE);
+    printf("  -S           Server mode - answer client requests until Ctrl-C\n");
+    printf("  -p port      Port to serve on, or of the server under load (default: %d)\n",
+           NTP_PORT);
+    printf("  -t threads   Server threads, one SO_REUSEPORT socket each (default: one\n");
+    printf("               per CPU)\n");
+    printf("  -r stratum   Stratum the server advertises while the clock is synced,\n");
+    printf("               one more than its upstream (default: %d)\n", NTP_SERVER_STRATUM);
+    printf("  -u refid     Reference ID the server advertises: the upstream's IPv4\n");
+    printf("               address, or up to 4 characters at stratum 1 (default:\n");
+    printf("               127.127.1.0)\n");
+    printf("  -L rate      Load mode - send rate requests/s (k, m suffixes) to the -s\n");
+    printf("               server and report throughput, loss and round trip percentiles\n");
+    printf("  -T seconds   Load mode duration (default: %d)\n", NTP_LOAD_SECONDS);
+    printf("  -N sockets   Load mode source ports (default: %d)\n", NTP_LOAD_SOCKETS);
     printf("  -d           Debug mode - show epoch conversion example\n");
     printf("  -h           Show this help\n");
     printf("\nExamples:\n");
     printf("  %s\n", progname);
     printf("  %s -s time.nist.gov\n", progname);
     printf("  %s -s pool.ntp.org\n", progname);
+    printf("  %s -s time.nist.gov -s time.google.com -s pool.ntp.org\n", progname);
+    printf("  %s -i -s time.nist.gov\n", progname);
+    printf("  %s -n -s time.google.com -s time.cloudflare.com -s pool.ntp.org\n", progname);
+    printf("  %s -S -p 1123\n", progname);
+    printf("  %s -S -r 3 -u 192.0.2.1\n", progname);
+    printf("  %s -L 200k -T 10 -s 127.0.0.1 -p 1123\n", progname);
     printf("  %s -d\n", progname);
 }
 
-// Resolve hostname to IP address using DNS
-int resolve_hostname(const char* hostname, char* ip_str) {
-    struct hostent* host_entry = gethostbyname(hostname);
-    if (host_entry == NULL) {
+// Resolve hostname to one address, through the resolver cache, into
+// ip_str of NTP_ADDRSTRLEN.  A server with both IPv6 and IPv4 addresses
+// gets a Happy Eyeballs race and the path that answers first is used;
+// the race is a full exchange, raced->replied says whether it holds one
+static int resolve_server(const char* hostname, char* ip_str, ntp_peer_t* raced) {
+    static const int families[] = { AF_INET6, AF_INET };
+    ntp_dns_result_t dns;
+    struct sockaddr_storage first[2];
+    int nfirst = 0;
+
+    memset(raced, 0, sizeof(*raced));
+    if (ntp_resolve_names(&hostname, 1, &dns, NTP_DNS_TIMEOUT_MS) == 0) {
         return -1;
     }
-    
-    struct in_addr addr;
-    memcpy(&addr, host_entry->h_addr_list[0], sizeof(struct in_addr));
-    strcpy(ip_str, inet_ntoa(addr));
-    
+    for (int f = 0; f < 2; f++) {
+        for (int i = 0; i < dns.count; i++) {
+            if (dns.addrs[i].ss_family == families[f]) {
+                first[nfirst] = dns.addrs[i];
+                ntp_addr_set_port(&first[nfirst++], NTP_PORT);
+                break;
+            }
+        }
+    }
+
+    int winner = 0;
+    if (nfirst == 2) {
+        winner = ntp_race_addresses(first, nfirst, NTP_QUERY_TIMEOUT_MS, raced);
+        if (winner < 0) {
+            // Neither answered, leave the timeout to the query
+            winner = 0;
+        } else {
+            printf("IPv6 and IPv4 raced, %s answered first\n", winner == 0 ? "IPv6" : "IPv4");
+        }
+    }
+    ntp_addr_str(&first[winner], ip_str, NTP_ADDRSTRLEN);
     return 0;
 }
 
-// Create UDP socket with appropriate timeout settings
+int resolve_hostname(const char* hostname, char* ip_str) {
+    ntp_peer_t raced;
+    return resolve_server(hostname, ip_str, &raced);
+}
+
+// Create UDP socket with appropriate timeout settings.  It is a dual-stack
+// IPv6 socket that reaches IPv4 servers too, or an IPv4 one on hosts
+// without IPv6
 int create_udp_socket() {
-    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    int off = 0;
+    int sockfd = socket(AF_INET6, SOCK_DGRAM, 0);
+    if (sockfd >= 0 && setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)) < 0) {
+        close(sockfd);
+        sockfd = -1;
+    }
+    if (sockfd < 0) {
+        sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    }
     if (sockfd < 0) {
         perror("socket");
         return -1;
@@ -143,11 +345,14 @@ int create_udp_socket() {
     return sockfd;
 }
 
-// Send NTP request packet over UDP
-int send_ntp_request(int sockfd, const struct sockaddr_in* server_addr, 
+// Send NTP request packet over UDP, to an IPv4 or IPv6 server
+int send_ntp_request(int sockfd, const struct sockaddr_storage* server_addr, 
                      const ntp_packet_t* packet) {
+    struct sockaddr_storage to;
+    ntp_addr_for_socket(sockfd, server_addr, &to);
+
     ssize_t sent = sendto(sockfd, packet, sizeof(ntp_packet_t), 0,
-                         (struct sockaddr*)server_addr, sizeof(struct sockaddr_in));
+                         (struct sockaddr*)&to, ntp_addr_len(&to));
     
     if (sent != sizeof(ntp_packet_t)) {
         perror("sendto");
@@ -159,7 +364,7 @@ int send_ntp_request(int sockfd, const struct sockaddr_in* server_addr,
 
 // Receive NTP response packet over UDP
 int recv_ntp_response(int sockfd, ntp_packet_t* packet) {
-    struct sockaddr_in from_addr;
+    struct sockaddr_storage from_addr;
     socklen_t from_len = sizeof(from_addr);
     
     ssize_t received = recvfrom(sockfd, packet, sizeof(ntp_packet_t), 0,
@@ -190,13 +395,11 @@ int query_ntp_server(const char* server_name, const char* ip_str) {
     if (sockfd < 0) {
         return -1;
     }
+    enable_rx_timestamps(sockfd);
     
     // Set up server address
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(NTP_PORT);
-    if (inet_pton(AF_INET, ip_str, &server_addr.sin_addr) != 1) {
+    struct sockaddr_storage server_addr;
+    if (ntp_addr_parse(ip_str, NTP_PORT, &server_addr) < 0) {
         fprintf(stderr, "Invalid IP address: %s\n", ip_str);
         close(sockfd);
         return -1;
@@ -223,38 +426,59 @@ int query_ntp_server(const char* server_name, const char* ip_str) {
         return -1;
     }
     
-    // Receive NTP response
+    // Receive NTP response, T4 is the time the kernel stamped on it if it
+    // did, the clock read right after the receive otherwise
     ntp_packet_t response_packet;
-    if (recv_ntp_response(sockfd, &response_packet) < 0) {
+    ntp_timestamp_t recv_time, read_time;
+    int rx_source;
+    ssize_t received = recv_ntp_response_ts(sockfd, &response_packet, NULL, &recv_time, &rx_source);
+    get_current_ntp_time(&read_time);
+    if (received < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            fprintf(stderr, "NTP request timed out\n");
+        } else {
+            perror("recvmsg");
+        }
         fprintf(stderr, "Failed to receive NTP response\n");
         close(sockfd);
         return -1;
     }
-
-    // FIRST thing to do is get receive time (T4) for accurate timing
-    ntp_timestamp_t recv_time;
-    get_current_ntp_time(&recv_time);
+    if (received != sizeof(ntp_packet_t)) {
+        fprintf(stderr, "Received incomplete NTP packet: %zd bytes\n", received);
+        close(sockfd);
+        return -1;
+    }
+    if (rx_source != NTP_RXTS_USER) {
+        printf("T4 from the %s receive timestamp, %.1f us before the program saw the reply\n",
+               rx_timestamp_name(rx_source),
+               ntp_fixed_to_ns(ntp_ts_diff(&read_time, &recv_time)) / 1e3);
+    }
     
     // Convert both packets back to host byte order for processing
     ntp_to_host(&request_packet);
     ntp_to_host(&response_packet);
+    close(sockfd);
+
+    return report_ntp_exchange(server_name, &request_packet, &response_packet, &recv_time);
+}
 
+// Print the reply and the offset and delay of one exchange, both packets
+// in host byte order
+static int report_ntp_exchange(const char* server_name, const ntp_packet_t* request,
+                               const ntp_packet_t* response, const ntp_timestamp_t* recv_time) {
     printf("\nReceived NTP response from %s!\n", server_name);
-    print_ntp_packet_info(&response_packet, "Response", IS_RESPONSE);
+    print_ntp_packet_info(response, "Response", IS_RESPONSE);
     
     // Calculate time offset and delay using NTP algorithm
     ntp_result_t result;
-    if (calculate_ntp_offset(&request_packet, &response_packet, &recv_time, &result) < 0) {
+    if (calculate_ntp_offset(request, response, recv_time, &result) < 0) {
         fprintf(stderr, "Failed to calculate time offset\n");
-        close(sockfd);
         return -1;
     }
     
     printf("\n=== NTP Time Synchronization Results ===\n");
     printf("Server: %s\n", server_name);
     print_ntp_results(&result);
-    
-    close(sockfd);
     return 0;
 }
 
@@ -0,0 +1,453 @@
+/*
+ * NTP Clock Discipline - see ntp-discipline.h and RFC 5905 appendix A.5.5.6
+ */
+
+#define _GNU_SOURCE                     // adjtimex(), sigaction() with -std=c99
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/timex.h>
+#include "ntp-discipline.h"
+#include "ntp-select.h"
+#include "ntp-resolve.h"
+
+// What local_clock() did with an offset
+#define CLK_IGNORE          0
+#define CLK_SLEW            1
+#define CLK_STEP            2
+#define CLK_PANIC           3
+
+typedef struct {
+    int state;                          // NTP_CLK_*
+    int poll;                           // log2 of the poll interval (s)
+    int count;                          // Poll adjust counter
+    double t;                           // Last update, monotonic (s)
+    double offset;                      // Offset still to be slewed (s)
+    double last;                        // Last offset measured (s)
+    double base;                        // Kernel frequency left as it was
+    double freq;                        // Our correction on top of base
+    double slew;                        // Offset slewed per second
+    double jitter;                      // Offset jitter (s)
+    double wander;                      // Frequency jitter
+    double virt;                        // Dry run: correction made so far (s)
+    int dry_run;
+} ntp_clock_t;
+
+static volatile sig_atomic_t stop = 0;
+
+static void on_signal(int sig) {
+    (void)sig;
+    stop = 1;
+}
+
+static const char* clock_state_name(int state) {
+    switch (state) {
+        case NTP_CLK_NSET: return "NSET";
+        case NTP_CLK_FSET: return "FSET";
+        case NTP_CLK_SPIK: return "SPIK";
+        case NTP_CLK_FREQ: return "FREQ";
+        case NTP_CLK_SYNC: return "SYNC";
+        default:           return "?";
+    }
+}
+
+// struct timex keeps frequencies in ppm with a 16 bit fraction
+static double freq_from_kernel(long freq) {
+    return freq / 65536e6;
+}
+
+static long freq_to_kernel(double freq) {
+    if (freq > NTP_MAXFREQ) {
+        freq = NTP_MAXFREQ;
+    } else if (freq < -NTP_MAXFREQ) {
+        freq = -NTP_MAXFREQ;
+    }
+    return lround(freq * 65536e6);
+}
+
+static void print_time_prefix(void) {
+    char buf[16];
+    time_t now = time(NULL);
+
+    strftime(buf, sizeof(buf), "%H:%M:%S", localtime(&now));
+    printf("%s ", buf);
+}
+
+/*
+ * Read the kernel frequency and, unless this is a dry run, switch off the
+ * kernel's own PLL so it does not fight ours.  A dry run leaves the kernel
+ * alone and corrects relative to the frequency it already has.
+ */
+static int clock_init(ntp_clock_t* clk, double* kernel_freq) {
+    struct timex tx;
+
+    memset(&tx, 0, sizeof(tx));
+    if (adjtimex(&tx) < 0) {
+        perror("adjtimex");
+        return -1;
+    }
+    *kernel_freq = freq_from_kernel(tx.freq);
+    if (clk->dry_run) {
+        clk->base = *kernel_freq;
+        return 0;
+    }
+
+    tx.modes = ADJ_STATUS;
+    tx.status &= ~(STA_PLL | STA_FLL | STA_PPSFREQ | STA_PPSTIME);
+    if (adjtimex(&tx) < 0) {
+        fprintf(stderr, "adjtimex: %s, setting the clock needs CAP_SYS_TIME (or use -n)\n",
+                strerror(errno));
+        return -1;
+    }
+    clk->base = 0;
+    return 0;
+}
+
+static void set_frequency(const ntp_clock_t* clk, double freq) {
+    struct timex tx;
+
+    if (clk->dry_run) {
+        return;
+    }
+    memset(&tx, 0, sizeof(tx));
+    tx.modes = ADJ_FREQUENCY;
+    tx.freq = freq_to_kernel(clk->base + freq);
+    if (adjtimex(&tx) < 0) {
+        perror("adjtimex");
+    }
+}
+
+static void step_clock(ntp_clock_t* clk, double offset) {
+    struct timex tx;
+    int64_t ns = ntp_fixed_to_ns(ntp_fixed_from_double(offset));
+
+    if (clk->dry_run) {
+        clk->virt += offset;
+        return;
+    }
+    // With ADJ_NANO the "usec" field holds nanoseconds, and must be positive
+    memset(&tx, 0, sizeof(tx));
+    tx.modes = ADJ_SETOFFSET | ADJ_NANO;
+    tx.time.tv_sec = ns / NSEC_PER_SEC - (ns % NSEC_PER_SEC < 0);
+    tx.time.tv_usec = ns - (int64_t)tx.time.tv_sec * NSEC_PER_SEC;
+    if (adjtimex(&tx) < 0) {
+        perror("adjtimex");
+    }
+}
+
+// Tell the kernel the clock is synchronized, and how well
+static void report_sync(const ntp_clock_t* clk, double rootdist) {
+    struct timex tx;
+
+    if (clk->dry_run) {
+        return;
+    }
+    memset(&tx, 0, sizeof(tx));
+    if (adjtimex(&tx) < 0) {
+        return;
+    }
+    tx.modes = ADJ_STATUS | ADJ_ESTERROR | ADJ_MAXERROR;
+    tx.status &= ~STA_UNSYNC;
+    tx.esterror = (long)(clk->jitter * 1e6);
+    tx.maxerror = (long)(rootdist * 1e6);
+    adjtimex(&tx);
+}
+
+/*
+ * Once a second (RFC 5905 clock_adjust()): account for the slew of the
+ * last dt seconds, then set the frequency to the drift correction plus
+ * 1 / (PLL * 2^poll) of the offset that is left
+ */
+static void clock_adjust(ntp_clock_t* clk, double dt) {
+    double done = clk->slew * dt;
+
+    if (fabs(done) > fabs(clk->offset)) {
+        done = clk->offset;
+    }
+    clk->offset -= done;
+    clk->virt += clk->dry_run ? clk->freq * dt + done : 0;
+    clk->slew = clk->offset / (NTP_PLL * fmin(ldexp(1.0, clk->poll), NTP_ALLAN));
+    set_frequency(clk, clk->freq + clk->slew);
+}
+
+static void set_state(ntp_clock_t* clk, int state, double offset, double now) {
+    clk->state = state;
+    clk->offset = offset;
+    clk->last = offset;
+    clk->t = now;
+}
+
+// Longer polls while the offsets stay within the jitter, shorter otherwise
+static void poll_adjust(ntp_clock_t* clk, double offset) {
+    if (fabs(offset) < NTP_PGATE * clk->jitter) {
+        clk->count += clk->poll;
+        if (clk->count > NTP_LIMIT) {
+            clk->count = NTP_LIMIT;
+            if (clk->poll < NTP_MAXPOLL) {
+                clk->count = 0;
+                clk->poll++;
+            }
+        }
+    } else {
+        clk->count -= 2 * clk->poll;
+        if (clk->count < -NTP_LIMIT) {
+            clk->count = -NTP_LIMIT;
+            if (clk->poll > NTP_MINPOLL) {
+                clk->count = 0;
+                clk->poll--;
+            }
+        }
+    }
+}
+
+// The hybrid PLL/FLL, one combined offset at a time (RFC 5905 local_clock())
+static int local_clock(ntp_clock_t* clk, double offset, double now) {
+    double mu = now - clk->t;
+    double interval = ldexp(1.0, clk->poll);
+    double precision = ldexp(1.0, NTP_LOCAL_PRECISION);
+
+    if (fabs(offset) > NTP_PANICT && clk->state != NTP_CLK_NSET && clk->state != NTP_CLK_FSET) {
+        return CLK_PANIC;
+    }
+
+    if (fabs(offset) > NTP_STEPT) {
+        switch (clk->state) {
+            case NTP_CLK_SYNC:
+                // Maybe a spike, only step if it is still there after NTP_WATCH
+                clk->state = NTP_CLK_SPIK;
+                return CLK_IGNORE;
+            case NTP_CLK_FREQ:
+                if (mu < NTP_WATCH) {
+                    return CLK_IGNORE;
+                }
+                clk->freq += (offset - clk->offset) / mu;
+                break;
+            case NTP_CLK_SPIK:
+                if (mu < NTP_WATCH) {
+                    return CLK_IGNORE;
+                }
+                break;
+            default:
+                break;
+        }
+        step_clock(clk, offset);
+        clk->count = 0;
+        clk->poll = NTP_MINPOLL;
+        clk->jitter = precision;
+        set_state(clk, clk->state == NTP_CLK_NSET ? NTP_CLK_FREQ : NTP_CLK_SYNC, 0, now);
+        return CLK_STEP;
+    }
+
+    double diff = fmax(fabs(offset - clk->last), precision);
+    double old_freq = clk->freq;
+
+    clk->jitter = sqrt(clk->jitter * clk->jitter +
+                       (diff * diff - clk->jitter * clk->jitter) / NTP_AVG);
+
+    switch (clk->state) {
+        case NTP_CLK_NSET:
+            // No frequency yet: slew this offset and measure from here
+            set_state(clk, NTP_CLK_FREQ, offset, now);
+            return CLK_SLEW;
+        case NTP_CLK_FSET:
+            // Frequency from the drift file, nothing more to learn first
+            set_state(clk, NTP_CLK_SYNC, offset, now);
+            return CLK_SLEW;
+        case NTP_CLK_FREQ:
+            if (mu < NTP_WATCH) {
+                return CLK_IGNORE;
+            }
+            clk->freq += (offset - clk->offset) / mu;
+            break;
+        default:
+            // FLL, for long poll intervals
+            if (interval > NTP_ALLAN / 2) {
+                double gain = NTP_FLL - clk->poll;
+                if (gain < NTP_AVG) {
+                    gain = NTP_AVG;
+                }
+                clk->freq += (offset - clk->offset) / (fmax(mu, NTP_ALLAN) * gain);
+            }
+            // PLL
+            double dtemp = 4 * NTP_PLL * interval;
+            clk->freq += offset * fmin(mu, interval) / (dtemp * dtemp);
+            break;
+    }
+    clk->freq = freq_from_kernel(freq_to_kernel(clk->base + clk->freq)) - clk->base;
+    set_state(clk, NTP_CLK_SYNC, offset, now);
+
+    double df = clk->freq - old_freq;
+    clk->wander = sqrt(clk->wander * clk->wander + (df * df - clk->wander * clk->wander) / NTP_AVG);
+    poll_adjust(clk, offset);
+    return CLK_SLEW;
+}
+
+static int read_drift(const char* path, double* freq) {
+    FILE* f = fopen(path, "r");
+    double ppm;
+    int ok;
+
+    if (f == NULL) {
+        return -1;
+    }
+    ok = fscanf(f, "%lf", &ppm) == 1 && fabs(ppm) <= NTP_MAXFREQ * 1e6;
+    fclose(f);
+    if (!ok) {
+        return -1;
+    }
+    *freq = ppm / 1e6;
+    return 0;
+}
+
+// Written to a temporary file and renamed, a crash never leaves half a file
+static void write_drift(const char* path, double freq) {
+    char tmp[1024];
+    FILE* f;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    f = fopen(tmp, "w");
+    if (f == NULL) {
+        perror(tmp);
+        return;
+    }
+    fprintf(f, "%.3f\n", freq * 1e6);
+    if (fclose(f) != 0 || rename(tmp, path) < 0) {
+        perror(path);
+        remove(tmp);
+    }
+}
+
+static void sleep_until(double t) {
+    struct timespec ts = { (time_t)t, (long)((t - floor(t)) * 1e9) };
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+/*
+ * Main loop: every second clock_adjust(), every 2^poll seconds a poll of all
+ * servers.  The first poll, and the first after a step, is a burst so the
+ * clock filters are full before their output is used.
+ */
+int run_ntp_daemon(char* const* servers, int nservers, const char* drift_file, int dry_run) {
+    ntp_peer_t peers[NTP_MAX_PEERS];
+    ntp_system_t sys;
+    ntp_clock_t clk;
+    double kernel_freq, drift;
+    int npeers = ntp_resolve_peers(servers, nservers, peers);
+    int rc = 0;
+
+    if (npeers == 0) {
+        return 1;
+    }
+    memset(&clk, 0, sizeof(clk));
+    clk.dry_run = dry_run;
+    clk.poll = NTP_MINPOLL;
+    clk.jitter = ldexp(1.0, NTP_LOCAL_PRECISION);
+    if (clock_init(&clk, &kernel_freq) < 0) {
+        return 1;
+    }
+    if (read_drift(drift_file, &drift) == 0) {
+        clk.freq = drift - clk.base;
+        clk.state = NTP_CLK_FSET;
+        printf("Frequency %.3f ppm from %s\n", drift * 1e6, drift_file);
+    } else {
+        clk.freq = kernel_freq - clk.base;
+        clk.state = NTP_CLK_NSET;
+        printf("No drift file %s, the frequency is measured over the first %d s\n",
+               drift_file, NTP_WATCH);
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    printf("Disciplining the clock with %d server(s)%s, poll %d to %d s\n", npeers,
+           dry_run ? " (dry run, the clock is not changed)" : "",
+           1 << NTP_MINPOLL, 1 << NTP_MAXPOLL);
+
+    double now = ntp_filter_now();
+    double last_adjust = now;
+    double next_poll = now;
+    double last_save = 0;
+    int rounds_left = NTP_BURST_COUNT;
+    double dns_expiry = ntp_resolve_expiry((const char* const*)servers, nservers);
+
+    clock_adjust(&clk, 0);
+    while (!stop) {
+        now = ntp_filter_now();
+        if (now - last_adjust >= 1) {
+            clock_adjust(&clk, now - last_adjust);
+            last_adjust = now;
+        }
+        if (now < next_poll) {
+            sleep_until(fmin(next_poll, last_adjust + 1));
+            continue;
+        }
+
+        int replies = ntp_poll_round(peers, npeers,
+                                     rounds_left > 1 ? NTP_BURST_TIMEOUT_MS : NTP_QUERY_TIMEOUT_MS,
+                                     &sys);
+        now = ntp_filter_now();
+        if (--rounds_left > 0) {
+            next_poll = now + NTP_BURST_GAP_MS / 1000.0;
+            continue;
+        }
+        rounds_left = 1;
+
+        print_time_prefix();
+        if (replies < 0 || sys.sys_peer < 0) {
+            printf("%d of %d servers replied, no estimate\n", replies < 0 ? 0 : replies, npeers);
+            next_poll = now + ldexp(1.0, clk.poll);
+            continue;
+        }
+
+        double offset = sys.offset - clk.virt;
+        int action = local_clock(&clk, offset, now);
+
+        if (action == CLK_PANIC) {
+            printf("offset %+.3f s is over the panic threshold of %d s, giving up\n",
+                   offset, NTP_PANICT);
+            rc = 1;
+            break;
+        }
+        printf("offset %+.6f s  freq %+8.3f ppm  jitter %.6f s  wander %.3f ppm  poll %4d s  %s%s\n",
+               offset, (clk.base + clk.freq) * 1e6, clk.jitter, clk.wander * 1e6,
+               1 << clk.poll, clock_state_name(clk.state),
+               action == CLK_STEP ? "  stepped" : action == CLK_IGNORE ? "  ignored" : "");
+
+        if (action == CLK_STEP) {
+            // Samples from before the step are meaningless now
+            for (int i = 0; i < npeers; i++) {
+                ntp_filter_init(&peers[i].filter);
+            }
+            rounds_left = NTP_BURST_COUNT;
+        } else if (action == CLK_SLEW && clk.state == NTP_CLK_SYNC) {
+            report_sync(&clk, sys.rootdist);
+        }
+        if (clk.state == NTP_CLK_SYNC && (last_save == 0 || now - last_save >= NTP_DRIFT_SAVE)) {
+            write_drift(drift_file, clk.base + clk.freq);
+            last_save = now;
+        }
+        next_poll = now + (rounds_left > 1 ? NTP_BURST_GAP_MS / 1000.0 : ldexp(1.0, clk.poll));
+
+        // Pool names hand out other servers over time, follow them at their TTL
+        if (now >= dns_expiry) {
+            npeers = ntp_refresh_peers(servers, nservers, peers, npeers);
+            dns_expiry = ntp_resolve_expiry((const char* const*)servers, nservers);
+        }
+    }
+
+    // Keep the drift correction, but not a slew nobody will end any more
+    set_frequency(&clk, clk.freq);
+    if (clk.state == NTP_CLK_SYNC) {
+        write_drift(drift_file, clk.base + clk.freq);
+    }
+    printf("\nStopped, frequency %.3f ppm\n", (clk.base + clk.freq) * 1e6);
+    return rc;
+}
@@ -0,0 +1,64 @@
+/*
+ * NTP Daemon Mode and Clock Discipline
+ *
+ * Measuring the offset once tells us how wrong the clock is right now.
+ * Keeping it right means steering it for as long as the machine runs,
+ * which is the job of the clock discipline of RFC 5905 section 11.3 and
+ * appendix A.5.5.6.  In daemon mode (-D) the client:
+ *
+ * 1. Polls every server each 2^poll seconds, through the clock filters
+ *    and the selection algorithms of ntp-select.c.
+ * 2. Feeds the combined offset to a HYBRID PLL/FLL.  The phase-locked
+ *    loop corrects the frequency by offset * time / (4 * PLL * 2^poll)^2,
+ *    which works best at short poll intervals; the frequency-locked loop
+ *    corrects it by the change of offset per second, which works best at
+ *    long ones.  Above NTP_ALLAN / 2 seconds both are used.
+ * 3. Applies the result with adjtimex(): every second the frequency is
+ *    set to the estimated drift plus a small part of the remaining offset,
+ *    so the clock is SLEWED smoothly and never runs backwards.  Offsets
+ *    over NTP_STEPT that persist for NTP_WATCH seconds STEP the clock.
+ * 4. Adapts the poll interval: while the offsets stay within NTP_PGATE
+ *    times the jitter it grows towards NTP_MAXPOLL, otherwise it shrinks
+ *    towards NTP_MINPOLL.
+ *
+ * Without a known frequency the loop first spends NTP_WATCH seconds
+ * measuring it (the FREQ state).  The estimate is therefore written to a
+ * drift file, in ppm like ntpd's, every NTP_DRIFT_SAVE seconds and on
+ * exit, and read back on start so a restart goes straight to SYNC.
+ *
+ * Changing the clock needs CAP_SYS_TIME.  The dry run (-n) only logs what
+ * it would do and keeps the correction it would have made in a virtual
+ * clock, so the loop converges just like the real one would.
+ */
+
+#ifndef NTP_DISCIPLINE_H
+#define NTP_DISCIPLINE_H
+
+// RFC 5905 clock discipline constants
+#define NTP_MINPOLL         4           // 16 s
+#define NTP_MAXPOLL         10          // 1024 s
+#define NTP_STEPT           0.128       // Step threshold (s)
+#define NTP_WATCH           900         // Stepout and frequency interval (s)
+#define NTP_PANICT          1000        // Give up on offsets larger than this (s)
+#define NTP_PLL             65          // PLL loop gain
+#define NTP_FLL             (NTP_MAXPOLL + 1)   // FLL loop gain
+#define NTP_AVG             4           // Averaging constant of jitter and wander
+#define NTP_ALLAN           1500        // Allan intercept (s)
+#define NTP_LIMIT           30          // Poll adjust threshold
+#define NTP_PGATE           4           // Poll adjust gate, in jitters
+#define NTP_MAXFREQ         500e-6      // Frequency tolerance (500 ppm)
+
+#define NTP_DRIFT_FILE      "ntp.drift"
+#define NTP_DRIFT_SAVE      3600        // Write the drift file this often (s)
+
+// Discipline states
+#define NTP_CLK_NSET        0           // Nothing known yet
+#define NTP_CLK_FSET        1           // Frequency from the drift file
+#define NTP_CLK_SPIK        2           // Big offset, waiting out the stepout
+#define NTP_CLK_FREQ        3           // Measuring the frequency
+#define NTP_CLK_SYNC        4           // Normal operation
+
+// Poll servers and steer the clock until SIGINT or SIGTERM
+int run_ntp_daemon(char* const* servers, int nservers, const char* drift_file, int dry_run);
+
+#endif
@@ -0,0 +1,70 @@
+/*
+ * NTP Clock Filter - see ntp-filter.h and RFC 5905 appendix A.5.2
+ */
+
+#define _GNU_SOURCE                     // clock_gettime() with -std=c99
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "ntp-filter.h"
+#include "ntp-select.h"
+
+void ntp_filter_init(ntp_filter_t* filter) {
+    memset(filter, 0, sizeof(*filter));
+    for (int i = 0; i < NTP_FILTER_STAGES; i++) {
+        filter->stages[i].delay = ntp_fixed_from_double(NTP_MAXDISP);
+        filter->stages[i].disp = NTP_MAXDISP;
+    }
+}
+
+double ntp_filter_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void ntp_filter_add(ntp_filter_t* filter, ntp_fixed_t offset, ntp_fixed_t delay, double disp, double t) {
+    ntp_fsample_t* f = filter->stages;
+    double age = filter->count > 0 ? t - filter->last_t : 0;
+    int order[NTP_FILTER_STAGES];
+
+    // Shift the register, older samples grow less certain with age
+    for (int i = NTP_FILTER_STAGES - 1; i > 0; i--) {
+        f[i] = f[i - 1];
+        if (f[i].disp < NTP_MAXDISP) {
+            f[i].disp += NTP_PHI * age;
+        }
+    }
+    f[0] = (ntp_fsample_t){ offset, delay, disp, t };
+    filter->last_t = t;
+    if (filter->count < NTP_FILTER_STAGES) {
+        filter->count++;
+    }
+
+    // Stage indexes by increasing delay, empty stages sort last
+    for (int i = 0; i < NTP_FILTER_STAGES; i++) {
+        int j = i;
+        while (j > 0 && f[order[j - 1]].delay > f[i].delay) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+
+    filter->offset = f[order[0]].offset;
+    filter->delay = f[order[0]].delay;
+
+    double d = 0, j = 0;
+    for (int i = NTP_FILTER_STAGES - 1; i >= 0; i--) {
+        d = (d + f[order[i]].disp) / 2;
+    }
+    for (int i = 1; i < filter->count; i++) {
+        double diff = ntp_fixed_to_double(f[order[i]].offset - filter->offset);
+        j += diff * diff;
+    }
+    filter->disp = d;
+    filter->jitter = filter->count > 1 ? sqrt(j / (filter->count - 1)) : 0;
+    if (filter->jitter < ldexp(1.0, NTP_LOCAL_PRECISION)) {
+        filter->jitter = ldexp(1.0, NTP_LOCAL_PRECISION);
+    }
+}
@@ -0,0 +1,60 @@
+/*
+ * NTP Clock Filter and Burst Mode
+ *
+ * One exchange gives one sample of offset and delay, and a sample is only
+ * as good as the queues its packets sat in.  The clock filter of RFC 5905
+ * section 10 keeps the last NTP_FILTER_STAGES samples of a server and
+ * trusts the one with the LOWEST DELAY: a packet that waited less had less
+ * chance to be delayed more in one direction than the other, so its offset
+ * is the most accurate.
+ *
+ * From the register the filter also derives:
+ * - Dispersion: the sample dispersions, grown by NTP_PHI per second of
+ *   age, weighted 1/2, 1/4, 1/8... in delay order
+ * - Jitter: the RMS of the differences between the chosen offset and the
+ *   offsets of the other samples
+ *
+ * Burst mode (-i, like the iburst option of ntpd) fills the register right
+ * away, NTP_BURST_COUNT exchanges NTP_BURST_GAP_MS apart, instead of one
+ * exchange per poll interval.
+ */
+
+#ifndef NTP_FILTER_H
+#define NTP_FILTER_H
+
+#include "ntp-fixed.h"
+
+#define NTP_FILTER_STAGES   8           // Samples kept per server
+#define NTP_MAXDISP         16.0        // Dispersion of an empty stage (s)
+#define NTP_BURST_COUNT     8           // Exchanges per server in a burst
+#define NTP_BURST_GAP_MS    100         // Between the exchanges of a burst
+#define NTP_BURST_TIMEOUT_MS 500        // Wait for the replies of one round
+
+typedef struct {
+    ntp_fixed_t offset;                 // Exact, as measured
+    ntp_fixed_t delay;
+    double disp;                        // Seconds
+    double t;                           // When it was taken, monotonic seconds
+} ntp_fsample_t;
+
+typedef struct {
+    ntp_fsample_t stages[NTP_FILTER_STAGES];    // Newest first
+    int count;                          // Real samples in the register
+    double last_t;
+    // Filter output, valid once count > 0
+    ntp_fixed_t offset;
+    ntp_fixed_t delay;
+    double disp;
+    double jitter;
+} ntp_filter_t;
+
+// Empty register, every stage at NTP_MAXDISP
+void ntp_filter_init(ntp_filter_t* filter);
+
+// Shift in a sample taken at t (monotonic seconds) and recompute the output
+void ntp_filter_add(ntp_filter_t* filter, ntp_fixed_t offset, ntp_fixed_t delay, double disp, double t);
+
+// Monotonic seconds, for the t of ntp_filter_add()
+double ntp_filter_now(void);
+
+#endif
@@ -0,0 +1,104 @@
+/*
+ * Fixed-Point NTP Time Arithmetic
+ *
+ * Converting a timestamp to a double, as ntp_time_to_double() does, keeps
+ * 53 bits: about 3.9 billion seconds use 32 of them, leaving a resolution
+ * of roughly half a microsecond for the fraction.  Subtracting two such
+ * doubles can not give back what was lost.  Instead, these helpers treat
+ * a timestamp as the 64-bit number it is on the wire and subtract in
+ * integers, the difference is a signed 32.32 fixed-point number of seconds
+ * (ntp_fixed_t) that is exact to 2^-32 s, about 233 picoseconds.
+ *
+ * ERAS: the 32-bit seconds field wraps around on 2036-02-07, the start of
+ * NTP era 1.  Differences are taken modulo 2^64 and read as signed, so they
+ * are right across the wrap as long as the two times are less than 68
+ * years apart (RFC 5905 section 6), without looking at the era at all.
+ * To turn a timestamp back into an absolute time, ntp_ts_to_unix_ns() picks
+ * the era that puts it closest to a pivot such as the current time.
+ *
+ * Everything is integer and branch free, cheap enough to run per packet.
+ */
+
+#ifndef NTP_FIXED_H
+#define NTP_FIXED_H
+
+#include <stdint.h>
+#include "ntp-protocol.h"
+
+typedef int64_t ntp_fixed_t;            // Signed seconds, 32.32
+
+#define NTP_FIXED_ONE       ((ntp_fixed_t)1 << 32)
+#define NSEC_PER_SEC        1000000000LL
+
+// Timestamp (host byte order) as one 64-bit number
+static inline uint64_t ntp_ts_to_u64(const ntp_timestamp_t* ts) {
+    return ((uint64_t)ts->seconds << 32) | ts->fraction;
+}
+
+static inline void ntp_u64_to_ts(uint64_t v, ntp_timestamp_t* ts) {
+    ts->seconds = (uint32_t)(v >> 32);
+    ts->fraction = (uint32_t)v;
+}
+
+// a - b, correct across an era boundary for times less than 68 years apart
+static inline ntp_fixed_t ntp_ts_diff(const ntp_timestamp_t* a, const ntp_timestamp_t* b) {
+    return (ntp_fixed_t)(ntp_ts_to_u64(a) - ntp_ts_to_u64(b));
+}
+
+// (a + b) / 2 rounded down, without overflowing for any a and b
+static inline ntp_fixed_t ntp_fixed_avg(ntp_fixed_t a, ntp_fixed_t b) {
+    return (a >> 1) + (b >> 1) + (a & b & 1);
+}
+
+/*
+ * The four-timestamp algorithm in fixed point:
+ *   offset = ((T2 - T1) + (T3 - T4)) / 2
+ *   delay  = (T4 - T1) - (T3 - T2)
+ */
+static inline void ntp_fixed_offset_delay(const ntp_timestamp_t* t1, const ntp_timestamp_t* t2,
+                                          const ntp_timestamp_t* t3, const ntp_timestamp_t* t4,
+                                          ntp_fixed_t* offset, ntp_fixed_t* delay) {
+    *offset = ntp_fixed_avg(ntp_ts_diff(t2, t1), ntp_ts_diff(t3, t4));
+    *delay = ntp_ts_diff(t4, t1) - ntp_ts_diff(t3, t2);
+}
+
+// Whole seconds and the fraction are scaled apart so nothing overflows
+static inline int64_t ntp_fixed_to_ns(ntp_fixed_t f) {
+    return (f >> 32) * NSEC_PER_SEC + (int64_t)(((f & 0xffffffffLL) * NSEC_PER_SEC) >> 32);
+}
+
+static inline ntp_fixed_t ntp_fixed_from_ns(int64_t ns) {
+    int64_t sec = ns / NSEC_PER_SEC;
+    int64_t rem = ns % NSEC_PER_SEC;
+
+    // Keep the remainder positive so the fraction scales the right way,
+    // rounded up so that ntp_fixed_to_ns() gives back the same nanosecond
+    sec -= rem < 0;
+    rem += (rem < 0) * NSEC_PER_SEC;
+    return (ntp_fixed_t)((uint64_t)sec << 32) +
+           (ntp_fixed_t)((((uint64_t)rem << 32) + NSEC_PER_SEC - 1) / NSEC_PER_SEC);
+}
+
+// For display and for the statistics of the selection algorithms only
+static inline double ntp_fixed_to_double(ntp_fixed_t f) {
+    return (double)f / NTP_FIXED_ONE;
+}
+
+static inline ntp_fixed_t ntp_fixed_from_double(double d) {
+    return (ntp_fixed_t)(d * NTP_FIXED_ONE);
+}
+
+// Unix time in nanoseconds to a timestamp, the era is dropped on the wire
+static inline void ntp_ts_from_unix_ns(int64_t unix_ns, ntp_timestamp_t* ts) {
+    ntp_u64_to_ts((uint64_t)ntp_fixed_from_ns(unix_ns) + ((uint64_t)NTP_EPOCH_OFFSET << 32), ts);
+}
+
+// Unix time in nanoseconds of a timestamp, in the era closest to pivot_ns
+static inline int64_t ntp_ts_to_unix_ns(const ntp_timestamp_t* ts, int64_t pivot_ns) {
+    ntp_timestamp_t pivot;
+
+    ntp_ts_from_unix_ns(pivot_ns, &pivot);
+    return pivot_ns + ntp_fixed_to_ns(ntp_ts_diff(ts, &pivot));
+}
+
+#endif
@@ -0,0 +1,382 @@
+/*
+ * NTP Load Generator - see ntp-loadgen.h
+ */
+
+#define _GNU_SOURCE                     // sendmmsg(), recvmmsg() with -std=c99
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "ntp-loadgen.h"
+#include "ntp-fixed.h"
+#include "ntp-rxtime.h"
+#include "ntp-resolve.h"
+
+#define HDR_HALF            (1 << (NTP_HDR_SUB_BITS - 1))
+#define HDR_BUCKETS         ((NTP_HDR_MAX_BITS - NTP_HDR_SUB_BITS + 2) * HDR_HALF)
+#define LOAD_SLOTS          (1u << NTP_LOAD_SEQ_BITS)
+#define LOAD_SEQ_MASK       (LOAD_SLOTS - 1)
+
+typedef struct {
+    uint64_t counts[HDR_BUCKETS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+} hdr_histogram_t;
+
+// One request in flight, found again by the low bits of its timestamp
+typedef struct {
+    uint64_t key;                       // Transmit timestamp as sent, 0 if free
+    uint64_t sent;                      // When it went to sendmmsg(), NTP format,
+                                        // only changed while key is 0
+} load_slot_t;
+
+typedef struct {
+    int epfd;
+    load_slot_t* slots;
+    hdr_histogram_t* hist;
+    int done;
+    uint64_t received;                  // Matched replies
+    uint64_t unmatched;                 // Late, duplicate or not ours
+} loadgen_t;
+
+/*
+ * Values below 2^NTP_HDR_SUB_BITS get a bucket each.  Above, a value with
+ * its top bit at position e + NTP_HDR_SUB_BITS - 1 keeps its top
+ * NTP_HDR_SUB_BITS bits and lands in the e-th group of HDR_HALF buckets.
+ */
+static int hdr_index(uint64_t v) {
+    if (v >= (1ULL << NTP_HDR_MAX_BITS)) {
+        v = (1ULL << NTP_HDR_MAX_BITS) - 1;
+    }
+    if (v < 2 * HDR_HALF) {
+        return (int)v;
+    }
+    int e = 63 - __builtin_clzll(v) - (NTP_HDR_SUB_BITS - 1);
+    return e * HDR_HALF + (int)(v >> e);
+}
+
+// Smallest value counted in bucket i
+static uint64_t hdr_value(int i) {
+    if (i < 2 * HDR_HALF) {
+        return i;
+    }
+    int e = i / HDR_HALF - 1;
+    return (uint64_t)(i - e * HDR_HALF) << e;
+}
+
+static void hdr_record(hdr_histogram_t* h, uint64_t v) {
+    h->counts[hdr_index(v)]++;
+    if (h->total == 0 || v < h->min) {
+        h->min = v;
+    }
+    if (v > h->max) {
+        h->max = v;
+    }
+    h->total++;
+}
+
+// Largest value that is still within the p-th percentile
+static uint64_t hdr_percentile(const hdr_histogram_t* h, double p) {
+    uint64_t target = (uint64_t)ceil(p / 100 * h->total);
+    uint64_t seen = 0;
+
+    if (target == 0) {
+        target = 1;
+    }
+    for (int i = 0; i < HDR_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= target) {
+            uint64_t v = hdr_value(i + 1) - 1;
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+static uint64_t now_ntp64(void) {
+    struct timespec ts;
+    ntp_timestamp_t ntp;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    timespec_to_ntp(&ts, &ntp);
+    return ntp_ts_to_u64(&ntp);
+}
+
+static double mono_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void match_reply(loadgen_t* lg, ntp_packet_t* reply, size_t len, struct msghdr* msg) {
+    ntp_timestamp_t recv_time, sent_time;
+
+    if (len < sizeof(ntp_packet_t)) {
+        lg->unmatched++;
+        return;
+    }
+    ntp_rx_timestamp(msg, &recv_time);
+    ntp_to_host(reply);
+
+    uint64_t key = ntp_ts_to_u64(&reply->orig_time);
+    load_slot_t* slot = &lg->slots[key & LOAD_SEQ_MASK];
+    uint64_t expect = key;
+    uint64_t sent;
+
+    // The send time is read before the slot is claimed: after a sequence
+    // wrap the sender may be refilling the slot, and the claim only
+    // succeeds if the key did not change, so the time belongs to it.
+    // Claiming also makes sure a duplicate reply is not counted twice.
+    if (key == 0 || GET_NTP_MODE(reply) != NTP_MODE_SERVER ||
+        __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE) != key) {
+        lg->unmatched++;
+        return;
+    }
+    sent = __atomic_load_n(&slot->sent, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (!__atomic_compare_exchange_n(&slot->key, &expect, 0, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        lg->unmatched++;
+        return;
+    }
+    ntp_u64_to_ts(sent, &sent_time);
+
+    ntp_fixed_t rtt = ntp_ts_diff(&recv_time, &sent_time);
+    hdr_record(lg->hist, rtt > 0 ? (uint64_t)ntp_fixed_to_ns(rtt) : 0);
+    __atomic_store_n(&lg->received, lg->received + 1, __ATOMIC_RELAXED);
+}
+
+// Drains every socket that has replies, until the sender says it is done
+static void* receiver_thread(void* arg) {
+    loadgen_t* lg = arg;
+    ntp_packet_t replies[NTP_LOAD_BATCH];
+    char control[NTP_LOAD_BATCH][NTP_RXTS_CONTROL_LEN];
+    struct iovec iov[NTP_LOAD_BATCH];
+    struct mmsghdr msgs[NTP_LOAD_BATCH];
+    struct epoll_event events[NTP_LOAD_BATCH];
+
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < NTP_LOAD_BATCH; i++) {
+        iov[i] = (struct iovec){ &replies[i], sizeof(replies[i]) };
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = control[i];
+    }
+
+    while (!__atomic_load_n(&lg->done, __ATOMIC_ACQUIRE)) {
+        int nev = epoll_wait(lg->epfd, events, NTP_LOAD_BATCH, 100);
+        for (int e = 0; e < nev; e++) {
+            int n;
+            do {
+                for (int i = 0; i < NTP_LOAD_BATCH; i++) {
+                    msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+                }
+                n = recvmmsg(events[e].data.fd, msgs, NTP_LOAD_BATCH, MSG_DONTWAIT, NULL);
+                for (int i = 0; i < n; i++) {
+                    match_reply(lg, &replies[i], msgs[i].msg_len, &msgs[i].msg_hdr);
+                }
+            } while (n == NTP_LOAD_BATCH);
+        }
+    }
+    return NULL;
+}
+
+static int open_load_socket(const struct sockaddr_storage* server, int epfd) {
+    int rcvbuf = 1 << 20;
+    int sockfd = socket(server->ss_family, SOCK_DGRAM, 0);
+
+    if (sockfd < 0) {
+        perror("socket");
+        return -1;
+    }
+    // Connected, so each socket only sees replies from the server under test
+    if (connect(sockfd, (const struct sockaddr*)server, ntp_addr_len(server)) < 0) {
+        perror("connect");
+        close(sockfd);
+        return -1;
+    }
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    enable_rx_timestamps(sockfd);
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = sockfd };
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev) < 0) {
+        perror("epoll_ctl");
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+static void print_load_report(const loadgen_t* lg, const char* server, int port, long rate,
+                              uint64_t sent, uint64_t send_errors, double elapsed) {
+    const hdr_histogram_t* h = lg->hist;
+    uint64_t lost = sent > lg->received ? sent - lg->received : 0;
+
+    printf("\n=== Load Test: %s port %d ===\n", server, port);
+    printf("Sent:        %llu requests in %.2f s, %.0f req/s (target %ld)\n",
+           (unsigned long long)sent, elapsed, sent / elapsed, rate);
+    printf("Received:    %llu replies, %.0f req/s\n",
+           (unsigned long long)lg->received, lg->received / elapsed);
+    printf("Lost:        %llu (%.3f%%)\n", (unsigned long long)lost,
+           sent > 0 ? 100.0 * lost / sent : 0.0);
+    printf("Unmatched:   %llu\n", (unsigned long long)lg->unmatched);
+    printf("Send errors: %llu\n", (unsigned long long)send_errors);
+    if (h->total == 0) {
+        return;
+    }
+    printf("Round trip (us): min %.1f  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+           h->min / 1e3, hdr_percentile(h, 50) / 1e3, hdr_percentile(h, 90) / 1e3,
+           hdr_percentile(h, 99) / 1e3, hdr_percentile(h, 99.9) / 1e3, h->max / 1e3);
+}
+
+int run_ntp_loadgen(const char* server, int port, long rate, int seconds, int nsockets) {
+    char ip_str[NTP_ADDRSTRLEN];
+    ntp_dns_result_t dns;
+    struct sockaddr_storage addr;
+    loadgen_t lg;
+    pthread_t receiver;
+    int* sockets;
+    int rc = 1;
+
+    if (rate <= 0 || seconds <= 0 || nsockets <= 0) {
+        fprintf(stderr, "Load mode needs a positive rate, duration and socket count\n");
+        return 1;
+    }
+    // The first address, IPv6 if there is one: a race would go to port 123
+    if (ntp_resolve_names(&server, 1, &dns, NTP_DNS_TIMEOUT_MS) == 0) {
+        fprintf(stderr, "Failed to resolve hostname: %s\n", server);
+        return 1;
+    }
+    addr = dns.addrs[0];
+    ntp_addr_set_port(&addr, port);
+    ntp_addr_str(&addr, ip_str, sizeof(ip_str));
+
+    memset(&lg, 0, sizeof(lg));
+    lg.slots = calloc(LOAD_SLOTS, sizeof(*lg.slots));
+    lg.hist = calloc(1, sizeof(*lg.hist));
+    sockets = calloc(nsockets, sizeof(*sockets));
+    lg.epfd = epoll_create1(0);
+    if (lg.slots == NULL || lg.hist == NULL || sockets == NULL || lg.epfd < 0) {
+        perror("load generator setup");
+        nsockets = 0;
+        goto out;
+    }
+    for (int i = 0; i < nsockets; i++) {
+        sockets[i] = open_load_socket(&addr, lg.epfd);
+        if (sockets[i] < 0) {
+            nsockets = i;
+            goto out;
+        }
+    }
+    if (pthread_create(&receiver, NULL, receiver_thread, &lg) != 0) {
+        perror("pthread_create");
+        goto out;
+    }
+
+    // About one batch per millisecond, a single request at low rates
+    int batch = rate / 1000;
+    batch = batch < 1 ? 1 : batch > NTP_LOAD_BATCH ? NTP_LOAD_BATCH : batch;
+    printf("Sending %ld requests/s to %s (%s) port %d for %d s from %d sockets\n",
+           rate, server, ip_str, port, seconds, nsockets);
+
+    ntp_packet_t requests[NTP_LOAD_BATCH];
+    struct iovec iov[NTP_LOAD_BATCH];
+    struct mmsghdr msgs[NTP_LOAD_BATCH];
+    uint64_t keys[NTP_LOAD_BATCH];
+    uint64_t total = (uint64_t)rate * seconds;
+    uint64_t sent = 0, send_errors = 0, seq = 0, last_sent = 0, last_received = 0;
+    double start = mono_now();
+    double next_report = start + 1;
+    int next_socket = 0;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < NTP_LOAD_BATCH; i++) {
+        iov[i] = (struct iovec){ &requests[i], sizeof(requests[i]) };
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while (sent + send_errors < total) {
+        // Open loop: the schedule does not wait for a slow server
+        double due = start + (double)(sent + send_errors) / rate;
+        double now = mono_now();
+        if (now < due) {
+            struct timespec ts = { (time_t)due, (long)((due - floor(due)) * 1e9) };
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        }
+
+        int n = total - sent - send_errors < (uint64_t)batch ? (int)(total - sent - send_errors) : batch;
+        for (int i = 0; i < n; i++) {
+            build_ntp_request(&requests[i]);
+            seq = (seq + 1) & LOAD_SEQ_MASK;
+            requests[i].xmit_time.fraction = (requests[i].xmit_time.fraction & ~LOAD_SEQ_MASK) | seq;
+            keys[i] = ntp_ts_to_u64(&requests[i].xmit_time);
+            ntp_to_net(&requests[i]);
+        }
+        uint64_t sent_at = now_ntp64();
+        for (int i = 0; i < n; i++) {
+            load_slot_t* slot = &lg.slots[keys[i] & LOAD_SEQ_MASK];
+            // Free the slot before its send time changes, see match_reply()
+            __atomic_store_n(&slot->key, 0, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            __atomic_store_n(&slot->sent, sent_at, __ATOMIC_RELAXED);
+            __atomic_store_n(&slot->key, keys[i], __ATOMIC_RELEASE);
+        }
+
+        int sockfd = sockets[next_socket];
+        next_socket = (next_socket + 1) % nsockets;
+        for (int done = 0; done < n; ) {
+            int r = sendmmsg(sockfd, msgs + done, n - done, 0);
+            if (r < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                // ECONNREFUSED: an ICMP error of an earlier request
+                send_errors += n - done;
+                break;
+            }
+            done += r;
+            sent += r;
+        }
+
+        now = mono_now();
+        if (now >= next_report) {
+            uint64_t received = __atomic_load_n(&lg.received, __ATOMIC_RELAXED);
+            printf("%4.0f s  sent %8llu/s  received %8llu/s\n", next_report - start,
+                   (unsigned long long)(sent - last_sent),
+                   (unsigned long long)(received - last_received));
+            last_sent = sent;
+            last_received = received;
+            next_report += 1;
+        }
+    }
+    double elapsed = mono_now() - start;
+
+    struct timespec drain = { NTP_LOAD_DRAIN_MS / 1000, (NTP_LOAD_DRAIN_MS % 1000) * 1000000L };
+    nanosleep(&drain, NULL);
+    __atomic_store_n(&lg.done, 1, __ATOMIC_RELEASE);
+    pthread_join(receiver, NULL);
+
+    print_load_report(&lg, server, port, rate, sent, send_errors, elapsed);
+    rc = 0;
+
+out:
+    for (int i = 0; i < nsockets; i++) {
+        close(sockets[i]);
+    }
+    if (lg.epfd >= 0) {
+        close(lg.epfd);
+    }
+    free(sockets);
+    free(lg.hist);
+    free(lg.slots);
+    return rc;
+}
@@ -0,0 +1,43 @@
+/*
+ * NTP Load Generator and Latency Benchmark
+ *
+ * To plan the capacity of a server we need to know how many requests per
+ * second it answers, how many it drops, and how the response time grows
+ * with load.  Load mode (-L rate) sends build_ntp_request() packets at a
+ * fixed rate for -T seconds and measures exactly that:
+ *
+ * - Requests leave in sendmmsg() batches, paced against the clock, from
+ *   -N sockets, so from as many source ports and spread over as many
+ *   receive queues and server threads as a real client population would.
+ * - Each request carries a sequence number in the low NTP_LOAD_SEQ_BITS
+ *   of its transmit timestamp, about 244 microseconds worth of bits no
+ *   server looks at.  The server echoes it as the origin timestamp, which
+ *   points straight at the slot remembering when it was sent; the whole
+ *   timestamp must match, so late or forged replies are not counted.
+ * - The round trip is the kernel receive stamp of the reply minus the
+ *   time the request was handed to sendmmsg(), in fixed point.
+ * - Round trips go into an HDR histogram: buckets double in width every
+ *   2^(NTP_HDR_SUB_BITS - 1) buckets, so every value from nanoseconds to
+ *   minutes is kept to about 0.1%, in constant memory and O(1) per value.
+ *
+ * The report gives the achieved rate, the loss, and min/p50/p90/p99/p99.9/
+ * max round trip.  Use it against a stand-in such as the -S mode of this
+ * client on another port.
+ */
+
+#ifndef NTP_LOADGEN_H
+#define NTP_LOADGEN_H
+
+#define NTP_LOAD_SOCKETS    64          // Source ports, default of -N
+#define NTP_LOAD_SECONDS    10          // Default of -T
+#define NTP_LOAD_BATCH      64          // Requests per sendmmsg()
+#define NTP_LOAD_SEQ_BITS   20          // Requests in flight that can be matched
+#define NTP_LOAD_DRAIN_MS   1000        // Wait for late replies after the last send
+#define NTP_HDR_SUB_BITS    11          // HDR precision, 2^-10 relative
+#define NTP_HDR_MAX_BITS    40          // Largest value about 2^40 ns, 18 minutes
+
+// Send rate requests per second to server:port for seconds over nsockets
+// sockets and print throughput, loss and the round trip percentiles
+int run_ntp_loadgen(const char* server, int port, long rate, int seconds, int nsockets);
+
+#endif
@@ -436,7 +436,7 @@ void demonstrate_epoch_conversion(void);
 void usage(const char* progname);
 int resolve_hostname(const char* hostname, char* ip_str);
 int create_udp_socket();
-int send_ntp_request(int sockfd, const struct sockaddr_in* server_addr, 
+int send_ntp_request(int sockfd, const struct sockaddr_storage* server_addr, 
                     const ntp_packet_t* packet);
 int recv_ntp_response(int sockfd, ntp_packet_t* packet);
 int query_ntp_server(const char* server_name, const char* ip_str);
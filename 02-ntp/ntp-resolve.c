@@ -0,0 +1,477 @@
+/*
+ * Parallel DNS Resolution - see ntp-resolve.h
+ */
+
+#define _GNU_SOURCE                     // res_nsearch(), getaddrinfo() with -std=c99
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+#include "ntp-resolve.h"
+#include "ntp-filter.h"
+
+typedef struct {
+    char name[NS_MAXDNAME];
+    ntp_dns_result_t result;
+} dns_cache_entry_t;
+
+// One lookup, shared by the caller and the thread doing it
+typedef struct {
+    char name[NS_MAXDNAME];
+    ntp_dns_result_t result;
+    int done;
+    int abandoned;                      // Caller timed out, the thread frees it
+} dns_job_t;
+
+static dns_cache_entry_t cache[NTP_DNS_CACHE_SIZE];
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_done = PTHREAD_COND_INITIALIZER;
+
+// Unmap ::ffff:a.b.c.d, what a dual-stack socket reports for IPv4 peers
+static void unmap(const struct sockaddr_storage* in, struct sockaddr_storage* out) {
+    const struct sockaddr_in6* sin6 = (const struct sockaddr_in6*)in;
+
+    *out = *in;
+    if (in->ss_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+        struct sockaddr_in* sin = (struct sockaddr_in*)out;
+        in_port_t port = sin6->sin6_port;
+
+        memset(out, 0, sizeof(*out));
+        sin->sin_family = AF_INET;
+        sin->sin_port = port;
+        memcpy(&sin->sin_addr, &sin6->sin6_addr.s6_addr[12], sizeof(sin->sin_addr));
+    }
+}
+
+socklen_t ntp_addr_len(const struct sockaddr_storage* addr) {
+    return addr->ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
+int ntp_addr_equal(const struct sockaddr_storage* a, const struct sockaddr_storage* b) {
+    struct sockaddr_storage x, y;
+
+    unmap(a, &x);
+    unmap(b, &y);
+    if (x.ss_family != y.ss_family) {
+        return 0;
+    }
+    if (x.ss_family == AF_INET) {
+        const struct sockaddr_in* p = (const struct sockaddr_in*)&x;
+        const struct sockaddr_in* q = (const struct sockaddr_in*)&y;
+        return p->sin_addr.s_addr == q->sin_addr.s_addr && p->sin_port == q->sin_port;
+    }
+    if (x.ss_family == AF_INET6) {
+        const struct sockaddr_in6* p = (const struct sockaddr_in6*)&x;
+        const struct sockaddr_in6* q = (const struct sockaddr_in6*)&y;
+        return IN6_ARE_ADDR_EQUAL(&p->sin6_addr, &q->sin6_addr) &&
+               p->sin6_port == q->sin6_port && p->sin6_scope_id == q->sin6_scope_id;
+    }
+    return 0;
+}
+
+void ntp_addr_set_port(struct sockaddr_storage* addr, int port) {
+    if (addr->ss_family == AF_INET) {
+        ((struct sockaddr_in*)addr)->sin_port = htons(port);
+    } else if (addr->ss_family == AF_INET6) {
+        ((struct sockaddr_in6*)addr)->sin6_port = htons(port);
+    }
+}
+
+const char* ntp_addr_str(const struct sockaddr_storage* addr, char* buf, size_t len) {
+    struct sockaddr_storage plain;
+
+    unmap(addr, &plain);
+    if (getnameinfo((const struct sockaddr*)&plain, ntp_addr_len(&plain), buf, len, NULL, 0,
+                    NI_NUMERICHOST) != 0) {
+        snprintf(buf, len, "?");
+    }
+    return buf;
+}
+
+int ntp_addr_parse(const char* ip_str, int port, struct sockaddr_storage* addr) {
+    struct addrinfo hints, *list;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_NUMERICHOST;
+    if (getaddrinfo(ip_str, NULL, &hints, &list) != 0) {
+        return -1;
+    }
+    memset(addr, 0, sizeof(*addr));
+    memcpy(addr, list->ai_addr, list->ai_addrlen);
+    freeaddrinfo(list);
+    ntp_addr_set_port(addr, port);
+    return 0;
+}
+
+void ntp_addr_for_socket(int sockfd, const struct sockaddr_storage* addr,
+                         struct sockaddr_storage* out) {
+    int domain = AF_UNSPEC;
+    socklen_t len = sizeof(domain);
+    const struct sockaddr_in* sin = (const struct sockaddr_in*)addr;
+
+    *out = *addr;
+    if (addr->ss_family != AF_INET || getsockopt(sockfd, SOL_SOCKET, SO_DOMAIN, &domain, &len) < 0 ||
+        domain != AF_INET6) {
+        return;
+    }
+    struct sockaddr_in6* sin6 = (struct sockaddr_in6*)out;
+    memset(out, 0, sizeof(*out));
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = sin->sin_port;
+    sin6->sin6_addr.s6_addr[10] = 0xff;
+    sin6->sin6_addr.s6_addr[11] = 0xff;
+    memcpy(&sin6->sin6_addr.s6_addr[12], &sin->sin_addr, sizeof(sin->sin_addr));
+}
+
+static void add_sockaddr(ntp_dns_result_t* res, const struct sockaddr* sa) {
+    struct sockaddr_storage ss;
+
+    memset(&ss, 0, sizeof(ss));
+    if (sa->sa_family == AF_INET) {
+        memcpy(&ss, sa, sizeof(struct sockaddr_in));
+    } else if (sa->sa_family == AF_INET6) {
+        memcpy(&ss, sa, sizeof(struct sockaddr_in6));
+    } else {
+        return;
+    }
+    ntp_addr_set_port(&ss, 0);
+    for (int i = 0; i < res->count; i++) {
+        if (ntp_addr_equal(&res->addrs[i], &ss)) {
+            return;
+        }
+    }
+    if (res->count < NTP_DNS_MAX_ADDRS) {
+        res->addrs[res->count++] = ss;
+    }
+}
+
+// An address record, 4 or 16 bytes
+static void add_addr(ntp_dns_result_t* res, int family, const void* addr) {
+    struct sockaddr_storage ss;
+
+    memset(&ss, 0, sizeof(ss));
+    ss.ss_family = family;
+    if (family == AF_INET) {
+        memcpy(&((struct sockaddr_in*)&ss)->sin_addr, addr, sizeof(struct in_addr));
+    } else {
+        memcpy(&((struct sockaddr_in6*)&ss)->sin6_addr, addr, sizeof(struct in6_addr));
+    }
+    add_sockaddr(res, (struct sockaddr*)&ss);
+}
+
+// Every address getaddrinfo() knows for name, numeric ones included
+static int add_addrinfo(ntp_dns_result_t* res, const char* name, int flags) {
+    struct addrinfo hints, *list;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = flags;
+    if (getaddrinfo(name, NULL, &hints, &list) != 0) {
+        return 0;
+    }
+    for (struct addrinfo* ai = list; ai != NULL; ai = ai->ai_next) {
+        add_sockaddr(res, ai->ai_addr);
+    }
+    freeaddrinfo(list);
+    return res->count;
+}
+
+// Literal addresses need no lookup and never expire, fe80::1%eth0 included
+static int parse_numeric(const char* name, ntp_dns_result_t* res) {
+    if (add_addrinfo(res, name, AI_NUMERICHOST) == 0) {
+        return 0;
+    }
+    res->expires = INFINITY;
+    return 1;
+}
+
+// The addresses of one record type, ttl lowered to the smallest TTL seen
+// on the way, CNAMEs included
+static void query_records(res_state st, const char* name, int type, ntp_dns_result_t* res,
+                          uint32_t* ttl) {
+    unsigned char answer[NS_PACKETSZ * 4];
+    ns_msg msg;
+    ns_rr rr;
+    int len = res_nsearch(st, name, ns_c_in, type, answer, sizeof(answer));
+
+    if (len < 0 || ns_initparse(answer, len, &msg) < 0) {
+        return;
+    }
+    for (int i = 0; i < ns_msg_count(msg, ns_s_an); i++) {
+        if (ns_parserr(&msg, ns_s_an, i, &rr) < 0) {
+            continue;
+        }
+        if (ns_rr_ttl(rr) < *ttl) {
+            *ttl = ns_rr_ttl(rr);
+        }
+        if (ns_rr_type(rr) == ns_t_a && ns_rr_rdlen(rr) == 4) {
+            add_addr(res, AF_INET, ns_rr_rdata(rr));
+        } else if (ns_rr_type(rr) == ns_t_aaaa && ns_rr_rdlen(rr) == 16) {
+            add_addr(res, AF_INET6, ns_rr_rdata(rr));
+        }
+    }
+}
+
+// One record type of a TTL lookup, run next to getaddrinfo()
+typedef struct {
+    const char* name;
+    int type;
+    ntp_dns_result_t result;
+    uint32_t ttl;
+} dns_query_t;
+
+static void* query_thread(void* arg) {
+    dns_query_t* q = arg;
+    struct __res_state st;
+
+    memset(&st, 0, sizeof(st));
+    if (res_ninit(&st) != 0) {
+        return NULL;
+    }
+    // Only the TTL waits for it, keep that short for names DNS does not know
+    st.retrans = 1;
+    st.retry = 1;
+    query_records(&st, q->name, q->type, &q->result, &q->ttl);
+    res_nclose(&st);
+    return NULL;
+}
+
+// IPv6 first, then the families take turns (RFC 8305 section 4), so the
+// first addresses tried cover both
+static void interleave(ntp_dns_result_t* res) {
+    ntp_dns_result_t out;
+    int i = 0, j = 0;
+
+    memset(&out, 0, sizeof(out));
+    while (out.count < res->count) {
+        while (i < res->count && res->addrs[i].ss_family != AF_INET6) {
+            i++;
+        }
+        if (i < res->count) {
+            out.addrs[out.count++] = res->addrs[i++];
+        }
+        while (j < res->count && res->addrs[j].ss_family == AF_INET6) {
+            j++;
+        }
+        if (j < res->count) {
+            out.addrs[out.count++] = res->addrs[j++];
+        }
+    }
+    memcpy(res->addrs, out.addrs, sizeof(out.addrs));
+}
+
+// Whether DNS returned every address of res, so its TTL applies to them
+static int from_dns(const ntp_dns_result_t* res, const dns_query_t* queries, int nqueries) {
+    for (int i = 0; i < res->count; i++) {
+        int found = 0;
+        for (int q = 0; q < nqueries && !found; q++) {
+            for (int k = 0; k < queries[q].result.count && !found; k++) {
+                found = ntp_addr_equal(&res->addrs[i], &queries[q].result.addrs[k]);
+            }
+        }
+        if (!found) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * The addresses come from getaddrinfo(), so nsswitch.conf decides where
+ * they come from and in which order (files before dns, as a rule).  The
+ * A and AAAA queries run next to it for the TTL only, and it only applies
+ * if DNS returned the same addresses: a name /etc/hosts answered is
+ * cached for NTP_DNS_DEFAULT_TTL.
+ */
+static void resolve_one(const char* name, ntp_dns_result_t* res) {
+    dns_query_t queries[2];
+    pthread_t threads[2];
+    int threaded[2];
+    uint32_t ttl = UINT32_MAX;
+
+    memset(res, 0, sizeof(*res));
+    memset(queries, 0, sizeof(queries));
+    for (int q = 0; q < 2; q++) {
+        queries[q].name = name;
+        queries[q].type = q == 0 ? ns_t_aaaa : ns_t_a;
+        queries[q].ttl = UINT32_MAX;
+        threaded[q] = pthread_create(&threads[q], NULL, query_thread, &queries[q]) == 0;
+    }
+
+    add_addrinfo(res, name, 0);
+    for (int q = 0; q < 2; q++) {
+        if (threaded[q]) {
+            pthread_join(threads[q], NULL);
+        } else if (res->count > 0) {
+            query_thread(&queries[q]);
+        }
+        if (queries[q].result.count > 0 && queries[q].ttl < ttl) {
+            ttl = queries[q].ttl;
+        }
+    }
+    interleave(res);
+
+    if (ttl == UINT32_MAX || !from_dns(res, queries, 2)) {
+        ttl = NTP_DNS_DEFAULT_TTL;
+    }
+    if (ttl < NTP_DNS_MIN_TTL) {
+        ttl = NTP_DNS_MIN_TTL;
+    }
+    res->expires = ntp_filter_now() + ttl;
+}
+
+static int cache_lookup(const char* name, ntp_dns_result_t* res) {
+    int found = 0;
+    double now = ntp_filter_now();
+
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < NTP_DNS_CACHE_SIZE; i++) {
+        if (cache[i].result.count > 0 && cache[i].result.expires > now &&
+            strcmp(cache[i].name, name) == 0) {
+            *res = cache[i].result;
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return found;
+}
+
+// Replaces the same name, else the entry that expires first
+static void cache_store(const char* name, const ntp_dns_result_t* res) {
+    int victim = 0;
+
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < NTP_DNS_CACHE_SIZE; i++) {
+        if (strcmp(cache[i].name, name) == 0) {
+            victim = i;
+            break;
+        }
+        if (cache[i].result.expires < cache[victim].result.expires) {
+            victim = i;
+        }
+    }
+    snprintf(cache[victim].name, sizeof(cache[victim].name), "%s", name);
+    cache[victim].result = *res;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+static void* resolver_thread(void* arg) {
+    dns_job_t* job = arg;
+    ntp_dns_result_t res;
+    int abandoned;
+
+    resolve_one(job->name, &res);
+    if (res.count > 0) {
+        cache_store(job->name, &res);
+    }
+
+    pthread_mutex_lock(&job_lock);
+    job->result = res;
+    job->done = 1;
+    abandoned = job->abandoned;
+    pthread_cond_broadcast(&job_done);
+    pthread_mutex_unlock(&job_lock);
+    if (abandoned) {
+        free(job);
+    }
+    return NULL;
+}
+
+int ntp_resolve_names(const char* const* names, int nnames, ntp_dns_result_t* results,
+                      int timeout_ms) {
+    dns_job_t** jobs = calloc(nnames, sizeof(*jobs));
+    int resolved = 0;
+
+    if (jobs == NULL) {
+        return 0;
+    }
+    for (int i = 0; i < nnames; i++) {
+        memset(&results[i], 0, sizeof(results[i]));
+        if (parse_numeric(names[i], &results[i]) || cache_lookup(names[i], &results[i])) {
+            continue;
+        }
+
+        pthread_t thread;
+        jobs[i] = calloc(1, sizeof(dns_job_t));
+        if (jobs[i] == NULL) {
+            continue;
+        }
+        snprintf(jobs[i]->name, sizeof(jobs[i]->name), "%s", names[i]);
+        if (pthread_create(&thread, NULL, resolver_thread, jobs[i]) != 0) {
+            // No thread to spare, resolve it here
+            resolver_thread(jobs[i]);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&job_lock);
+    for (int i = 0; i < nnames; i++) {
+        while (jobs[i] != NULL && !jobs[i]->done) {
+            if (pthread_cond_timedwait(&job_done, &job_lock, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+    }
+    for (int i = 0; i < nnames; i++) {
+        if (jobs[i] == NULL) {
+            continue;
+        }
+        if (jobs[i]->done) {
+            results[i] = jobs[i]->result;
+            free(jobs[i]);
+        } else {
+            jobs[i]->abandoned = 1;
+        }
+    }
+    pthread_mutex_unlock(&job_lock);
+    free(jobs);
+
+    for (int i = 0; i < nnames; i++) {
+        resolved += results[i].count > 0;
+    }
+    return resolved;
+}
+
+double ntp_resolve_expiry(const char* const* names, int nnames) {
+    double expiry = INFINITY;
+
+    for (int i = 0; i < nnames; i++) {
+        ntp_dns_result_t res;
+
+        memset(&res, 0, sizeof(res));
+        if (parse_numeric(names[i], &res)) {
+            continue;
+        }
+        // Not cached, or expired: due now
+        if (!cache_lookup(names[i], &res)) {
+            return 0;
+        }
+        if (res.expires < expiry) {
+            expiry = res.expires;
+        }
+    }
+    return expiry;
+}
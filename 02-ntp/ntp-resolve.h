@@ -0,0 +1,79 @@
+/*
+ * Parallel DNS Resolution with a TTL Cache
+ *
+ * gethostbyname() blocks, one name after the other, and resolve_hostname()
+ * only ever used its first address.  A pool name like pool.ntp.org returns
+ * several servers on purpose, and with four -s pools startup waited for
+ * four lookups in a row.  This resolver:
+ *
+ * - Looks up every name at once, one thread per name, and waits at most
+ *   NTP_DNS_TIMEOUT_MS for all of them together.
+ * - Keeps ALL the addresses getaddrinfo() returns, so a pool name fans
+ *   out to every server it returns.  getaddrinfo() follows nsswitch.conf,
+ *   so /etc/hosts still comes before DNS.
+ * - Reads the TTL of the records, which getaddrinfo() does not report,
+ *   from A and AAAA queries with res_nsearch() made at the same time, and
+ *   caches each answer that long (at least NTP_DNS_MIN_TTL).  Names whose
+ *   addresses did not come from DNS, like those in /etc/hosts, are cached
+ *   for NTP_DNS_DEFAULT_TTL.  Numeric addresses never touch the resolver
+ *   at all.
+ *
+ * The cache lives as long as the process, which matters for daemon mode:
+ * it resolves its servers again when their TTL runs out.  Addresses come
+ * IPv6 first, then alternating between the families (RFC 8305), so the
+ * first few always cover both.
+ *
+ * The ntp_addr_* helpers below let the rest of the client handle IPv4
+ * and IPv6 alike.  Sockets are dual-stack IPv6 sockets where the host
+ * allows it, so IPv4 peers show up as IPv4-mapped addresses
+ * (::ffff:a.b.c.d); the helpers treat those as the IPv4 address inside.
+ */
+
+#ifndef NTP_RESOLVE_H
+#define NTP_RESOLVE_H
+
+#include <stddef.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <netinet/in.h>
+
+#define NTP_DNS_MAX_ADDRS   16          // Addresses kept per name
+#define NTP_DNS_CACHE_SIZE  32          // Names cached
+#define NTP_DNS_TIMEOUT_MS  3000        // For all the lookups together
+#define NTP_DNS_MIN_TTL     60          // Cache an answer at least this long (s)
+#define NTP_DNS_DEFAULT_TTL 300         // When the TTL is unknown (s)
+#define NTP_ADDRSTRLEN      (INET6_ADDRSTRLEN + IF_NAMESIZE)  // With a %scope
+
+typedef struct {
+    int count;
+    struct sockaddr_storage addrs[NTP_DNS_MAX_ADDRS];  // AF_INET and AF_INET6
+    double expires;                     // Monotonic seconds, see ntp_filter_now()
+} ntp_dns_result_t;
+
+// Resolve names in parallel, through the cache.  results[i] is empty if
+// names[i] did not resolve in time; returns how many did
+int ntp_resolve_names(const char* const* names, int nnames, ntp_dns_result_t* results,
+                      int timeout_ms);
+
+// Earliest time one of these names needs resolving again
+double ntp_resolve_expiry(const char* const* names, int nnames);
+
+// Length of the sockaddr inside, for sendto() and friends
+socklen_t ntp_addr_len(const struct sockaddr_storage* addr);
+
+// Same address and port, IPv4-mapped or not
+int ntp_addr_equal(const struct sockaddr_storage* a, const struct sockaddr_storage* b);
+
+void ntp_addr_set_port(struct sockaddr_storage* addr, int port);
+
+// Numeric form, IPv4-mapped addresses as plain IPv4; returns buf
+const char* ntp_addr_str(const struct sockaddr_storage* addr, char* buf, size_t len);
+
+// Numeric IPv4 or IPv6 address to a sockaddr, -1 if ip_str is neither
+int ntp_addr_parse(const char* ip_str, int port, struct sockaddr_storage* addr);
+
+// addr as sockfd can send to it, IPv4 is mapped for an IPv6 socket
+void ntp_addr_for_socket(int sockfd, const struct sockaddr_storage* addr,
+                         struct sockaddr_storage* out);
+
+#endif
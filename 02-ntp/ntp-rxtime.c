@@ -0,0 +1,129 @@
+/*
+ * Kernel Receive Timestamps - see ntp-rxtime.h
+ */
+
+#define _GNU_SOURCE                     // SO_TIMESTAMPNS, struct ifreq with -std=c99
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
+#include "ntp-rxtime.h"
+
+static const char* hw_iface = NULL;
+
+void set_rx_timestamp_iface(const char* iface) {
+    hw_iface = iface;
+}
+
+void timespec_to_ntp(const struct timespec* ts, ntp_timestamp_t* ntp_ts) {
+    ntp_ts->seconds = (uint32_t)(ts->tv_sec + NTP_EPOCH_OFFSET);
+    ntp_ts->fraction = (uint32_t)((((uint64_t)ts->tv_nsec << 32) + 500000000) / 1000000000);
+}
+
+const char* rx_timestamp_name(int source) {
+    switch (source) {
+        case NTP_RXTS_KERNEL:   return "kernel";
+        case NTP_RXTS_HARDWARE: return "hardware";
+        default:                return "user space";
+    }
+}
+
+/*
+ * Switches the NIC to stamping every received packet.  Filters for all
+ * packets are the most widely supported, the NTP only one is tried next.
+ */
+static int enable_nic_timestamps(int sockfd, const char* iface) {
+    static const int filters[] = { HWTSTAMP_FILTER_ALL, HWTSTAMP_FILTER_NTP_ALL };
+    struct hwtstamp_config config;
+    struct ifreq ifr;
+
+    for (size_t i = 0; i < sizeof(filters) / sizeof(filters[0]); i++) {
+        memset(&ifr, 0, sizeof(ifr));
+        memset(&config, 0, sizeof(config));
+        strncpy(ifr.ifr_name, iface, IFNAMSIZ - 1);
+        config.tx_type = HWTSTAMP_TX_OFF;
+        config.rx_filter = filters[i];
+        ifr.ifr_data = (char*)&config;
+        if (ioctl(sockfd, SIOCSHWTSTAMP, &ifr) == 0) {
+            return 0;
+        }
+    }
+    fprintf(stderr, "Hardware timestamps on %s: %s, using kernel timestamps\n",
+            iface, strerror(errno));
+    return -1;
+}
+
+int enable_rx_timestamps(int sockfd) {
+    if (hw_iface != NULL && enable_nic_timestamps(sockfd, hw_iface) == 0) {
+        int flags = SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE |
+                    SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+        if (setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == 0) {
+            return NTP_RXTS_HARDWARE;
+        }
+    }
+
+    int on = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) == 0) {
+        return NTP_RXTS_KERNEL;
+    }
+    return NTP_RXTS_USER;
+}
+
+/*
+ * The stamp the kernel attached to a datagram.  SO_TIMESTAMPING hands over
+ * three stamps: [0] software, [1] unused, [2] raw hardware.
+ */
+int ntp_rx_timestamp(struct msghdr* msg, ntp_timestamp_t* recv_time) {
+    int source = NTP_RXTS_USER;
+
+    for (struct cmsghdr* cm = CMSG_FIRSTHDR(msg); cm != NULL; cm = CMSG_NXTHDR(msg, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET) {
+            continue;
+        }
+        if (cm->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(cm), sizeof(ts));
+            timespec_to_ntp(&ts, recv_time);
+            source = NTP_RXTS_KERNEL;
+        } else if (cm->cmsg_type == SCM_TIMESTAMPING) {
+            struct timespec ts[3];
+            memcpy(ts, CMSG_DATA(cm), sizeof(ts));
+            if (ts[2].tv_sec != 0 || ts[2].tv_nsec != 0) {
+                timespec_to_ntp(&ts[2], recv_time);
+                source = NTP_RXTS_HARDWARE;
+            } else if (ts[0].tv_sec != 0 || ts[0].tv_nsec != 0) {
+                timespec_to_ntp(&ts[0], recv_time);
+                source = NTP_RXTS_KERNEL;
+            }
+        }
+    }
+    if (source == NTP_RXTS_USER) {
+        get_current_ntp_time(recv_time);
+    }
+    return source;
+}
+
+ssize_t recv_ntp_response_ts(int sockfd, ntp_packet_t* packet, struct sockaddr_storage* from,
+                             ntp_timestamp_t* recv_time, int* source) {
+    char control[NTP_RXTS_CONTROL_LEN];
+    struct iovec iov = { .iov_base = packet, .iov_len = sizeof(ntp_packet_t) };
+    struct msghdr msg = {
+        .msg_name = from,
+        .msg_namelen = from != NULL ? sizeof(*from) : 0,
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+
+    ssize_t received = recvmsg(sockfd, &msg, 0);
+    if (received < 0) {
+        return received;
+    }
+    *source = ntp_rx_timestamp(&msg, recv_time);
+    return received;
+}
@@ -0,0 +1,60 @@
+/*
+ * Kernel Receive Timestamps for T4
+ *
+ * Reading the clock after recvfrom() returns measures when our program got
+ * around to the reply, not when it arrived: the wakeup, the scheduler and
+ * the system call all end up in T4, and so in the offset and the delay.
+ * The kernel can stamp every datagram as it comes off the network instead
+ * and hand the stamp to recvmsg() as a control message:
+ *
+ * - SO_TIMESTAMPNS: software stamp taken in the network stack, with
+ *   nanosecond resolution, on the system clock.  Always tried.
+ * - SO_TIMESTAMPING with hardware flags: stamp taken by the NIC itself,
+ *   requires a NIC that supports it, CAP_NET_ADMIN to switch it on for
+ *   the interface (-H iface) and the NIC clock synchronized to the system
+ *   clock (for example with phc2sys).  The software stamp is the fallback
+ *   for every packet the NIC did not stamp.
+ *
+ * If no stamp comes with a datagram T4 is read with get_current_ntp_time()
+ * as before.
+ */
+
+#ifndef NTP_RXTIME_H
+#define NTP_RXTIME_H
+
+#include <sys/types.h>
+#include <time.h>
+#include <netinet/in.h>
+#include "ntp-protocol.h"
+
+struct timespec;                        // Hidden by <time.h> under -std=c99
+struct msghdr;
+
+// Control buffer for one datagram's stamps, room for SO_TIMESTAMPING's three
+#define NTP_RXTS_CONTROL_LEN CMSG_SPACE(sizeof(struct timespec) * 3)
+
+// Where a T4 came from
+#define NTP_RXTS_USER       0           // Clock read after the receive
+#define NTP_RXTS_KERNEL     1           // Network stack (SO_TIMESTAMPNS)
+#define NTP_RXTS_HARDWARE   2           // NIC (SO_TIMESTAMPING)
+
+// Ask for hardware stamps from this interface on sockets set up afterwards
+void set_rx_timestamp_iface(const char* iface);
+
+// Turn on receive stamps for a socket, returns the best NTP_RXTS_* enabled
+int enable_rx_timestamps(int sockfd);
+
+// T4 from the control messages of a received msghdr, the clock if there
+// are none; returns the NTP_RXTS_* it came from
+int ntp_rx_timestamp(struct msghdr* msg, ntp_timestamp_t* recv_time);
+
+// recvmsg() a reply and its T4, from may be NULL, source gets NTP_RXTS_*
+ssize_t recv_ntp_response_ts(int sockfd, ntp_packet_t* packet, struct sockaddr_storage* from,
+                             ntp_timestamp_t* recv_time, int* source);
+
+// Wall clock time to NTP format, nanoseconds rounded to 2^-32 s
+void timespec_to_ntp(const struct timespec* ts, ntp_timestamp_t* ntp_ts);
+
+const char* rx_timestamp_name(int source);
+
+#endif
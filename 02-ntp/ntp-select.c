@@ -0,0 +1,686 @@
+/*
+ * Multi-Server NTP Queries and Source Selection - see ntp-select.h
+ *
+ * Replies are matched to requests by the origin timestamp: a server copies
+ * the transmit timestamp of the request (T1) into the origin field of its
+ * reply.  The low bits of every T1 are randomized below the resolution of
+ * the clock so two requests sent within the same microsecond still differ,
+ * and an old or forged reply can not be taken for a new one.
+ */
+
+#define _GNU_SOURCE                     // poll(), random() with -std=c99
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "ntp-select.h"
+#include "ntp-rxtime.h"
+#include "ntp-resolve.h"
+
+#define NTP_T1_RANDOM_MASK  0xfff       // Below 1 us in NTP fraction units
+
+// Endpoint of a correctness interval, type is -1 low, 0 middle, +1 high
+typedef struct {
+    double edge;
+    int type;
+} ntp_endpoint_t;
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int same_timestamp(const ntp_timestamp_t* a, const ntp_timestamp_t* b) {
+    return a->seconds == b->seconds && a->fraction == b->fraction;
+}
+
+// The peer a reply belongs to, -1 for stray, duplicate or forged replies
+static int match_reply(ntp_peer_t* peers, int npeers,
+                       const struct sockaddr_storage* from, const ntp_packet_t* reply) {
+    for (int i = 0; i < npeers; i++) {
+        if (peers[i].replied || !ntp_addr_equal(&peers[i].addr, from))
+            continue;
+        if (same_timestamp(&reply->orig_time, &peers[i].request.xmit_time))
+            return i;
+    }
+    return -1;
+}
+
+// Non-blocking, dual-stack where possible, with receive timestamps
+static int open_query_socket(void) {
+    static int seeded = 0;
+
+    if (!seeded) {
+        srandom((unsigned)time(NULL) ^ (unsigned)getpid());
+        seeded = 1;
+    }
+
+    int sockfd = create_udp_socket();
+    if (sockfd < 0) {
+        return -1;
+    }
+    if (fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK) < 0) {
+        perror("fcntl");
+        close(sockfd);
+        return -1;
+    }
+    enable_rx_timestamps(sockfd);
+    return sockfd;
+}
+
+// A fresh request with a randomized T1, 0 once it is on its way
+static int send_to_peer(int sockfd, ntp_peer_t* peer) {
+    ntp_packet_t packet;
+
+    peer->replied = 0;
+    peer->status = NTP_PEER_NOREPLY;
+    if (build_ntp_request(&peer->request) < 0) {
+        return -1;
+    }
+    peer->request.xmit_time.fraction ^= (uint32_t)random() & NTP_T1_RANDOM_MASK;
+
+    packet = peer->request;
+    ntp_to_net(&packet);
+    return send_ntp_request(sockfd, &peer->addr, &packet);
+}
+
+/*
+ * Collects replies in whatever order they arrive until *pending of them
+ * came or the monotonic deadline (ms) has passed, returns how many came.  T4 is
+ * the kernel receive timestamp of each datagram where there is one.
+ */
+static int collect_replies(int sockfd, ntp_peer_t* peers, int npeers, int* pending,
+                           long long deadline) {
+    int replies = 0;
+
+    while (*pending > 0) {
+        long long left = deadline - now_ms();
+        if (left <= 0) {
+            break;
+        }
+
+        struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+        int rc = poll(&pfd, 1, (int)left);
+        if (rc < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rc <= 0) {
+            break;
+        }
+
+        // Drain everything that is queued, one poll() can cover several replies
+        for (;;) {
+            ntp_packet_t reply;
+            ntp_timestamp_t recv_time;
+            struct sockaddr_storage from;
+            int rx_source;
+
+            ssize_t received = recv_ntp_response_ts(sockfd, &reply, &from, &recv_time, &rx_source);
+            if (received < 0) {
+                break;
+            }
+            if (received != sizeof(ntp_packet_t)) {
+                continue;
+            }
+
+            ntp_to_host(&reply);
+            int i = match_reply(peers, npeers, &from, &reply);
+            if (i < 0) {
+                continue;
+            }
+            peers[i].response = reply;
+            peers[i].recv_time = recv_time;
+            peers[i].rx_source = rx_source;
+            peers[i].replied = 1;
+            ntp_peer_sample(&peers[i]);
+            (*pending)--;
+            replies++;
+        }
+    }
+    return replies;
+}
+
+/*
+ * Sends a request to every peer, then collects the replies until all are
+ * in or timeout_ms has passed.
+ */
+int query_ntp_servers(ntp_peer_t* peers, int npeers, int timeout_ms) {
+    int pending = 0;
+    int sockfd = open_query_socket();
+
+    if (sockfd < 0) {
+        return -1;
+    }
+    for (int i = 0; i < npeers; i++) {
+        if (send_to_peer(sockfd, &peers[i]) == 0) {
+            pending++;
+        }
+    }
+
+    int replies = collect_replies(sockfd, peers, npeers, &pending, now_ms() + timeout_ms);
+    close(sockfd);
+    return replies;
+}
+
+/*
+ * The first address gets a head start, the next is only asked if it has
+ * not answered by then, and so on; once all are asked the first answer
+ * is awaited up to the timeout.  If several arrive together the lowest
+ * delay wins.
+ */
+int ntp_race_addresses(const struct sockaddr_storage* addrs, int naddrs, int timeout_ms,
+                       ntp_peer_t* winner) {
+    ntp_peer_t racers[NTP_MAX_PEERS];
+    int first = -1;
+
+    if (naddrs > NTP_MAX_PEERS) {
+        naddrs = NTP_MAX_PEERS;
+    }
+    int sockfd = open_query_socket();
+    if (sockfd < 0) {
+        return -1;
+    }
+    memset(racers, 0, sizeof(racers));
+
+    long long deadline = now_ms() + timeout_ms;
+    for (int i = 0; i < naddrs; i++) {
+        long long until = deadline;
+        int wanted = 1;                 // The first reply ends the race
+
+        racers[i].addr = addrs[i];
+        if (send_to_peer(sockfd, &racers[i]) < 0) {
+            // No route in this family, no point in waiting for it
+            continue;
+        }
+        if (i + 1 < naddrs && now_ms() + NTP_RACE_DELAY_MS < deadline) {
+            until = now_ms() + NTP_RACE_DELAY_MS;
+        }
+        if (collect_replies(sockfd, racers, i + 1, &wanted, until) > 0 || now_ms() >= deadline) {
+            break;
+        }
+    }
+    close(sockfd);
+
+    for (int i = 0; i < naddrs; i++) {
+        if (racers[i].replied && (first < 0 || racers[i].delay < racers[first].delay)) {
+            first = i;
+        }
+    }
+    if (first >= 0 && winner != NULL) {
+        *winner = racers[first];
+    }
+    return first;
+}
+
+/*
+ * Offset and delay come from the four timestamps, subtracted as 64-bit
+ * integers so no precision is lost and the 2036 era wrap does no harm.
+ * The dispersion is the precision of both clocks plus what our clock may
+ * have drifted during the exchange (RFC 5905 section 8)
+ */
+int ntp_peer_sample(ntp_peer_t* peer) {
+    ntp_fixed_offset_delay(&peer->request.xmit_time, &peer->response.recv_time,
+                           &peer->response.xmit_time, &peer->recv_time,
+                           &peer->sample_offset, &peer->sample_delay);
+    if (peer->sample_delay < 0) {
+        peer->sample_delay = 0;
+    }
+    peer->offset = ntp_fixed_to_double(peer->sample_offset);
+    peer->delay = ntp_fixed_to_double(peer->sample_delay);
+    peer->disp = ldexp(1.0, peer->response.precision) + ldexp(1.0, NTP_LOCAL_PRECISION) +
+                 NTP_PHI * peer->delay;
+    peer->jitter = 0;
+    return RC_OK;
+}
+
+// Root delay and root dispersion are Q16.16 seconds
+static double q1616_to_double(uint32_t q) {
+    return q / 65536.0;
+}
+
+// Lambda, how far off the server may be from true time (RFC 5905 A.5.5.2)
+static double root_distance(const ntp_peer_t* peer) {
+    double delay = q1616_to_double(peer->response.root_delay) + peer->delay;
+
+    return (delay > NTP_MINDISP ? delay : NTP_MINDISP) / 2 +
+           q1616_to_double(peer->response.root_dispersion) + peer->disp + peer->jitter;
+}
+
+// Worth considering at all (RFC 5905 fit())
+static int peer_fit(const ntp_peer_t* peer) {
+    const ntp_packet_t* r = &peer->response;
+
+    if (!peer->replied) {
+        return 0;
+    }
+    if (GET_NTP_MODE(r) != NTP_MODE_SERVER || GET_NTP_LI(r) == NTP_LI_UNSYNC) {
+        return 0;
+    }
+    // Stratum 0 is a kiss-o'-death, 16 is unsynchronized
+    if (r->stratum == 0 || r->stratum >= NTP_MAXSTRAT) {
+        return 0;
+    }
+    if (r->xmit_time.seconds == 0) {
+        return 0;
+    }
+    return peer->rootdist < NTP_MAXDIST;
+}
+
+static int cmp_endpoints(const void* a, const void* b) {
+    double ea = ((const ntp_endpoint_t*)a)->edge;
+    double eb = ((const ntp_endpoint_t*)b)->edge;
+
+    return (ea > eb) - (ea < eb);
+}
+
+/*
+ * Intersection algorithm (RFC 5905 A.5.5.1).  Tries to find an interval
+ * shared by all n candidates, then n - 1 and so on, as long as the ones
+ * allowed to disagree stay a minority.  Returns 0 and sets low and high if
+ * a majority agrees.
+ */
+static int intersect(const ntp_peer_t* peers, const int* cand, int n, double* low, double* high) {
+    ntp_endpoint_t list[3 * NTP_MAX_PEERS];
+    int nl = 0;
+
+    for (int i = 0; i < n; i++) {
+        const ntp_peer_t* p = &peers[cand[i]];
+        list[nl++] = (ntp_endpoint_t){ p->offset - p->rootdist, -1 };
+        list[nl++] = (ntp_endpoint_t){ p->offset, 0 };
+        list[nl++] = (ntp_endpoint_t){ p->offset + p->rootdist, +1 };
+    }
+    qsort(list, nl, sizeof(ntp_endpoint_t), cmp_endpoints);
+
+    for (int allow = 0; 2 * allow < n; allow++) {
+        int found = 0, chime = 0;
+
+        *low = 2e9;
+        *high = -2e9;
+        for (int i = 0; i < nl; i++) {
+            chime -= list[i].type;
+            if (chime >= n - allow) {
+                *low = list[i].edge;
+                break;
+            }
+            if (list[i].type == 0) {
+                found++;
+            }
+        }
+        chime = 0;
+        for (int i = nl - 1; i >= 0; i--) {
+            chime += list[i].type;
+            if (chime >= n - allow) {
+                *high = list[i].edge;
+                break;
+            }
+            if (list[i].type == 0) {
+                found++;
+            }
+        }
+        // Midpoints outside the interval belong to the ones allowed to disagree
+        if (found > allow) {
+            continue;
+        }
+        if (*high > *low) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Stratum first, root distance second (RFC 5905 A.5.5.1)
+static double peer_metric(const ntp_peer_t* peer) {
+    return NTP_MAXDIST * peer->response.stratum + peer->rootdist;
+}
+
+int ntp_select(ntp_peer_t* peers, int npeers, ntp_system_t* sys) {
+    int cand[NTP_MAX_PEERS];
+    int n = 0;
+
+    memset(sys, 0, sizeof(*sys));
+    sys->sys_peer = -1;
+
+    for (int i = 0; i < npeers; i++) {
+        if (!peers[i].replied) {
+            peers[i].status = NTP_PEER_NOREPLY;
+            continue;
+        }
+        peers[i].rootdist = root_distance(&peers[i]);
+        if (!peer_fit(&peers[i])) {
+            peers[i].status = NTP_PEER_UNFIT;
+            continue;
+        }
+
+        // One vote per host, the path with the lowest delay casts it
+        int same = -1;
+        for (int j = 0; j < n && same < 0; j++) {
+            same = peers[cand[j]].host == peers[i].host ? j : -1;
+        }
+        if (same < 0) {
+            cand[n++] = i;
+        } else if (peers[i].delay < peers[cand[same]].delay) {
+            peers[cand[same]].status = NTP_PEER_OTHERPATH;
+            cand[same] = i;
+        } else {
+            peers[i].status = NTP_PEER_OTHERPATH;
+        }
+    }
+    if (n == 0 || intersect(peers, cand, n, &sys->low, &sys->high) < 0) {
+        for (int i = 0; i < n; i++) {
+            peers[cand[i]].status = NTP_PEER_FALSETICK;
+        }
+        return RC_BAD_PACKET;
+    }
+
+    // Truechimers, kept in metric order so the first one is the best
+    int surv[NTP_MAX_PEERS];
+    int ns = 0;
+    for (int i = 0; i < n; i++) {
+        ntp_peer_t* p = &peers[cand[i]];
+        if (p->offset < sys->low || p->offset > sys->high) {
+            p->status = NTP_PEER_FALSETICK;
+            continue;
+        }
+        p->status = NTP_PEER_SURVIVOR;
+        int j = ns++;
+        while (j > 0 && peer_metric(&peers[surv[j - 1]]) > peer_metric(p)) {
+            surv[j] = surv[j - 1];
+            j--;
+        }
+        surv[j] = cand[i];
+    }
+    sys->truechimers = ns;
+
+    /*
+     * Clustering (RFC 5905 A.5.5.2): drop the survivor with the largest
+     * selection jitter until that would not beat the jitter of the best
+     * peer, or NTP_NMIN are left
+     */
+    while (ns > NTP_NMIN) {
+        double max_phi = -1, min_psi = 1e9;
+        int worst = 0;
+
+        for (int i = 0; i < ns; i++) {
+            double sum = 0;
+            for (int j = 0; j < ns; j++) {
+                double d = peers[surv[j]].offset - peers[surv[i]].offset;
+                sum += d * d;
+            }
+            double phi = sqrt(sum / (ns - 1));
+            if (phi > max_phi) {
+                max_phi = phi;
+                worst = i;
+            }
+            if (peers[surv[i]].jitter < min_psi) {
+                min_psi = peers[surv[i]].jitter;
+            }
+        }
+        if (max_phi <= min_psi) {
+            break;
+        }
+        peers[surv[worst]].status = NTP_PEER_OUTLIER;
+        memmove(&surv[worst], &surv[worst + 1], (ns - worst - 1) * sizeof(int));
+        ns--;
+    }
+    sys->survivors = ns;
+
+    // Combining (RFC 5905 A.5.5.3), weights are 1 / root distance
+    const ntp_peer_t* best = &peers[surv[0]];
+    double y = 0, z = 0, w = 0;
+    for (int i = 0; i < ns; i++) {
+        const ntp_peer_t* p = &peers[surv[i]];
+        double x = 1.0 / p->rootdist;
+        double d = p->offset - best->offset;
+
+        y += x;
+        z += x * p->offset;
+        w += x * d * d;
+    }
+    sys->sys_peer = surv[0];
+    peers[surv[0]].status = NTP_PEER_SYSPEER;
+    sys->offset = z / y;
+    sys->jitter = sqrt(best->jitter * best->jitter + w / y);
+    sys->rootdist = best->rootdist;
+    return RC_OK;
+}
+
+static const char* status_name(int status) {
+    static const char* names[] = {
+        "no reply", "unfit", "falseticker", "outlier", "survivor", "SYSTEM PEER",
+        "other path"
+    };
+    return (status >= 0 && status <= NTP_PEER_OTHERPATH) ? names[status] : "?";
+}
+
+void print_ntp_selection(const ntp_peer_t* peers, int npeers, const ntp_system_t* sys) {
+    int width = 15;                     // IPv4, wider for IPv6
+
+    for (int i = 0; i < npeers; i++) {
+        int len = (int)strlen(peers[i].ip_str);
+        width = len > width ? len : width;
+    }
+    printf("\n%-24s %-*s %3s %12s %10s %10s %10s %12s  %s\n", "Server", width, "Address", "St",
+           "Offset(ms)", "Delay(ms)", "Jitter(ms)", "Disp(ms)", "RootDist(ms)", "Status");
+    for (int i = 0; i < npeers; i++) {
+        const ntp_peer_t* p = &peers[i];
+        if (!p->replied) {
+            printf("%-24s %-*s %3s %12s %10s %10s %10s %12s  %s\n", p->name, width, p->ip_str,
+                   "-", "-", "-", "-", "-", "-", status_name(p->status));
+            continue;
+        }
+        printf("%-24s %-*s %3d %12.3f %10.3f %10.3f %10.3f %12.3f  %s\n", p->name, width,
+               p->ip_str, p->response.stratum, p->offset * 1000, p->delay * 1000,
+               p->jitter * 1000, p->disp * 1000, p->rootdist * 1000, status_name(p->status));
+    }
+
+    if (sys->sys_peer < 0) {
+        printf("\nNo majority of the servers agrees, the clock can not be trusted\n");
+        return;
+    }
+    printf("\n=== Combined Result (%d truechimers, %d survivors) ===\n",
+           sys->truechimers, sys->survivors);
+    printf("System Peer: %s (%s), T4 from %s timestamps\n", peers[sys->sys_peer].name,
+           peers[sys->sys_peer].ip_str, rx_timestamp_name(peers[sys->sys_peer].rx_source));
+    printf("Intersection: [%.3f, %.3f] ms\n", sys->low * 1000, sys->high * 1000);
+    printf("Time Offset: %.6f seconds\n", sys->offset);
+    printf("System Jitter: %.6f seconds\n", sys->jitter);
+    printf("Root Distance: %.6f seconds\n", sys->rootdist);
+    if (sys->offset > 0) {
+        printf("\nYour clock is running BEHIND by %.2fms\n", sys->offset * 1000);
+    } else {
+        printf("\nYour clock is running AHEAD by %.2fms\n", -sys->offset * 1000);
+    }
+}
+
+// Replace the last sample of every peer with the output of its filter
+static void use_filter(ntp_peer_t* peers, int npeers) {
+    for (int i = 0; i < npeers; i++) {
+        ntp_peer_t* p = &peers[i];
+
+        p->replied = p->filter.count > 0;
+        if (!p->replied) {
+            continue;
+        }
+        p->offset = ntp_fixed_to_double(p->filter.offset);
+        p->delay = ntp_fixed_to_double(p->filter.delay);
+        p->disp = p->filter.disp;
+        p->jitter = p->filter.jitter;
+    }
+}
+
+static void sleep_ms(double ms) {
+    if (ms <= 0) {
+        return;
+    }
+    struct timespec ts = { (time_t)(ms / 1000), (long)(fmod(ms, 1000) * 1000000) };
+    nanosleep(&ts, NULL);
+}
+
+int ntp_poll_round(ntp_peer_t* peers, int npeers, int timeout_ms, ntp_system_t* sys) {
+    int replies = query_ntp_servers(peers, npeers, timeout_ms);
+    if (replies < 0) {
+        return -1;
+    }
+
+    double now = ntp_filter_now();
+    for (int i = 0; i < npeers; i++) {
+        ntp_peer_t* p = &peers[i];
+        if (p->replied) {
+            ntp_filter_add(&p->filter, p->sample_offset, p->sample_delay, p->disp, now);
+        }
+    }
+    use_filter(peers, npeers);
+    ntp_select(peers, npeers, sys);
+    return replies;
+}
+
+/*
+ * Burst mode: burst rounds, each one queries every peer once and feeds the
+ * replies to the clock filters.  After every round the filtered samples go
+ * through selection so the estimate, and how long it took, can be seen
+ * improving.
+ */
+static int run_burst(ntp_peer_t* peers, int npeers, int burst, ntp_system_t* sys) {
+    double start = ntp_filter_now();
+
+    for (int i = 0; i < npeers; i++) {
+        ntp_filter_init(&peers[i].filter);
+    }
+    for (int round = 1; round <= burst; round++) {
+        double round_start = ntp_filter_now();
+        int replies = ntp_poll_round(peers, npeers, NTP_BURST_TIMEOUT_MS, sys);
+        if (replies < 0) {
+            return RC_BAD_PACKET;
+        }
+
+        double now = ntp_filter_now();
+        if (sys->sys_peer >= 0) {
+            printf("Round %d at %6.1f ms: %d replies, offset %.6f s, jitter %.6f s\n",
+                   round, (now - start) * 1000, replies, sys->offset, sys->jitter);
+        } else {
+            printf("Round %d at %6.1f ms: %d replies, no estimate yet\n",
+                   round, (now - start) * 1000, replies);
+        }
+        if (round < burst) {
+            sleep_ms(NTP_BURST_GAP_MS - (ntp_filter_now() - round_start) * 1000);
+        }
+    }
+    return sys->sys_peer >= 0 ? RC_OK : RC_BAD_PACKET;
+}
+
+// A name with a "pool" label, like pool.ntp.org or 0.debian.pool.ntp.org,
+// stands for a different server behind each address
+static int is_pool_name(const char* name) {
+    size_t len;
+
+    for (const char* label = name; *label != '\0'; label += len + (label[len] == '.')) {
+        len = strcspn(label, ".");
+        if (len == 4 && strncasecmp(label, "pool", 4) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Every name is looked up at the same time and fans out to all of its
+ * addresses, IPv6 and IPv4.  Those of a pool name are servers of their
+ * own, those of any other name are paths to one host and share its host
+ * number, so ntp_select() gives them one vote.  The same address reached
+ * through two names is only asked once.
+ */
+int ntp_resolve_peers(char* const* servers, int nservers, ntp_peer_t* peers) {
+    ntp_dns_result_t dns[NTP_MAX_PEERS];
+    int npeers = 0;
+    int hosts = 0;
+
+    if (nservers > NTP_MAX_PEERS) {
+        nservers = NTP_MAX_PEERS;
+    }
+    memset(peers, 0, NTP_MAX_PEERS * sizeof(*peers));
+    ntp_resolve_names((const char* const*)servers, nservers, dns, NTP_DNS_TIMEOUT_MS);
+
+    for (int i = 0; i < nservers; i++) {
+        if (dns[i].count == 0) {
+            fprintf(stderr, "Failed to resolve hostname: %s\n", servers[i]);
+            continue;
+        }
+        int pool = is_pool_name(servers[i]);
+        int host = hosts++;
+        for (int a = 0; a < dns[i].count && npeers < NTP_MAX_PEERS; a++) {
+            struct sockaddr_storage addr = dns[i].addrs[a];
+            int dup = 0;
+
+            ntp_addr_set_port(&addr, NTP_PORT);
+            for (int j = 0; j < npeers; j++) {
+                dup |= ntp_addr_equal(&peers[j].addr, &addr);
+            }
+            if (dup) {
+                continue;
+            }
+
+            ntp_peer_t* p = &peers[npeers++];
+            p->name = servers[i];
+            p->host = pool ? hosts++ : host;
+            p->addr = addr;
+            ntp_addr_str(&addr, p->ip_str, sizeof(p->ip_str));
+            ntp_filter_init(&p->filter);
+        }
+    }
+    return npeers;
+}
+
+int ntp_refresh_peers(char* const* servers, int nservers, ntp_peer_t* peers, int npeers) {
+    ntp_peer_t fresh[NTP_MAX_PEERS];
+    int n = ntp_resolve_peers(servers, nservers, fresh);
+
+    // Keep the old set while DNS is down
+    if (n == 0) {
+        return npeers;
+    }
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < npeers; j++) {
+            if (ntp_addr_equal(&fresh[i].addr, &peers[j].addr)) {
+                fresh[i].filter = peers[j].filter;
+            }
+        }
+    }
+    memcpy(peers, fresh, sizeof(fresh));
+    return n;
+}
+
+int query_ntp_pool(char* const* servers, int nservers, int burst) {
+    ntp_peer_t peers[NTP_MAX_PEERS];
+    ntp_system_t sys;
+    int npeers = ntp_resolve_peers(servers, nservers, peers);
+
+    if (npeers == 0) {
+        return 1;
+    }
+
+    int rc;
+    if (burst > 1) {
+        printf("Burst of %d requests to %d NTP server(s), %d ms apart...\n",
+               burst, npeers, NTP_BURST_GAP_MS);
+        rc = run_burst(peers, npeers, burst, &sys);
+    } else {
+        printf("Querying %d NTP servers at once...\n", npeers);
+        int replies = query_ntp_servers(peers, npeers, NTP_QUERY_TIMEOUT_MS);
+        if (replies < 0) {
+            return 1;
+        }
+        printf("%d of %d servers replied\n", replies, npeers);
+        rc = ntp_select(peers, npeers, &sys);
+    }
+    print_ntp_selection(peers, npeers, &sys);
+    return rc == RC_OK ? 0 : 1;
+}
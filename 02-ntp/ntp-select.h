@@ -0,0 +1,136 @@
+/*
+ * Multi-Server NTP Queries and Source Selection
+ *
+ * A single server can be wrong, and asking several of them one after the
+ * other costs one round trip each.  These helpers ask up to NTP_MAX_PEERS
+ * servers at once from one non-blocking socket and then decide which of
+ * them to believe using the mitigation algorithms of RFC 5905 section 11.2:
+ *
+ * 0. One vote per server - the IPv6 and IPv4 addresses of one host are two
+ *    paths to the same clock.  Only the path with the lowest delay takes
+ *    part, the others are OTHER PATHS.  Each address of a pool name (one
+ *    with a "pool" label, like pool.ntp.org) is a server of its own.
+ *
+ * 1. Selection (intersection) - every server gives a correctness interval,
+ *    its offset +/- its root distance.  A variant of Marzullo's algorithm
+ *    finds the smallest interval that the majority of the intervals share.
+ *    Servers whose offset falls outside of it are FALSETICKERS, the rest
+ *    are TRUECHIMERS.
+ *
+ * 2. Clustering - the truechimer that adds the most selection jitter (the
+ *    spread of the offsets around it) is dropped, repeatedly, until only
+ *    NTP_NMIN are left or the spread is already below the jitter of the
+ *    servers themselves.
+ *
+ * 3. Combining - the offsets of the survivors are averaged, each one
+ *    weighted by 1 / root distance, so close and accurate servers count
+ *    for more.  The best survivor becomes the SYSTEM PEER.
+ */
+
+#ifndef NTP_SELECT_H
+#define NTP_SELECT_H
+
+#include <netinet/in.h>
+#include "ntp-protocol.h"
+#include "ntp-fixed.h"
+#include "ntp-filter.h"
+#include "ntp-resolve.h"
+
+#define NTP_MAX_PEERS       16          // Servers queried at once
+#define NTP_QUERY_TIMEOUT_MS 2000       // Wait for the replies this long
+#define NTP_RACE_DELAY_MS   50          // Head start of each address in a race
+
+// RFC 5905 mitigation constants
+#define NTP_MAXDIST         1.0         // Larger root distance is unfit (s)
+#define NTP_MINDISP         0.01        // Minimum dispersion increment (s)
+#define NTP_PHI             15e-6       // Frequency tolerance (15 ppm)
+#define NTP_NMIN            3           // Clustering keeps at least this many
+#define NTP_MAXSTRAT        16          // Stratum 16 means unsynchronized
+#define NTP_LOCAL_PRECISION -20         // Our clock, about 1 microsecond
+
+// Where a server ended up, see ntp_select()
+#define NTP_PEER_NOREPLY    0           // No (matching) reply arrived
+#define NTP_PEER_UNFIT      1           // Unsynchronized, bad stratum, too far
+#define NTP_PEER_FALSETICK  2           // Outside the intersection interval
+#define NTP_PEER_OUTLIER    3           // Dropped by clustering
+#define NTP_PEER_SURVIVOR   4           // Used by the combine step
+#define NTP_PEER_SYSPEER    5           // Best survivor
+#define NTP_PEER_OTHERPATH  6           // Same host as a peer with less delay
+
+/*
+ * One server and its latest sample.  query_ntp_servers() fills in the
+ * exchange, ntp_peer_sample() computes the exact sample in fixed point and
+ * the doubles the mitigation algorithms work with from it, disp from the
+ * precision of both clocks.  In burst mode they are replaced by the output
+ * of the clock filter before selection.
+ */
+typedef struct {
+    const char* name;                   // As given on the command line
+    int host;                           // Same for every address of one server
+    char ip_str[NTP_ADDRSTRLEN];
+    struct sockaddr_storage addr;       // AF_INET or AF_INET6
+    ntp_packet_t request;               // As sent, host byte order
+    ntp_packet_t response;              // Host byte order
+    ntp_timestamp_t recv_time;          // T4
+    int rx_source;                      // NTP_RXTS_*, where T4 came from
+    int replied;
+    ntp_fixed_t sample_offset;          // Last exchange, 32.32 seconds
+    ntp_fixed_t sample_delay;
+    double offset;                      // Theta (s)
+    double delay;                       // Delta (s)
+    double disp;                        // Epsilon (s)
+    double jitter;                      // Psi (s), 0 for a single sample
+    double rootdist;                    // Lambda (s), set by ntp_select()
+    int status;                         // NTP_PEER_*
+    ntp_filter_t filter;                // Burst mode samples
+} ntp_peer_t;
+
+// Outcome of the mitigation algorithms
+typedef struct {
+    int sys_peer;                       // Index of the system peer, -1 if none
+    int truechimers;
+    int survivors;
+    double low;                         // Intersection interval (s)
+    double high;
+    double offset;                      // Combined offset (s)
+    double jitter;                      // System jitter (s)
+    double rootdist;                    // Root distance of the system peer (s)
+} ntp_system_t;
+
+// Query all peers at once, returns the number of replies
+int query_ntp_servers(ntp_peer_t* peers, int npeers, int timeout_ms);
+
+// Happy Eyeballs (RFC 8305) for NTP: ask addrs one after the other, each
+// NTP_RACE_DELAY_MS after the last unless a reply came.  Returns the index
+// of the address that answered first, -1 if none did within timeout_ms.
+// The exchange of the winner goes to *winner unless it is NULL, it is a
+// complete sample and needs no second query.
+int ntp_race_addresses(const struct sockaddr_storage* addrs, int naddrs, int timeout_ms,
+                       ntp_peer_t* winner);
+
+// Fill in offset, delay and disp of a peer from its last exchange
+int ntp_peer_sample(ntp_peer_t* peer);
+
+// Run selection, clustering and combining; RC_OK if a system peer was found
+int ntp_select(ntp_peer_t* peers, int npeers, ntp_system_t* sys);
+
+// Per server table plus the combined result
+void print_ntp_selection(const ntp_peer_t* peers, int npeers, const ntp_system_t* sys);
+
+// Resolve server names, all at once, into a peer per address with an empty
+// filter, the addresses of one host sharing a host number; returns how many
+int ntp_resolve_peers(char* const* servers, int nservers, ntp_peer_t* peers);
+
+// Resolve again, peers whose address stays keep their filter; returns the
+// new number of peers
+int ntp_refresh_peers(char* const* servers, int nservers, ntp_peer_t* peers, int npeers);
+
+// One poll of every peer: query, clock filter and selection.  Returns the
+// number of replies, sys->sys_peer is -1 if there is no estimate
+int ntp_poll_round(ntp_peer_t* peers, int npeers, int timeout_ms, ntp_system_t* sys);
+
+// Resolve, query and select over a list of server names (the -s options),
+// burst > 1 runs that many rounds through the clock filter first
+int query_ntp_pool(char* const* servers, int nservers, int burst);
+
+#endif
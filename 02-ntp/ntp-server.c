@@ -0,0 +1,468 @@
+/*
+ * NTP Server Mode - see ntp-server.h
+ */
+
+#define _GNU_SOURCE                     // recvmmsg(), CPU affinity with -std=c99
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/timex.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "ntp-server.h"
+#include "ntp-select.h"
+#include "ntp-rxtime.h"
+
+typedef struct {
+    int sockfd;
+    int cpu;                            // Pinned to, -1 for none
+    pthread_t thread;
+    uint64_t requests;                  // Updated by the thread only
+    uint64_t replies;
+    uint64_t dropped;                   // Short, or not a client request
+    long maxerror;                      // Kernel maximum error at the last refresh (us)
+    struct timespec updated;            // When it was last seen to drop, 0 if never
+} __attribute__((aligned(64))) server_thread_t;     // A cache line of its own
+
+// Receive stamps plus the address a request was sent to, IPv4 or IPv6
+#define SERVER_CONTROL_LEN (NTP_RXTS_CONTROL_LEN + CMSG_SPACE(sizeof(struct in_pktinfo)) + \
+                            CMSG_SPACE(sizeof(struct in6_pktinfo)))
+// The source address of a reply
+#define SERVER_PKTINFO_LEN CMSG_SPACE(sizeof(struct in6_pktinfo))
+
+static volatile sig_atomic_t stop = 0;
+static int server_stratum = NTP_SERVER_STRATUM;     // Set before the threads start
+static uint32_t server_refid = NTP_SERVER_REFID;
+
+static void on_signal(int sig) {
+    (void)sig;
+    stop = 1;
+}
+
+// log2 of the clock resolution, what a reply advertises as precision
+static int8_t clock_precision(void) {
+    struct timespec res;
+
+    if (clock_getres(CLOCK_REALTIME, &res) < 0 || res.tv_sec != 0 || res.tv_nsec == 0) {
+        return NTP_LOCAL_PRECISION;
+    }
+    return (int8_t)floor(log2(res.tv_nsec / 1e9));
+}
+
+/*
+ * When the kernel clock was last updated, for the reference time.  The
+ * daemon that disciplines it resets the maximum error on every update and
+ * the kernel adds NTP_SERVER_MAXERR_GROWTH to it each second, so a drop
+ * is an update, and until one is seen the growth bounds how old the last
+ * one can be.
+ */
+static void reference_time(server_thread_t* st, const struct timex* tx, ntp_timestamp_t* ref) {
+    struct timespec now, oldest;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (st->maxerror > 0 && tx->maxerror < st->maxerror) {
+        st->updated = now;
+    }
+    st->maxerror = tx->maxerror;
+
+    long long age_ns = (long long)tx->maxerror * 1000000000LL / NTP_SERVER_MAXERR_GROWTH;
+    oldest.tv_sec = now.tv_sec - (time_t)(age_ns / 1000000000LL);
+    oldest.tv_nsec = now.tv_nsec - (long)(age_ns % 1000000000LL);
+    if (oldest.tv_nsec < 0) {
+        oldest.tv_sec--;
+        oldest.tv_nsec += 1000000000L;
+    }
+    if (st->updated.tv_sec > oldest.tv_sec ||
+        (st->updated.tv_sec == oldest.tv_sec && st->updated.tv_nsec > oldest.tv_nsec)) {
+        oldest = st->updated;
+    }
+    timespec_to_ntp(&oldest, ref);
+}
+
+/*
+ * The fields every reply shares, in host byte order, from the state of
+ * the kernel clock.  The leap indicator passes on a pending leap second.
+ * The kernel does not know where its time comes from, so stratum and
+ * reference ID are what -r and -u say and the root delay is assumed to be
+ * NTP_SERVER_ROOT_DELAY; its maximum error goes out as root dispersion.
+ */
+static void build_reply_template(ntp_packet_t* reply, int8_t precision, server_thread_t* st) {
+    struct timex tx;
+    int state;
+
+    memset(&tx, 0, sizeof(tx));
+    state = adjtimex(&tx);
+    memset(reply, 0, sizeof(*reply));
+    reply->precision = precision;
+    if (state < 0 || (tx.status & STA_UNSYNC)) {
+        SET_NTP_LI_VN_MODE(reply, NTP_LI_UNSYNC, NTP_VERSION, NTP_MODE_SERVER);
+        reply->stratum = NTP_MAXSTRAT;
+        reply->reference_id = NTP_SERVER_UNSYNC_REFID;
+        return;
+    }
+
+    int li = state == TIME_INS ? NTP_LI_ADD_SECOND :
+             state == TIME_DEL ? NTP_LI_DEL_SECOND : NTP_LI_NONE;
+    SET_NTP_LI_VN_MODE(reply, li, NTP_VERSION, NTP_MODE_SERVER);
+    reply->stratum = server_stratum;
+    reply->root_delay = (uint32_t)(NTP_SERVER_ROOT_DELAY * 65536);
+    reply->root_dispersion = (uint32_t)(tx.maxerror * 65536 / 1000000);
+    reply->reference_id = server_refid;
+    reference_time(st, &tx, &reply->ref_time);
+}
+
+// Dual-stack, so one socket per thread serves IPv6 and IPv4 clients, IPv4
+// only on hosts without IPv6.  reuseport lets the threads share the port.
+static int bind_server_socket(int port, int reuseport) {
+    struct sockaddr_storage addr;
+    int on = 1, off = 0;
+    int sockfd = socket(AF_INET6, SOCK_DGRAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    if (sockfd >= 0 && setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)) == 0) {
+        struct sockaddr_in6* sin6 = (struct sockaddr_in6*)&addr;
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_addr = in6addr_any;
+        sin6->sin6_port = htons(port);
+    } else {
+        struct sockaddr_in* sin = (struct sockaddr_in*)&addr;
+        if (sockfd >= 0) {
+            close(sockfd);
+        }
+        sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+        sin->sin_family = AF_INET;
+        sin->sin_addr.s_addr = htonl(INADDR_ANY);
+        sin->sin_port = htons(port);
+    }
+    if (sockfd < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        perror("SO_REUSEPORT");
+        close(sockfd);
+        return -1;
+    }
+    if (bind(sockfd, (struct sockaddr*)&addr, ntp_addr_len(&addr)) < 0) {
+        if (errno == EADDRINUSE) {
+            fprintf(stderr, "Port %d is in use, is another server running?\n", port);
+        } else {
+            perror("bind");
+        }
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+/*
+ * SO_REUSEPORT would let a second server (or anything else of the same
+ * user) bind the port next to ours and quietly take a share of the
+ * clients.  Bound without it first, the port has to be free: a socket
+ * already there makes the bind fail, with or without SO_REUSEPORT.
+ */
+static int port_is_free(int port) {
+    int sockfd = bind_server_socket(port, 0);
+
+    if (sockfd < 0) {
+        return 0;
+    }
+    close(sockfd);
+    return 1;
+}
+
+static int open_server_socket(int port) {
+    int on = 1;
+    int rcvbuf = NTP_SERVER_RCVBUF;
+    struct timeval tv = { 0, 200000 };  // Notice a stop request in time
+    int sockfd = bind_server_socket(port, 1);
+
+    if (sockfd < 0) {
+        return -1;
+    }
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    // Learn the address each request was sent to, to answer from it
+    int domain;
+    socklen_t len = sizeof(domain);
+    if (getsockopt(sockfd, SOL_SOCKET, SO_DOMAIN, &domain, &len) == 0 && domain == AF_INET6) {
+        setsockopt(sockfd, IPPROTO_IPV6, IPV6_RECVPKTINFO, &on, sizeof(on));
+    }
+    setsockopt(sockfd, IPPROTO_IP, IP_PKTINFO, &on, sizeof(on));
+    enable_rx_timestamps(sockfd);
+    return sockfd;
+}
+
+/*
+ * The wildcard socket lets the kernel pick the source of a reply, which on
+ * a host with several addresses need not be the one the client asked, and
+ * clients drop replies from an address they did not send to.  The reply
+ * gets a control message with the destination of the request as its
+ * source instead; returns its length, 0 if the request did not say.
+ */
+static size_t reply_source(struct msghdr* request, char* control) {
+    struct cmsghdr* out = (struct cmsghdr*)control;
+
+    for (struct cmsghdr* cm = CMSG_FIRSTHDR(request); cm != NULL; cm = CMSG_NXTHDR(request, cm)) {
+        if (cm->cmsg_level == IPPROTO_IP && cm->cmsg_type == IP_PKTINFO) {
+            struct in_pktinfo in, src;
+
+            memcpy(&in, CMSG_DATA(cm), sizeof(in));
+            memset(&src, 0, sizeof(src));
+            src.ipi_spec_dst = in.ipi_addr;
+            out->cmsg_level = IPPROTO_IP;
+            out->cmsg_type = IP_PKTINFO;
+            out->cmsg_len = CMSG_LEN(sizeof(src));
+            memcpy(CMSG_DATA(out), &src, sizeof(src));
+            return CMSG_SPACE(sizeof(src));
+        }
+        if (cm->cmsg_level == IPPROTO_IPV6 && cm->cmsg_type == IPV6_PKTINFO) {
+            struct in6_pktinfo src;
+
+            // The interface too, a link-local address means nothing without it
+            memcpy(&src, CMSG_DATA(cm), sizeof(src));
+            out->cmsg_level = IPPROTO_IPV6;
+            out->cmsg_type = IPV6_PKTINFO;
+            out->cmsg_len = CMSG_LEN(sizeof(src));
+            memcpy(CMSG_DATA(out), &src, sizeof(src));
+            return CMSG_SPACE(sizeof(src));
+        }
+    }
+    return 0;
+}
+
+static void* server_thread(void* arg) {
+    server_thread_t* st = arg;
+    ntp_packet_t requests[NTP_SERVER_BATCH];
+    ntp_packet_t replies[NTP_SERVER_BATCH];
+    struct sockaddr_storage from[NTP_SERVER_BATCH];
+    char control[NTP_SERVER_BATCH][SERVER_CONTROL_LEN] __attribute__((aligned(8)));
+    char out_control[NTP_SERVER_BATCH][SERVER_PKTINFO_LEN] __attribute__((aligned(8)));
+    struct iovec in_iov[NTP_SERVER_BATCH], out_iov[NTP_SERVER_BATCH];
+    struct mmsghdr in[NTP_SERVER_BATCH], out[NTP_SERVER_BATCH];
+    ntp_packet_t reply_template;
+    int8_t precision = clock_precision();
+    time_t refreshed = 0;
+
+    if (st->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(st->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    memset(in, 0, sizeof(in));
+    for (int i = 0; i < NTP_SERVER_BATCH; i++) {
+        in_iov[i] = (struct iovec){ &requests[i], sizeof(requests[i]) };
+        in[i].msg_hdr.msg_name = &from[i];
+        in[i].msg_hdr.msg_iov = &in_iov[i];
+        in[i].msg_hdr.msg_iovlen = 1;
+        in[i].msg_hdr.msg_control = control[i];
+    }
+
+    while (!stop) {
+        for (int i = 0; i < NTP_SERVER_BATCH; i++) {
+            in[i].msg_hdr.msg_namelen = sizeof(from[i]);
+            in[i].msg_hdr.msg_controllen = sizeof(control[i]);
+        }
+        // Block for the first datagram, then take whatever else is queued
+        int n = recvmmsg(st->sockfd, in, NTP_SERVER_BATCH, MSG_WAITFORONE, NULL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                continue;
+            }
+            perror("recvmmsg");
+            break;
+        }
+
+        time_t now = time(NULL);
+        if (now != refreshed) {
+            build_reply_template(&reply_template, precision, st);
+            refreshed = now;
+        }
+
+        int nout = 0;
+        for (int i = 0; i < n; i++) {
+            ntp_packet_t* req = &requests[i];
+            ntp_packet_t* rep = &replies[nout];
+            ntp_timestamp_t recv_time;
+
+            if (in[i].msg_len < sizeof(ntp_packet_t)) {
+                st->dropped++;
+                continue;
+            }
+            ntp_rx_timestamp(&in[i].msg_hdr, &recv_time);
+            ntp_to_host(req);
+            if (GET_NTP_MODE(req) != NTP_MODE_CLIENT) {
+                st->dropped++;
+                continue;
+            }
+
+            // Answer in the client's version, the rest from the template
+            *rep = reply_template;
+            SET_NTP_LI_VN_MODE(rep, GET_NTP_LI(&reply_template), GET_NTP_VN(req), NTP_MODE_SERVER);
+            rep->poll = req->poll;
+            rep->orig_time = req->xmit_time;
+            rep->recv_time = recv_time;
+
+            out_iov[nout] = (struct iovec){ rep, sizeof(*rep) };
+            memset(&out[nout], 0, sizeof(out[nout]));
+            out[nout].msg_hdr.msg_name = &from[i];
+            out[nout].msg_hdr.msg_namelen = in[i].msg_hdr.msg_namelen;
+            out[nout].msg_hdr.msg_iov = &out_iov[nout];
+            out[nout].msg_hdr.msg_iovlen = 1;
+            out[nout].msg_hdr.msg_controllen = reply_source(&in[i].msg_hdr, out_control[nout]);
+            if (out[nout].msg_hdr.msg_controllen > 0) {
+                out[nout].msg_hdr.msg_control = out_control[nout];
+            }
+            nout++;
+        }
+        st->requests += n;
+        if (nout == 0) {
+            continue;
+        }
+
+        // One T3 for the batch, as late as possible
+        ntp_timestamp_t xmit_time;
+        get_current_ntp_time(&xmit_time);
+        for (int i = 0; i < nout; i++) {
+            replies[i].xmit_time = xmit_time;
+            ntp_to_net(&replies[i]);
+        }
+        for (int sent = 0; sent < nout; ) {
+            int rc = sendmmsg(st->sockfd, out + sent, nout - sent, 0);
+            if (rc < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                st->dropped += nout - sent;
+                break;
+            }
+            sent += rc;
+            __atomic_store_n(&st->replies, st->replies + rc, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * An IPv4 address names the server we follow, as at stratum 2 and up, up
+ * to 4 characters the source of a stratum 1 server ("GPS", "PPS")
+ */
+static int parse_refid(const char* text, uint32_t* refid) {
+    struct in_addr addr;
+    size_t len = strlen(text);
+
+    if (inet_pton(AF_INET, text, &addr) == 1) {
+        *refid = ntohl(addr.s_addr);
+        return 0;
+    }
+    if (len == 0 || len > 4) {
+        return -1;
+    }
+    *refid = 0;
+    for (size_t i = 0; i < 4; i++) {
+        *refid = (*refid << 8) | (i < len ? (uint8_t)text[i] : 0);
+    }
+    return 0;
+}
+
+int run_ntp_server(int port, int nthreads, int stratum, const char* refid) {
+    cpu_set_t online;
+    int cpus[CPU_SETSIZE];
+    int ncpus = 0;
+
+    if (stratum < 1 || stratum >= NTP_MAXSTRAT) {
+        fprintf(stderr, "Stratum must be 1 to %d\n", NTP_MAXSTRAT - 1);
+        return 1;
+    }
+    if (refid != NULL && parse_refid(refid, &server_refid) < 0) {
+        fprintf(stderr, "Reference ID must be an IPv4 address or 1 to 4 characters: %s\n", refid);
+        return 1;
+    }
+    server_stratum = stratum;
+
+    if (sched_getaffinity(0, sizeof(online), &online) == 0) {
+        for (int c = 0; c < CPU_SETSIZE; c++) {
+            if (CPU_ISSET(c, &online)) {
+                cpus[ncpus++] = c;
+            }
+        }
+    }
+    if (nthreads <= 0) {
+        nthreads = ncpus > 0 ? ncpus : 1;
+    }
+
+    if (!port_is_free(port)) {
+        return 1;
+    }
+
+    server_thread_t* threads = calloc(nthreads, sizeof(*threads));
+    if (threads == NULL) {
+        perror("calloc");
+        return 1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    int started = 0;
+    for (; started < nthreads; started++) {
+        server_thread_t* st = &threads[started];
+        st->cpu = ncpus > 0 ? cpus[started % ncpus] : -1;
+        st->sockfd = open_server_socket(port);
+        if (st->sockfd < 0 || pthread_create(&st->thread, NULL, server_thread, st) != 0) {
+            if (st->sockfd >= 0) {
+                close(st->sockfd);
+            }
+            stop = 1;
+            break;
+        }
+    }
+    if (started == nthreads) {
+        printf("Serving NTP on port %d with %d thread(s), Ctrl-C to stop\n", port, nthreads);
+    }
+
+    // Once a second: how many requests all threads answered since the last
+    uint64_t last = 0;
+    while (!stop) {
+        struct timespec second = { 1, 0 };
+        nanosleep(&second, NULL);
+
+        uint64_t replies = 0;
+        for (int i = 0; i < started; i++) {
+            replies += __atomic_load_n(&threads[i].replies, __ATOMIC_RELAXED);
+        }
+        if (replies != last) {
+            printf("%10llu replies/s\n", (unsigned long long)(replies - last));
+            last = replies;
+        }
+    }
+
+    uint64_t requests = 0, replies = 0, dropped = 0;
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i].thread, NULL);
+        close(threads[i].sockfd);
+        requests += threads[i].requests;
+        replies += threads[i].replies;
+        dropped += threads[i].dropped;
+    }
+    printf("\nStopped: %llu requests, %llu replies, %llu dropped\n",
+           (unsigned long long)requests, (unsigned long long)replies,
+           (unsigned long long)dropped);
+    free(threads);
+    return started == nthreads ? 0 : 1;
+}
@@ -0,0 +1,55 @@
+/*
+ * NTP Server Mode
+ *
+ * The same packet format that asks for the time also answers: a server
+ * copies the client's transmit timestamp into the origin field, fills in
+ * when the request arrived (T2) and when the reply leaves (T3), and sends
+ * it back in NTP_MODE_SERVER.  Answering is so little work that the cost
+ * is all in the system calls, so the server (-S) is built to make few:
+ *
+ * - One SO_REUSEPORT socket per thread, one thread per CPU and pinned to
+ *   it.  The kernel spreads the clients over the sockets by a hash of
+ *   their address, nothing is shared between the threads.  The port must
+ *   be free when the server starts, so a second server refuses to start
+ *   rather than join the group and take a share of the clients.
+ * - recvmmsg() takes up to NTP_SERVER_BATCH requests in one call and
+ *   sendmmsg() sends all their replies in one call.
+ * - T2 is the kernel receive stamp of each request (see ntp-rxtime.h), so
+ *   time spent waiting in the socket buffer is not counted against us.
+ *   T3 is read once per batch, right before sendmmsg().
+ * - Each reply leaves from the address its request was sent to, taken
+ *   from IP_PKTINFO/IPV6_PKTINFO, so a client that asked a secondary
+ *   address or a VIP gets an answer it recognizes.
+ *
+ * Leap indicator and root dispersion come from the kernel clock
+ * (adjtimex()), refreshed once a second: while something keeps it
+ * synchronized (ntpd, chronyd or the -D mode of this client) the server
+ * answers as synchronized, otherwise it answers unsynchronized and clients
+ * will not use it.  The kernel does not know where its time comes from,
+ * so the rest of what a synchronized reply advertises is synthetic:
+ *
+ * - Stratum and reference ID are configured (-r, -u), NTP_SERVER_STRATUM
+ *   and 127.127.1.0 unless told otherwise.  Set them to match the upstream.
+ * - The root delay is a conservative NTP_SERVER_ROOT_DELAY.
+ * - The reference time is when the maximum error of the kernel clock was
+ *   last seen to drop, which is when the daemon updated it, or the oldest
+ *   that update can be going by how far the error has grown.
+ */
+
+#ifndef NTP_SERVER_H
+#define NTP_SERVER_H
+
+#define NTP_SERVER_BATCH    64          // Datagrams per recvmmsg()/sendmmsg()
+#define NTP_SERVER_STRATUM  2           // Advertised while the clock is synced (-r)
+#define NTP_SERVER_REFID    0x7f7f0100  // 127.127.1.0, the upstream is unknown (-u)
+#define NTP_SERVER_UNSYNC_REFID 0x494e4954  // "INIT"
+#define NTP_SERVER_RCVBUF   (4 << 20)   // Socket receive buffer (bytes)
+#define NTP_SERVER_ROOT_DELAY 0.1       // Advertised, the upstream path is unknown (s)
+#define NTP_SERVER_MAXERR_GROWTH 500    // Kernel maximum error growth (us per s)
+
+// Answer client requests on port with nthreads sockets (0 = one per CPU)
+// until SIGINT or SIGTERM.  Synchronized replies advertise stratum and
+// refid, an IPv4 address or up to 4 characters (NULL for the default).
+int run_ntp_server(int port, int nthreads, int stratum, const char* refid);
+
+#endif
@@ -0,0 +1,378 @@
+/*
+ *  du-bench - throughput and latency benchmark for du-proto
+ *
+ *  Runs a du-proto server and client over loopback and reports, for every
+ *  combination of payload size and impairment setting, the achieved Mbps,
+ *  packets per second, per message latency percentiles and the duplicate
+ *  ACK count.  Results are written one record per line, either as JSON
+ *  (the default) or as CSV, so they can be fed straight into a spreadsheet
+ *  or a plotting script.
+ *
+ *  The server runs in a forked child.  When an impairment delay is asked
+ *  for, a second child runs a small UDP relay between the client and the
+ *  server that holds every datagram for the requested number of micro-
+ *  seconds before forwarding it.  du-proto is stop-and-wait, there is no
+ *  send window to sweep, so each message costs one full round trip.  It
+ *  never retransmits either, so there is no retransmission count to show.
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "du-proto.h"
+
+#define BENCH_DEF_PORT      2180
+#define BENCH_DEF_MSGS      2000
+#define BENCH_DEF_SIZES     "64,256,512"
+#define BENCH_DEF_DELAYS    "0,50,200"
+#define BENCH_MAX_SWEEP     16
+#define BENCH_LOOPBACK      "127.0.0.1"
+
+#define BENCH_FMT_JSON      0
+#define BENCH_FMT_CSV       1
+
+#define BENCH_ROLE_SERVER   0
+#define BENCH_ROLE_RELAY    1
+
+typedef struct bench_config{
+    int     port_number;
+    int     msg_count;
+    int     out_format;
+    int     num_sizes;
+    int     sizes[BENCH_MAX_SWEEP];
+    int     num_delays;
+    int     delays[BENCH_MAX_SWEEP];
+} bench_config;
+
+typedef struct bench_result{
+    int         payload_sz;
+    int         delay_us;
+    int         msgs;
+    uint64_t    bytes;
+    double      elapsed_sec;
+    uint64_t    lat_p50_ns;
+    uint64_t    lat_p99_ns;
+    uint64_t    lat_p999_ns;
+    uint64_t    dup_acks;
+    uint64_t    srtt_us;
+} bench_result;
+
+static uint64_t now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ *  Parses a comma separated list of integers like "64,256,512" into
+ *  list, returns the number of entries parsed.
+ */
+static int parse_list(char *str, int *list, int max){
+    int n = 0;
+    char *tok = strtok(str, ",");
+
+    while ((tok != NULL) && (n < max)){
+        list[n++] = atoi(tok);
+        tok = strtok(NULL, ",");
+    }
+    return n;
+}
+
+static void initParams(int argc, char *argv[], bench_config *cfg){
+    int option;
+    char sizes[128] = BENCH_DEF_SIZES;
+    char delays[128] = BENCH_DEF_DELAYS;
+
+    cfg->port_number = BENCH_DEF_PORT;
+    cfg->msg_count = BENCH_DEF_MSGS;
+    cfg->out_format = BENCH_FMT_JSON;
+
+    while ((option = getopt(argc, argv, ":p:n:s:d:ch")) != -1){
+        switch(option) {
+            case 'p':
+                cfg->port_number = atoi(optarg);
+                break;
+            case 'n':
+                cfg->msg_count = atoi(optarg);
+                break;
+            case 's':
+                strncpy(sizes, optarg, sizeof(sizes) - 1);
+                break;
+            case 'd':
+                strncpy(delays, optarg, sizeof(delays) - 1);
+                break;
+            case 'c':
+                cfg->out_format = BENCH_FMT_CSV;
+                break;
+            case 'h':
+                printf("USAGE: %s [-p port] [-n msgs] [-s sizes] [-d delays] [-c] [-h]\n", argv[0]);
+                printf("WHERE:\n\t[-p port] base port, the relay uses port+1; DEFAULT = %d\n", BENCH_DEF_PORT);
+                printf("\t[-n msgs] messages sent per run; DEFAULT = %d\n", BENCH_DEF_MSGS);
+                printf("\t[-s sizes] comma separated payload sizes in bytes; DEFAULT = %s\n", BENCH_DEF_SIZES);
+                printf("\t[-d delays] comma separated one-way relay delays in usec; DEFAULT = %s\n", BENCH_DEF_DELAYS);
+                printf("\t[-c] write CSV instead of JSON lines\n");
+                printf("\t[-h] displays what you are looking at now - the help\n\n");
+                exit(0);
+            case ':':
+                fprintf(stderr, "Option -%c missing value\n", optopt);
+                exit(-1);
+            default:
+                fprintf(stderr, "Unknown option -%c\n", optopt);
+                exit(-1);
+        }
+    }
+
+    cfg->num_sizes = parse_list(sizes, cfg->sizes, BENCH_MAX_SWEEP);
+    cfg->num_delays = parse_list(delays, cfg->delays, BENCH_MAX_SWEEP);
+    if (cfg->msg_count < 1)
+        cfg->msg_count = 1;
+}
+
+/*
+ *  Server side of a run, executed in a child process.  Signals the parent
+ *  through ready_fd once the socket is bound so the client never sends its
+ *  CONNECT into a port nobody is listening on.
+ */
+static void bench_server(int port, int ready_fd){
+    static char rBuff[DP_MAX_BUFF_SZ];
+    int rcvSz;
+
+    dp_connp dpc = dpServerInit(port);
+    if (dpc == NULL)
+        exit(-1);
+    write(ready_fd, "R", 1);
+    close(ready_fd);
+
+    if (dplisten(dpc) < 0)
+        exit(-1);
+
+    while(1) {
+        rcvSz = dprecv(dpc, rBuff, sizeof(rBuff));
+        if (rcvSz == DP_CONNECTION_CLOSED)
+            exit(0);
+        if (rcvSz < 0)
+            exit(-1);
+    }
+}
+
+/*
+ *  UDP relay used to impair the path, executed in a child process.  The
+ *  first peer that is not the server is taken to be the client, every
+ *  datagram is held for delay_us and then forwarded to the other side.
+ */
+static void bench_relay(int listen_port, int svr_port, int delay_us, int ready_fd){
+    static char buff[DP_MAX_DGRAM_SZ];
+    struct sockaddr_in me = {0}, svr = {0}, cli = {0}, from;
+    socklen_t fromLen;
+    bool haveCli = false;
+    int bytes;
+
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0)
+        exit(-1);
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
+
+    me.sin_family = AF_INET;
+    me.sin_addr.s_addr = inet_addr(BENCH_LOOPBACK);
+    me.sin_port = htons(listen_port);
+    if (bind(sock, (struct sockaddr *)&me, sizeof(me)) < 0){
+        perror("relay bind failed");
+        exit(-1);
+    }
+    svr.sin_family = AF_INET;
+    svr.sin_addr.s_addr = inet_addr(BENCH_LOOPBACK);
+    svr.sin_port = htons(svr_port);
+
+    write(ready_fd, "R", 1);
+    close(ready_fd);
+
+    while(1) {
+        fromLen = sizeof(from);
+        bytes = recvfrom(sock, buff, sizeof(buff), 0, (struct sockaddr *)&from, &fromLen);
+        if (bytes < 0)
+            exit(-1);
+        if (delay_us > 0)
+            usleep(delay_us);
+
+        if ((from.sin_port == svr.sin_port) && (from.sin_addr.s_addr == svr.sin_addr.s_addr)){
+            if (haveCli)
+                sendto(sock, buff, bytes, 0, (struct sockaddr *)&cli, sizeof(cli));
+        } else {
+            cli = from;
+            haveCli = true;
+            sendto(sock, buff, bytes, 0, (struct sockaddr *)&svr, sizeof(svr));
+        }
+    }
+}
+
+/*
+ *  Forks the server or the relay into a child and waits until it reports
+ *  that it is ready, returns the pid of the child.
+ */
+static pid_t bench_spawn(int role, int port, int svr_port, int delay_us){
+    int fds[2];
+    char c;
+
+    //children exit() through stdio, don't let them replay our buffer
+    fflush(stdout);
+    if (pipe(fds) < 0){
+        perror("pipe");
+        exit(-1);
+    }
+    pid_t pid = fork();
+    if (pid < 0){
+        perror("fork");
+        exit(-1);
+    }
+    if (pid == 0){
+        close(fds[0]);
+        if (role == BENCH_ROLE_SERVER)
+            bench_server(port, fds[1]);
+        else
+            bench_relay(port, svr_port, delay_us, fds[1]);
+        exit(0);
+    }
+    close(fds[1]);
+    if (read(fds[0], &c, 1) != 1){
+        fprintf(stderr, "benchmark child %d failed to start\n", pid);
+        exit(-1);
+    }
+    close(fds[0]);
+    return pid;
+}
+
+static int cmp_u64(const void *a, const void *b){
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(uint64_t *sorted, int n, int per_mille){
+    int idx = (int)(((int64_t)n * per_mille) / 1000);
+    if (idx >= n)
+        idx = n - 1;
+    return sorted[idx];
+}
+
+static int bench_run(bench_config *cfg, int payload_sz, int delay_us, bench_result *res){
+    static char sBuff[DP_MAX_BUFF_SZ];
+    pid_t relay = 0;
+    int connectPort = cfg->port_number;
+    int i, rc;
+
+    uint64_t *lat = malloc(sizeof(uint64_t) * cfg->msg_count);
+    if (lat == NULL)
+        return -1;
+
+    memset(sBuff, 'X', sizeof(sBuff));
+    pid_t server = bench_spawn(BENCH_ROLE_SERVER, cfg->port_number, 0, 0);
+    if (delay_us > 0){
+        connectPort = cfg->port_number + 1;
+        relay = bench_spawn(BENCH_ROLE_RELAY, connectPort, cfg->port_number, delay_us);
+    }
+
+    dp_connp dpc = dpClientInit(BENCH_LOOPBACK, connectPort);
+    if ((dpc == NULL) || (dpconnect(dpc) < 0)){
+        fprintf(stderr, "benchmark client could not connect\n");
+        exit(-1);
+    }
+
+    uint64_t start = now_ns();
+    for (i = 0; i < cfg->msg_count; i++){
+        uint64_t t0 = now_ns();
+        rc = dpsend(dpc, sBuff, payload_sz);
+        lat[i] = now_ns() - t0;
+        if (rc != payload_sz){
+            fprintf(stderr, "dpsend returned %d, expected %d\n", rc, payload_sz);
+            break;
+        }
+    }
+    uint64_t end = now_ns();
+
+    dp_stats st;
+    dp_get_stats(dpc, &st);
+    res->dup_acks = st.dup_acks;
+    res->srtt_us = st.srtt_us;
+    dpdisconnect(dpc);
+
+    waitpid(server, NULL, 0);
+    if (relay > 0){
+        kill(relay, SIGTERM);
+        waitpid(relay, NULL, 0);
+    }
+
+    qsort(lat, i, sizeof(uint64_t), cmp_u64);
+    res->payload_sz = payload_sz;
+    res->delay_us = delay_us;
+    res->msgs = i;
+    res->bytes = (uint64_t)i * payload_sz;
+    res->elapsed_sec = (end - start) / 1e9;
+    res->lat_p50_ns = (i > 0) ? percentile(lat, i, 500) : 0;
+    res->lat_p99_ns = (i > 0) ? percentile(lat, i, 990) : 0;
+    res->lat_p999_ns = (i > 0) ? percentile(lat, i, 999) : 0;
+
+    free(lat);
+    return (i == cfg->msg_count) ? 0 : -1;
+}
+
+static void print_result(bench_config *cfg, bench_result *res){
+    double mbps = (res->bytes * 8.0) / res->elapsed_sec / 1e6;
+    double pps = res->msgs / res->elapsed_sec;
+
+    if (cfg->out_format == BENCH_FMT_CSV){
+        printf("%d,%d,%d,%llu,%.6f,%.3f,%.1f,%.3f,%.3f,%.3f,%llu,%llu\n",
+            res->payload_sz, res->delay_us, res->msgs,
+            (unsigned long long)res->bytes, res->elapsed_sec, mbps, pps,
+            res->lat_p50_ns / 1e3, res->lat_p99_ns / 1e3, res->lat_p999_ns / 1e3,
+            (unsigned long long)res->dup_acks, (unsigned long long)res->srtt_us);
+    } else {
+        printf("{\"payload_bytes\":%d,\"delay_us\":%d,\"msgs\":%d,\"bytes\":%llu,"
+            "\"elapsed_sec\":%.6f,\"mbps\":%.3f,\"pps\":%.1f,"
+            "\"lat_p50_us\":%.3f,\"lat_p99_us\":%.3f,\"lat_p999_us\":%.3f,"
+            "\"dup_acks\":%llu,\"srtt_us\":%llu}\n",
+            res->payload_sz, res->delay_us, res->msgs,
+            (unsigned long long)res->bytes, res->elapsed_sec, mbps, pps,
+            res->lat_p50_ns / 1e3, res->lat_p99_ns / 1e3, res->lat_p999_ns / 1e3,
+            (unsigned long long)res->dup_acks, (unsigned long long)res->srtt_us);
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    bench_config cfg;
+    bench_result res;
+    int s, d, rc = 0;
+
+    initParams(argc, argv, &cfg);
+
+    //the per packet PDU dump would dominate every measurement
+    dpsetdebug(0);
+
+    if (cfg.out_format == BENCH_FMT_CSV)
+        printf("payload_bytes,delay_us,msgs,bytes,elapsed_sec,mbps,pps,"
+            "lat_p50_us,lat_p99_us,lat_p999_us,dup_acks,srtt_us\n");
+
+    for (d = 0; d < cfg.num_delays; d++){
+        for (s = 0; s < cfg.num_sizes; s++){
+            if ((cfg.sizes[s] < 1) || (cfg.sizes[s] > dpmaxdgram())){
+                fprintf(stderr, "skipping payload size %d, must be 1..%d\n",
+                    cfg.sizes[s], dpmaxdgram());
+                continue;
+            }
+            if (bench_run(&cfg, cfg.sizes[s], cfg.delays[d], &res) < 0)
+                rc = -1;
+            print_result(&cfg, &res);
+        }
+    }
+    return rc;
+}
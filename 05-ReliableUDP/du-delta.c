@@ -0,0 +1,161 @@
+#include <stdlib.h>
+
+#include "du-delta.h"
+
+//chained hash table over the weak checksums of the basis blocks
+struct dd_index{
+    const ftp_sig   *sigs;
+    uint32_t        num_blocks;
+    uint32_t        block_sz;
+    uint32_t        shift;
+    uint32_t        *head;          //block + 1 per bucket, 0 if empty
+    uint32_t        *next;          //block + 1 of the next in the chain
+};
+
+/*
+ *  Block size grows with the square root of the file like rsync does, it
+ *  keeps the checksum list small without making matches too coarse
+ */
+uint32_t dd_block_size(uint64_t basis_size){
+    uint64_t bs = FTP_DELTA_MIN_BLOCK;
+
+    while ((bs < FTP_DELTA_MAX_BLOCK) && (bs * bs < basis_size))
+        bs += 64;
+    return (uint32_t)bs;
+}
+
+void dd_make_sigs(const uint8_t *basis, uint32_t block_sz, uint32_t num_blocks,
+                  ftp_sig *sigs){
+    for (uint32_t i = 0; i < num_blocks; i++){
+        const uint8_t *blk = basis + (uint64_t)i * block_sz;
+
+        sigs[i].weak = dh_weak(blk, block_sz);
+        sigs[i].reserved = 0;
+        sigs[i].strong = dh_xxh64(blk, block_sz, 0);
+    }
+}
+
+static inline uint32_t bucket_of(const dd_index *idx, uint32_t weak){
+    return (weak * 0x9E3779B1u) >> idx->shift;
+}
+
+dd_index *dd_index_build(const ftp_sig *sigs, uint32_t num_blocks, uint32_t block_sz){
+    dd_index *idx = calloc(1, sizeof(dd_index));
+    uint32_t bits = 4;
+
+    if (idx == NULL)
+        return NULL;
+    while (((1u << bits) < 2 * num_blocks) && (bits < 30))
+        bits++;
+    idx->sigs = sigs;
+    idx->num_blocks = num_blocks;
+    idx->block_sz = block_sz;
+    idx->shift = 32 - bits;
+    idx->head = calloc(1u << bits, sizeof(uint32_t));
+    idx->next = calloc(num_blocks + 1, sizeof(uint32_t));
+    if ((idx->head == NULL) || (idx->next == NULL)){
+        dd_index_free(idx);
+        return NULL;
+    }
+
+    //insert backwards so every chain lists the lowest block first
+    for (uint32_t i = num_blocks; i > 0; i--){
+        uint32_t b = bucket_of(idx, sigs[i - 1].weak);
+        idx->next[i - 1] = idx->head[b];
+        idx->head[b] = i;
+    }
+    return idx;
+}
+
+void dd_index_free(dd_index *idx){
+    if (idx == NULL)
+        return;
+    free(idx->head);
+    free(idx->next);
+    free(idx);
+}
+
+/*
+ *  Looks up the window at data, returns the matching block or -1.  The
+ *  strong checksum is only computed once a weak checksum matched, hint is
+ *  tried first so runs of identical blocks keep coalescing into one COPY.
+ */
+static int64_t index_lookup(const dd_index *idx, uint32_t weak, const uint8_t *data,
+                            uint32_t hint){
+    uint32_t i = idx->head[bucket_of(idx, weak)];
+    uint64_t strong = 0;
+    int have_strong = 0;
+
+    if (i == 0)
+        return -1;
+    if ((hint < idx->num_blocks) && (idx->sigs[hint].weak == weak)){
+        strong = dh_xxh64(data, idx->block_sz, 0);
+        have_strong = 1;
+        if (idx->sigs[hint].strong == strong)
+            return hint;
+    }
+    for (; i != 0; i = idx->next[i - 1]){
+        const ftp_sig *s = &idx->sigs[i - 1];
+
+        if (s->weak != weak)
+            continue;
+        if (!have_strong){
+            strong = dh_xxh64(data, idx->block_sz, 0);
+            have_strong = 1;
+        }
+        if (s->strong == strong)
+            return i - 1;
+    }
+    return -1;
+}
+
+/*
+ *  Walks src and reports it as literal ranges and copies of basis blocks,
+ *  in file order.  Adjacent copies of adjacent blocks are merged.
+ */
+int dd_scan(dd_index *idx, const uint8_t *src, uint64_t size,
+            dd_literal_fn on_literal, dd_copy_fn on_copy, void *ctx){
+    uint32_t bs = idx->block_sz;
+    uint64_t pos = 0, lit = 0;
+    uint64_t copy_off = 0;
+    uint32_t copy_blk = 0, copy_cnt = 0;
+    uint32_t weak = 0;
+    int have_weak = 0, rc;
+
+    while ((idx->num_blocks > 0) && (pos + bs <= size)){
+        if (!have_weak){
+            weak = dh_weak(src + pos, bs);
+            have_weak = 1;
+        }
+
+        int64_t blk = index_lookup(idx, weak, src + pos, copy_blk + copy_cnt);
+        if (blk >= 0){
+            if ((copy_cnt > 0) && (lit == pos) && (copy_off + (uint64_t)copy_cnt * bs == pos) &&
+                    (copy_blk + copy_cnt == blk)){
+                copy_cnt++;
+            } else {
+                if ((copy_cnt > 0) && ((rc = on_copy(ctx, copy_off, copy_blk, copy_cnt)) != 0))
+                    return rc;
+                if ((lit < pos) && ((rc = on_literal(ctx, lit, pos - lit)) != 0))
+                    return rc;
+                copy_off = pos;
+                copy_blk = blk;
+                copy_cnt = 1;
+            }
+            pos += bs;
+            lit = pos;
+            have_weak = 0;
+            continue;
+        }
+
+        if (pos + bs < size)
+            weak = dh_weak_roll(weak, bs, src[pos], src[pos + bs]);
+        pos++;
+    }
+
+    if ((copy_cnt > 0) && ((rc = on_copy(ctx, copy_off, copy_blk, copy_cnt)) != 0))
+        return rc;
+    if ((lit < size) && ((rc = on_literal(ctx, lit, size - lit)) != 0))
+        return rc;
+    return 0;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "du-hash.h"
+
+/*
+ * rsync style delta encoding for du-ftp
+ *
+ * The receiver cuts its current copy of a file (the basis) into fixed size
+ * blocks and sends a weak rolling and a strong checksum for each one.  The
+ * sender slides a window over the new version, every offset where both
+ * checksums match a basis block becomes a COPY of that block, everything
+ * in between is sent as literal bytes.  Only whole blocks are matched, a
+ * short last block of the basis is never reused.
+ */
+#define FTP_DELTA_MIN_BLOCK     1024
+#define FTP_DELTA_MAX_BLOCK     (64 * 1024)
+
+//checksums of one basis block, sent as is on the wire
+typedef struct ftp_sig{
+    uint32_t    weak;
+    uint32_t    reserved;
+    uint64_t    strong;
+} ftp_sig;
+
+typedef struct dd_index dd_index;
+
+//callbacks of dd_scan(), a non zero return stops the scan
+typedef int (*dd_literal_fn)(void *ctx, uint64_t offset, uint64_t len);
+typedef int (*dd_copy_fn)(void *ctx, uint64_t offset, uint32_t block, uint32_t count);
+
+uint32_t  dd_block_size(uint64_t basis_size);
+void      dd_make_sigs(const uint8_t *basis, uint32_t block_sz, uint32_t num_blocks,
+                       ftp_sig *sigs);
+dd_index *dd_index_build(const ftp_sig *sigs, uint32_t num_blocks, uint32_t block_sz);
+void      dd_index_free(dd_index *idx);
+int       dd_scan(dd_index *idx, const uint8_t *src, uint64_t size,
+                  dd_literal_fn on_literal, dd_copy_fn on_copy, void *ctx);
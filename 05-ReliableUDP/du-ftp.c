@@ -1,18 +1,51 @@
+#define _GNU_SOURCE     //copy_file_range(), pthread_setaffinity_np()
 #include <stdlib.h>
 #include <unistd.h> 
 #include <string.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <errno.h>
 #include <getopt.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "du-ftp.h"
 #include "du-proto.h"
+#include "du-writer.h"
 
 
-#define BUFF_SZ 512
-static char sbuffer[BUFF_SZ];
-static char rbuffer[BUFF_SZ];
-static char full_file_path[FNAME_SZ];
+/*
+ *  A rate in bits per second, with an optional k, m or g (powers of 1000)
+ */
+static uint64_t parse_rate(const char *arg){
+    char *end;
+    uint64_t rate = strtoull(arg, &end, 10);
+
+    switch (*end){
+        case 'k': case 'K': rate *= 1000ULL; end++; break;
+        case 'm': case 'M': rate *= 1000000ULL; end++; break;
+        case 'g': case 'G': rate *= 1000000000ULL; end++; break;
+    }
+    if ((end == arg) || (*end != '\0') || (rate < 8)){
+        printf("ERROR: bad rate %s, expected bits per second like 800k or 20m\n", arg);
+        exit(-1);
+    }
+    return rate;
+}
+
+static int parse_prio(const char *arg){
+    if (strcmp(arg, "bulk") == 0)
+        return DP_PRIO_BULK;
+    if (strcmp(arg, "normal") == 0)
+        return DP_PRIO_NORMAL;
+    if (strcmp(arg, "interactive") == 0)
+        return DP_PRIO_INTERACTIVE;
+    printf("ERROR: unknown priority class %s, expected bulk, normal or interactive\n", arg);
+    exit(-1);
+}
 
 /*
  *  Helper function that processes the command line arguements.  Highlights
@@ -34,8 +67,19 @@ static int initParams(int argc, char *argv[], prog_config *cfg){
     cfg->port_number = DEF_PORT_NO;
     strcpy(cfg->file_name, PROG_DEF_FNAME);
     strcpy(cfg->svr_ip_addr, PROG_DEF_SVR_ADDR);
+    cfg->metrics_file[0] = '\0';
+    cfg->num_streams = 1;
+    cfg->delta = 0;
+    cfg->compress = 0;
+    cfg->batch = 0;
+    cfg->workers = 0;
+    cfg->direct = 0;
+    cfg->rate = 0;
+    cfg->prio = DP_PRIO_NORMAL;
+    cfg->dscp = 0;
+    cfg->bucket = NULL;
     
-    while ((option = getopt(argc, argv, ":p:f:a:csh")) != -1){
+    while ((option = getopt(argc, argv, ":p:f:a:m:n:w:b:q:dzrotcsh")) != -1){
         switch(option) {
             case 'p':
                 strncpy(cmdBuffer, optarg, sizeof(cmdBuffer));
@@ -47,6 +91,36 @@ static int initParams(int argc, char *argv[], prog_config *cfg){
             case 'a':
                 strncpy(cfg->svr_ip_addr, optarg, sizeof(cfg->svr_ip_addr));
                 break;
+            case 'm':
+                strncpy(cfg->metrics_file, optarg, sizeof(cfg->metrics_file) - 1);
+                break;
+            case 'n':
+                cfg->num_streams = atoi(optarg);
+                break;
+            case 'w':
+                cfg->workers = atoi(optarg);
+                break;
+            case 'b':
+                cfg->rate = parse_rate(optarg);
+                break;
+            case 'q':
+                cfg->prio = parse_prio(optarg);
+                break;
+            case 't':
+                cfg->dscp = 1;
+                break;
+            case 'd':
+                cfg->delta = 1;
+                break;
+            case 'z':
+                cfg->compress = 1;
+                break;
+            case 'r':
+                cfg->batch = 1;
+                break;
+            case 'o':
+                cfg->direct = 1;
+                break;
             case 'c':
                 cfg->prog_mode = PROG_MD_CLI;
                 break;
@@ -54,11 +128,31 @@ static int initParams(int argc, char *argv[], prog_config *cfg){
                 cfg->prog_mode = PROG_MD_SVR;
                 break;
             case 'h':
-                printf("USAGE: %s [-p port] [-f fname] [-a svr_addr] [-s] [-c] [-h]\n", argv[0]);
+                printf("USAGE: %s [-p port] [-f fname] [-a svr_addr] [-n streams] [-d] [-z] [-r] [-w workers] [-o] [-b rate] [-q class] [-t] [-m metrics_file] [-s] [-c] [-h]\n", argv[0]);
                 printf("WHERE:\n\t[-c] runs in client mode, [-s] runs in server mode; DEFAULT= client_mode\n");
                 printf("\t[-a svr_addr] specifies the servers IP address as a string; DEFAULT = %s\n", cfg->svr_ip_addr);
                 printf("\t[-p portnum] specifies the port number; DEFAULT = %d\n", cfg->port_number);
-                printf("\t[-f fname] specifies the filename to send or recv; DEFAULT = %s\n", cfg->file_name);
+                printf("\t[-f fname] specifies the filename to send, the server uses the name the client sends; DEFAULT = %s\n", cfg->file_name);
+                printf("\t[-n streams] client: stripes the file over this many parallel connections\n"
+                       "\t\ton ports port..port+streams-1, max %d; DEFAULT = 1\n", FTP_MAX_STREAMS);
+                printf("\t[-d] client: delta mode, only sends what differs from the servers copy\n"
+                       "\t\tof the file, uses a single stream; DEFAULT = off\n");
+                printf("\t[-z] client: compresses blocks that compress well; DEFAULT = off\n");
+                printf("\t[-r] client: fname is a directory, sends the whole tree over one\n"
+                       "\t\tconnection, small files share datagrams; DEFAULT = off\n");
+                printf("\t[-w workers] server: keeps running and receives up to this many uploads at\n"
+                       "\t\tonce, one worker thread per CPU, max %d; DEFAULT = 0, serve one client\n",
+                       FTP_MAX_WORKERS);
+                printf("\t[-o] server: writes received files with O_DIRECT where the filesystem\n"
+                       "\t\tsupports it, bypassing the page cache; DEFAULT = off\n");
+                printf("\t[-b rate] caps what this side sends at rate bits per second, k, m and g\n"
+                       "\t\tsuffixes allowed, shared by all streams and sessions; DEFAULT = no cap\n");
+                printf("\t[-q class] priority class of the traffic: bulk, normal or interactive,\n"
+                       "\t\tsets SO_PRIORITY; DEFAULT = normal\n");
+                printf("\t[-t] also marks the priority class in the DSCP field of the IP header\n"
+                       "\t\t(bulk CS1, normal best effort, interactive AF41); DEFAULT = off\n");
+                printf("\t[-m metrics_file] dumps du-proto statistics every %d ms, Prometheus text\n"
+                       "\t\tif the name ends in .prom, JSON otherwise; DEFAULT = off\n", PROG_METRICS_MS);
                 printf("\t[-p] displays what you are looking at now - the help\n\n");
                 exit(0);
             case ':':
@@ -73,69 +167,1818 @@ static int initParams(int argc, char *argv[], prog_config *cfg){
     return cfg->prog_mode;
 }
 
-int server_loop(dp_connp dpc, void *sBuff, void *rBuff, int sbuff_sz, int rbuff_sz){
-    int rcvSz;
+/*
+ *  Hooks up the optional periodic statistics export for a connection, when
+ *  a transfer uses several streams each one gets its own file, name.<id>
+ */
+static void setup_metrics(dp_connp dpc, prog_config *cfg, int stream_id){
+    char path[sizeof(cfg->metrics_file) + 16];
+    int len = strlen(cfg->metrics_file);
+    int fmt = DP_STATS_FMT_JSON;
 
-    FILE *f = fopen(full_file_path, "wb+");
-    if(f == NULL){
-        printf("ERROR:  Cannot open file %s\n", full_file_path);
-        exit(-1);
+    if (len == 0)
+        return;
+    if ((len > 5) && (strcmp(cfg->metrics_file + len - 5, ".prom") == 0))
+        fmt = DP_STATS_FMT_PROM;
+    if (stream_id > 0)
+        snprintf(path, sizeof(path), "%s.%d", cfg->metrics_file, stream_id);
+    else
+        snprintf(path, sizeof(path), "%s", cfg->metrics_file);
+    if (dp_stats_export(dpc, path, fmt, PROG_METRICS_MS) != DP_NO_ERROR)
+        printf("WARNING: cannot export statistics to %s\n", path);
+}
+
+/*
+ *  Applies the rate cap and the priority class to a connection, every
+ *  connection of the process takes from the same bucket
+ */
+static void setup_traffic(dp_connp dpc, prog_config *cfg){
+    dp_set_bucket(dpc, cfg->bucket);
+    if (((cfg->prio != DP_PRIO_NORMAL) || cfg->dscp) &&
+            (dp_set_priority(dpc, cfg->prio, cfg->dscp) != DP_NO_ERROR))
+        printf("WARNING: cannot set the priority class of the connection\n");
+}
+
+/*
+ *  Sends one du-ftp message, the header and the payload go to du-proto as
+ *  two buffers so the payload is never copied.  Returns the payload size
+ *  or a DP_ error code.
+ */
+static int ftp_send(dp_connp dpc, ftp_pdu *hdr, const void *data, int data_sz){
+    struct iovec iov[2] = {
+        { .iov_base = hdr,          .iov_len = sizeof(ftp_pdu) },
+        { .iov_base = (void *)data, .iov_len = data_sz }
+    };
+
+    hdr->data_sz = data_sz;
+    int rc = dpsendv(dpc, iov, (data_sz > 0) ? 2 : 1);
+    if (rc < 0)
+        return rc;
+    return data_sz;
+}
+
+/*
+ *  Receives one du-ftp message, the header lands in hdr and the payload in
+ *  data.  Returns the payload size or a DP_ error code.
+ */
+static int ftp_recv(dp_connp dpc, ftp_pdu *hdr, void *data, int data_sz){
+    struct iovec iov[2] = {
+        { .iov_base = hdr,  .iov_len = sizeof(ftp_pdu) },
+        { .iov_base = data, .iov_len = data_sz }
+    };
+
+    int rc = dprecvv(dpc, iov, 2);
+    if (rc < 0)
+        return rc;
+    if ((rc < (int)sizeof(ftp_pdu)) || (hdr->data_sz != rc - (int)sizeof(ftp_pdu)))
+        return DP_ERROR_BAD_DGRAM;
+    return hdr->data_sz;
+}
+
+/*
+ *  Only the last path component of a client supplied name is used, so a
+ *  client can never write outside of the servers ./infile directory
+ */
+static int safe_file_name(const char *name, char *out, int out_sz){
+    const char *base = strrchr(name, '/');
+    base = (base == NULL) ? name : base + 1;
+
+    if ((base[0] == '\0') || (strcmp(base, ".") == 0) || (strcmp(base, "..") == 0))
+        return -1;
+    snprintf(out, out_sz, "%s", base);
+    return 0;
+}
+
+
+//// SERVER
+
+static void *server_stream_thread(void *arg);
+
+//names being received right now, only used by the worker pool
+static pthread_mutex_t busy_lock = PTHREAD_MUTEX_INITIALIZER;
+static char busy_names[FTP_MAX_WORKERS][FTP_NAME_SZ];
+
+/*
+ *  Concurrent sessions must not write the same file, a session holds the
+ *  name it receives until it ends.  Returns 0 if another session has it.
+ */
+static int server_claim(ftp_file *file){
+    int i, free_slot = -1;
+
+    if (file->cfg->workers <= 0)
+        return 1;
+    pthread_mutex_lock(&busy_lock);
+    for (i = 0; i < FTP_MAX_WORKERS; i++){
+        if (busy_names[i][0] == '\0'){
+            if (free_slot < 0)
+                free_slot = i;
+        } else if (strcmp(busy_names[i], file->name) == 0){
+            break;
+        }
+    }
+    if ((i == FTP_MAX_WORKERS) && (free_slot >= 0)){
+        strcpy(busy_names[free_slot], file->name);
+        file->claimed = 1;
+    }
+    pthread_mutex_unlock(&busy_lock);
+    return file->claimed;
+}
+
+static void server_release(ftp_file *file){
+    int i;
+
+    if (!file->claimed)
+        return;
+    pthread_mutex_lock(&busy_lock);
+    for (i = 0; i < FTP_MAX_WORKERS; i++)
+        if (strcmp(busy_names[i], file->name) == 0)
+            busy_names[i][0] = '\0';
+    pthread_mutex_unlock(&busy_lock);
+    file->claimed = 0;
+}
+
+/*
+ *  Reserves the whole file up front so it is laid out in a few large
+ *  extents instead of growing a little with every write, a full disk is
+ *  reported now rather than halfway through.  Filesystems without
+ *  fallocate() just get the size.
+ */
+static int server_allocate(int fd, uint64_t size){
+    if (size == 0)
+        return ftruncate(fd, 0);
+    if (fallocate(fd, 0, 0, size) == 0)
+        return 0;
+    if ((errno != EOPNOTSUPP) && (errno != ENOSYS))
+        return -1;
+    return ftruncate(fd, size);
+}
+
+/*
+ *  Prepares a delta transfer against the servers current copy of the
+ *  file, returns NULL if there is no copy worth diffing against
+ */
+static ftp_delta *server_delta_open(const char *path){
+    struct stat sb;
+    ftp_delta *d;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return NULL;
+    if ((fstat(fd, &sb) < 0) || !S_ISREG(sb.st_mode) || (sb.st_size < FTP_DELTA_MIN_BLOCK)){
+        close(fd);
+        return NULL;
+    }
+    d = calloc(1, sizeof(ftp_delta));
+    if (d == NULL){
+        close(fd);
+        return NULL;
+    }
+    d->basis_fd = fd;
+    d->basis_size = sb.st_size;
+    d->basis = mmap(NULL, d->basis_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    d->block_sz = dd_block_size(d->basis_size);
+    d->num_blocks = d->basis_size / d->block_sz;
+    d->sigs = malloc(sizeof(ftp_sig) * d->num_blocks);
+    if ((d->basis == MAP_FAILED) || (d->sigs == NULL)){
+        if (d->basis != MAP_FAILED)
+            munmap(d->basis, d->basis_size);
+        free(d->sigs);
+        free(d);
+        close(fd);
+        return NULL;
+    }
+    madvise(d->basis, d->basis_size, MADV_SEQUENTIAL);
+    dd_make_sigs((const uint8_t *)d->basis, d->block_sz, d->num_blocks, d->sigs);
+    snprintf(d->tmp_path, sizeof(d->tmp_path), "%s.delta", path);
+    printf("Delta against the current %s, %u blocks of %u bytes\n", path,
+        d->num_blocks, d->block_sz);
+    return d;
+}
+
+/*
+ *  Swaps in the new version if the transfer completed, throws it away
+ *  otherwise
+ */
+static void server_delta_finish(ftp_file *file, int ok){
+    ftp_delta *d = file->delta;
+
+    if (ok && (rename(d->tmp_path, file->path) == 0)){
+        printf("Delta: %llu bytes reused, %llu bytes received\n",
+            (unsigned long long)d->copied, (unsigned long long)d->literal);
+    } else {
+        printf("WARNING: delta transfer of %s failed, the old copy is kept\n", file->path);
+        unlink(d->tmp_path);
+    }
+    munmap(d->basis, d->basis_size);
+    close(d->basis_fd);
+    free(d->sigs);
+    free(d);
+    file->delta = NULL;
+}
+
+/*
+ *  Copies basis blocks into the new version.  copy_file_range() keeps the
+ *  bytes in the kernel, if the filesystem can't do it fall back to writing
+ *  from the mapping.
+ */
+static int server_delta_copy(ftp_file *file, uint64_t offset, ftp_copy *cp){
+    ftp_delta *d = file->delta;
+    uint64_t len, src;
+
+    if ((cp->count == 0) || (cp->block >= d->num_blocks) ||
+            (cp->count > d->num_blocks - cp->block))
+        return FTP_ERR_PROTOCOL;
+    src = (uint64_t)cp->block * d->block_sz;
+    len = (uint64_t)cp->count * d->block_sz;
+    if (offset + len > file->size)
+        return FTP_ERR_PROTOCOL;
+
+    while (len > 0){
+        loff_t in = src, out = offset;
+        ssize_t rc = copy_file_range(d->basis_fd, &in, file->fd, &out, len, 0);
+        if (rc <= 0)
+            rc = pwrite(file->fd, d->basis + src, len, offset);
+        if (rc <= 0)
+            return FTP_ERR_IO;
+        src += rc;
+        offset += rc;
+        len -= rc;
+        d->copied += rc;
+    }
+    return FTP_NO_ERROR;
+}
+
+/*
+ *  Handles the OPEN of a stream.  The first OPEN creates the file and, for
+ *  a striped transfer, binds the ports of the remaining streams before it
+ *  is acknowledged so their CONNECT can never arrive early.  If the client
+ *  asks to resume and a journal for the same version of the file is found
+ *  the partial file is kept instead of truncated.
+ */
+static int server_open(ftp_stream *st, int flags, ftp_open *req){
+    ftp_file *file = st->file;
+    prog_config *cfg = file->cfg;
+    int i, resume = 0, err = FTP_NO_ERROR;
+    struct stat sb;
+
+    req->file_name[FTP_NAME_SZ - 1] = '\0';
+    if ((req->stream_id != st->id) || (req->num_streams < 1) ||
+            (req->num_streams > FTP_MAX_STREAMS) ||
+            (req->range_off + req->range_len > req->file_size))
+        return FTP_ERR_PROTOCOL;
+    //the stream ports can't be shared between concurrent sessions
+    if ((cfg->workers > 0) && (req->num_streams > 1))
+        return FTP_ERR_STREAMS;
+
+    pthread_mutex_lock(&file->lock);
+    if (file->batch != NULL){
+        err = FTP_ERR_PROTOCOL;
+    } else if (file->fd < 0){
+        if ((st->id != 0) || (safe_file_name(req->file_name, file->name, sizeof(file->name)) < 0)){
+            err = FTP_ERR_PROTOCOL;
+            goto done;
+        }
+        snprintf(file->path, sizeof(file->path), "./infile/%s", file->name);
+        if (!server_claim(file)){
+            printf("WARNING: %s is being received by another session\n", file->path);
+            err = FTP_ERR_BUSY;
+            goto done;
+        }
+
+        //a partial transfer takes precedence, the file on disk is no basis then
+        if ((flags & FTP_FL_DELTA) && (req->num_streams == 1) && !ftp_journal_exists(file->path))
+            file->delta = server_delta_open(file->path);
+        if (file->delta != NULL){
+            file->fd = open(file->delta->tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        } else {
+            resume = (flags & FTP_FL_RESUME) && (stat(file->path, &sb) == 0) &&
+                     ((uint64_t)sb.st_size == req->file_size);
+            file->journal = ftp_journal_open(file->path, req->file_size, req->file_mtime, resume);
+            if (file->journal == NULL)
+                printf("WARNING: no progress journal for %s, it cannot be resumed\n", file->path);
+            resume = (file->journal != NULL) && file->journal->resumed;
+
+            file->fd = open(file->path, O_RDWR | O_CREAT | (resume ? 0 : O_TRUNC), 0644);
+        }
+        if (file->fd < 0){
+            printf("ERROR:  Cannot open file %s\n", file->path);
+            err = (errno == EACCES) ? FTP_ERR_ACCESS : FTP_ERR_IO;
+            goto done;
+        }
+        if (((flags & FTP_FL_SPARSE) ? ftruncate(file->fd, req->file_size) :
+                                       server_allocate(file->fd, req->file_size)) < 0){
+            printf("ERROR:  Cannot allocate %llu bytes for %s\n",
+                (unsigned long long)req->file_size, file->path);
+            err = FTP_ERR_IO;
+            goto done;
+        }
+        file->size = req->file_size;
+        if (cfg->direct){
+            file->direct_fd = open((file->delta != NULL) ? file->delta->tmp_path : file->path,
+                                   O_WRONLY | O_DIRECT);
+            if (file->direct_fd < 0)
+                printf("WARNING: no O_DIRECT for %s, using buffered writes\n", file->path);
+        }
+
+        for (i = 1; i < req->num_streams; i++){
+            ftp_stream *other = &file->streams[i];
+            other->id = i;
+            other->file = file;
+            other->dpc = dpServerInit(cfg->port_number + i);
+            if (other->dpc == NULL){
+                err = FTP_ERR_IO;
+                break;
+            }
+            setup_metrics(other->dpc, cfg, i);
+            setup_traffic(other->dpc, cfg);
+            if (pthread_create(&other->thread, NULL, server_stream_thread, other) != 0){
+                dpclose(other->dpc);
+                err = FTP_ERR_IO;
+                break;
+            }
+            file->num_streams = i + 1;
+        }
+        printf("Receiving %s, %llu bytes over %d stream(s)\n", file->path,
+            (unsigned long long)file->size, req->num_streams);
+        if (resume)
+            printf("Resuming, %u of %u chunks were received before\n",
+                file->journal->chunks_done, file->journal->hdr.num_chunks);
+    } else if ((strcmp(req->file_name, file->name) != 0) || (req->file_size != file->size)){
+        err = FTP_ERR_PROTOCOL;
+    }
+
+done:
+    pthread_mutex_unlock(&file->lock);
+    if (err == FTP_NO_ERROR){
+        st->range_off = req->range_off;
+        st->range_len = req->range_len;
+    }
+    return err;
+}
+
+/*
+ *  Sends the block checksums of the basis, right after a delta OPENACK
+ */
+static int server_send_sigs(ftp_stream *st){
+    ftp_delta *d = st->file->delta;
+    uint32_t per_msg = FTP_MAX_DATA / sizeof(ftp_sig);
+    ftp_pdu hdr = {0};
+    uint32_t i = 0;
+
+    hdr.mtype = FTP_MT_SIGS;
+    do {
+        uint32_t n = (d->num_blocks - i) < per_msg ? d->num_blocks - i : per_msg;
+        hdr.offset = i;
+        hdr.flags = (i + n == d->num_blocks) ? FTP_FL_LAST : 0;
+        if (ftp_send(st->dpc, &hdr, d->sigs + i, n * sizeof(ftp_sig)) < 0)
+            return FTP_ERR_IO;
+        i += n;
+    } while (i < d->num_blocks);
+    return FTP_NO_ERROR;
+}
+
+/*
+ *  Sends the journal bitmap to a resuming client, right after its OPENACK
+ */
+static int server_send_journal(ftp_stream *st){
+    ftp_journal *j = st->file->journal;
+    ftp_pdu hdr = {0};
+    uint32_t off = 0;
+
+    hdr.mtype = FTP_MT_JOURNAL;
+    do {
+        int bytes = (j->map_sz - off) < FTP_MAX_DATA ? (int)(j->map_sz - off) : FTP_MAX_DATA;
+        hdr.offset = off;
+        hdr.flags = (off + bytes == j->map_sz) ? FTP_FL_LAST : 0;
+        if (ftp_send(st->dpc, &hdr, j->bitmap + off, bytes) < 0)
+            return FTP_ERR_IO;
+        off += bytes;
+    } while (off < j->map_sz);
+    return FTP_NO_ERROR;
+}
+
+//writer thread hook, records progress once data is in the file
+static void server_written(void *ctx, int fd, off_t offset, size_t len){
+    ftp_file *file = ctx;
+
+    if (file->journal != NULL)
+        ftp_journal_written(file->journal, offset, len);
+}
+
+static int stream_in_range(ftp_stream *st, uint64_t offset, uint64_t len){
+    return (st->range_len > 0) && (offset >= st->range_off) &&
+           (offset + len <= st->range_off + st->range_len);
+}
+
+/*
+ *  Zeros at offset.  The range reads as zeros already unless it is being
+ *  repaired, punching it gives the space back and makes sure of it.
+ *  Without hole punching the zeros are written.  The journal counts the
+ *  range as written.
+ */
+static int server_hole(ftp_stream *st, ftp_pdu *hdr, const char *data, int len){
+    static const char zeros[64 * 1024];
+    ftp_file *file = st->file;
+    ftp_hole hole;
+    uint64_t off = hdr->offset;
+
+    if (len != sizeof(ftp_hole))
+        return FTP_ERR_PROTOCOL;
+    memcpy(&hole, data, sizeof(hole));
+    if ((hole.len == 0) || (hole.len > file->size) || !stream_in_range(st, off, hole.len))
+        return FTP_ERR_PROTOCOL;
+
+    if (fallocate(file->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, hole.len) < 0){
+        uint64_t left = hole.len;
+        while (left > 0){
+            ssize_t rc = pwrite(file->fd, zeros, left < sizeof(zeros) ? left : sizeof(zeros), off);
+            if (rc <= 0)
+                return FTP_ERR_IO;
+            off += rc;
+            left -= rc;
+        }
+    }
+    server_written(file, file->fd, hdr->offset, hole.len);
+    return FTP_NO_ERROR;
+}
+
+/*
+ *  Collects the parts of a compressed block, once the last one is in the
+ *  block is decompressed straight into writer slots
+ */
+static int server_zdata(ftp_stream *st, ftp_writer *writer, ftp_pdu *hdr,
+                        const char *data, int len){
+    ftp_file *file = st->file;
+    uint8_t *out;
+    int n, i;
+
+    if ((st->zbuf == NULL) && ((st->zbuf = malloc(2 * FTP_Z_BLOCK)) == NULL))
+        return FTP_ERR_IO;
+    if (st->zlen == 0)
+        st->zoff = hdr->offset;
+    if ((hdr->offset != st->zoff) || (st->zlen + len > FTP_Z_BLOCK)){
+        st->zlen = 0;
+        return FTP_ERR_PROTOCOL;
+    }
+    memcpy(st->zbuf + st->zlen, data, len);
+    st->zlen += len;
+    if (!(hdr->flags & FTP_FL_LAST))
+        return FTP_NO_ERROR;
+
+    out = st->zbuf + FTP_Z_BLOCK;
+    n = lz_decompress(st->zbuf, st->zlen, out, FTP_Z_BLOCK);
+    st->zlen = 0;
+    if ((n < 0) || !stream_in_range(st, st->zoff, n))
+        return FTP_ERR_PROTOCOL;
+    if (file->delta != NULL)
+        file->delta->literal += n;
+
+    printf("========================> \n%.*s\n========================> \n",
+        n > 50 ? 50 : n, out);
+    for (i = 0; i < n; i += DP_MAX_BUFF_SZ){
+        ftp_slot *slot = ftp_writer_slot(writer);
+        slot->fd = file->fd;
+        slot->offset = st->zoff + i;
+        slot->len = (n - i) < DP_MAX_BUFF_SZ ? n - i : DP_MAX_BUFF_SZ;
+        memcpy(slot->data, out + i, slot->len);
+        ftp_writer_commit(writer);
+    }
+    return FTP_NO_ERROR;
+}
+
+/*
+ *  Creates a manifest entry under ./infile, along with any parent that is
+ *  missing.  Files get their final size right away, the data is written
+ *  into them later.
+ */
+static int server_batch_create(ftp_mf_item *it){
+    char path[FTP_MF_NAME_SZ + 16];
+    char *p;
+    int fd;
+
+    snprintf(path, sizeof(path), "./infile/%s", it->name);
+    for (p = strchr(path + strlen("./infile/"), '/'); p != NULL; p = strchr(p + 1, '/')){
+        *p = '\0';
+        if ((mkdir(path, 0755) < 0) && (errno != EEXIST))
+            return FTP_ERR_IO;
+        *p = '/';
+    }
+    if (S_ISDIR(it->mode)){
+        if ((mkdir(path, (it->mode & 0777) | S_IRWXU) < 0) && (errno != EEXIST))
+            return (errno == EACCES) ? FTP_ERR_ACCESS : FTP_ERR_IO;
+        return FTP_NO_ERROR;
+    }
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, it->mode & 0777);
+    if (fd < 0)
+        return (errno == EACCES) ? FTP_ERR_ACCESS : FTP_ERR_IO;
+    if ((fchmod(fd, it->mode & 0777) < 0) || (server_allocate(fd, it->size) < 0)){
+        close(fd);
+        return FTP_ERR_IO;
+    }
+    close(fd);
+    return FTP_NO_ERROR;
+}
+
+/*
+ *  Adds a MANIFEST message to the batch, the entries are created as they
+ *  arrive so the tree is ready by the time the data follows
+ */
+static int server_manifest(ftp_stream *st, ftp_pdu *hdr, const char *data, int len){
+    ftp_file *file = st->file;
+    ftp_batch *b = file->batch;
+    uint32_t i;
+
+    if ((st->id != 0) || (file->fd >= 0))
+        return FTP_ERR_PROTOCOL;
+    if (b == NULL){
+        if ((b = calloc(1, sizeof(ftp_batch))) == NULL)
+            return FTP_ERR_IO;
+        file->batch = b;
+    }
+    i = b->mf.num_items;
+    if (b->complete || (hdr->offset != i) || (mf_unpack(&b->mf, data, len) < 0))
+        return FTP_ERR_PROTOCOL;
+    if (i == 0){
+        snprintf(file->name, sizeof(file->name), "%s", b->mf.items[0].name);
+        snprintf(file->path, sizeof(file->path), "./infile/%s", file->name);
+        if (!server_claim(file)){
+            printf("WARNING: %s is being received by another session\n", file->path);
+            b->failed = b->mf.num_items;
+            b->busy = 1;
+        }
+    }
+    if (b->busy)
+        return FTP_NO_ERROR;
+    for (; i < b->mf.num_items; i++){
+        if (server_batch_create(&b->mf.items[i]) != FTP_NO_ERROR){
+            printf("ERROR:  Cannot create ./infile/%s\n", b->mf.items[i].name);
+            b->failed++;
+        }
+    }
+    if (hdr->flags & FTP_FL_LAST){
+        b->complete = 1;
+        printf("Receiving %s, %u files and %u directories, %llu bytes\n", file->path,
+            b->mf.num_files, b->mf.num_dirs, (unsigned long long)b->mf.bytes);
+    }
+    return FTP_NO_ERROR;
+}
+
+//Closes the batch files once everything queued for them is written
+static void server_batch_close(ftp_batch *b, ftp_writer *writer){
+    int i;
+
+    ftp_writer_flush(writer);
+    for (i = 0; i < b->num_open; i++){
+        ftp_mf_item *it = &b->mf.items[b->open[i]];
+        close(it->fd);
+        it->fd = -1;
     }
-    if (dpc->isConnected == false){
+    b->num_open = 0;
+}
+
+static int server_batch_fd(ftp_batch *b, ftp_writer *writer, uint32_t entry){
+    char path[FTP_MF_NAME_SZ + 16];
+    ftp_mf_item *it = &b->mf.items[entry];
+
+    if (it->fd >= 0)
+        return it->fd;
+    if (b->num_open == FTP_BATCH_MAX_OPEN)
+        server_batch_close(b, writer);
+    snprintf(path, sizeof(path), "./infile/%s", it->name);
+    it->fd = open(path, O_WRONLY);
+    if (it->fd >= 0)
+        b->open[b->num_open++] = entry;
+    return it->fd;
+}
+
+/*
+ *  Unpacks a RECS message into writer slots.  The message is copied out
+ *  first since it was received into the slot the first record needs.
+ */
+static int server_recs(ftp_stream *st, ftp_writer *writer, const char *data, int len){
+    char msg[FTP_MAX_DATA];
+    ftp_batch *b = st->file->batch;
+    int off = 0;
+
+    if ((b == NULL) || !b->complete || (len > (int)sizeof(msg)))
+        return FTP_ERR_PROTOCOL;
+    memcpy(msg, data, len);
+
+    while (off < len){
+        ftp_rec rec;
+        ftp_mf_item *it;
+
+        if (len - off < (int)sizeof(rec))
+            return FTP_ERR_PROTOCOL;
+        memcpy(&rec, msg + off, sizeof(rec));
+        off += sizeof(rec);
+        if ((rec.file >= b->mf.num_items) || (rec.len > (uint32_t)(len - off)))
+            return FTP_ERR_PROTOCOL;
+        it = &b->mf.items[rec.file];
+        if (!S_ISREG(it->mode) || (rec.offset + rec.len > it->size))
+            return FTP_ERR_PROTOCOL;
+
+        ftp_slot *slot = ftp_writer_slot(writer);
+        slot->fd = server_batch_fd(b, writer, rec.file);
+        if (slot->fd < 0){
+            printf("ERROR:  Cannot open ./infile/%s\n", it->name);
+            return FTP_ERR_IO;
+        }
+        slot->offset = rec.offset;
+        slot->len = rec.len;
+        memcpy(slot->data, msg + off, rec.len);
+        ftp_writer_commit(writer);
+        off += rec.len;
+    }
+    return FTP_NO_ERROR;
+}
+
+/*
+ *  Digest of every batch entry as it is on disk, entries that cannot be
+ *  read get the complement of the clients digest so they are resent
+ */
+static void server_batch_sums(ftp_file *file, ftp_writer *writer, uint64_t *sums){
+    char path[FTP_MF_NAME_SZ + 16];
+    ftp_batch *b = file->batch;
+    uint32_t i;
+
+    server_batch_close(b, writer);
+    for (i = 0; i < b->mf.num_items; i++){
+        ftp_mf_item *it = &b->mf.items[i];
+        char *map;
+        int fd;
+
+        sums[i] = 0;
+        if (!S_ISREG(it->mode))
+            continue;
+        sums[i] = ~file->leaves[i];
+        snprintf(path, sizeof(path), "./infile/%s", it->name);
+        if ((fd = open(path, O_RDONLY)) < 0)
+            continue;
+        if (it->size == 0){
+            sums[i] = dh_xxh64("", 0, 0);
+        } else if ((map = mmap(NULL, it->size, PROT_READ, MAP_SHARED, fd, 0)) != MAP_FAILED){
+            sums[i] = dh_xxh64(map, it->size, 0);
+            munmap(map, it->size);
+        }
+        close(fd);
+    }
+}
+
+/*
+ *  Runs once the client sent all of its leaf digests.  Everything still in
+ *  flight is written first, including the other streams, then the file is
+ *  hashed back from disk and the leaves that differ are reported so the
+ *  client can send them again.
+ */
+static int server_check(ftp_stream *st, ftp_writer *writer){
+    uint32_t list[FTP_MAX_DATA / sizeof(uint32_t)];
+    uint32_t per_msg = FTP_MAX_DATA / sizeof(uint32_t);
+    ftp_file *file = st->file;
+    uint32_t i, cnt = 0, bad = 0;
+    uint64_t *mine, root[2];
+    ftp_pdu hdr = {0};
+    char *map;
+
+    ftp_writer_flush(writer);
+    pthread_mutex_lock(&file->lock);
+    while (file->streams_done < file->num_streams - 1)
+        pthread_cond_wait(&file->done_cv, &file->lock);
+    pthread_mutex_unlock(&file->lock);
+
+    mine = malloc(sizeof(uint64_t) * (file->num_leaves + 1));
+    if (mine == NULL)
+        return FTP_ERR_IO;
+    if (file->batch != NULL){
+        server_batch_sums(file, writer, mine);
+    } else if (file->size > 0){
+        map = mmap(NULL, file->size, PROT_READ, MAP_SHARED, file->fd, 0);
+        if (map == MAP_FAILED){
+            free(mine);
+            return FTP_ERR_IO;
+        }
+        dh_leaves((const uint8_t *)map, file->size, file->fd, mine, dh_threads(file->size));
+        munmap(map, file->size);
+    }
+    for (i = 0; i < file->num_leaves; i++)
+        bad += (mine[i] != file->leaves[i]);
+
+    hdr.mtype = FTP_MT_VERIFYACK;
+    hdr.err_num = bad;
+    for (i = 0; i < file->num_leaves; i++){
+        if (mine[i] == file->leaves[i])
+            continue;
+        list[cnt++] = i;
+        if (cnt == per_msg){
+            ftp_send(st->dpc, &hdr, list, cnt * sizeof(uint32_t));
+            cnt = 0;
+        }
+    }
+    hdr.flags = FTP_FL_LAST;
+    ftp_send(st->dpc, &hdr, list, cnt * sizeof(uint32_t));
+
+    file->verified = (bad == 0);
+    if (file->verified){
+        dh_root(mine, file->num_leaves, file->size, root);
+        printf("Verified %s, digest %016llx%016llx\n", file->path,
+            (unsigned long long)root[0], (unsigned long long)root[1]);
+    } else {
+        printf("WARNING: %u of %u %s of %s differ, the client resends them\n",
+            bad, file->num_leaves, (file->batch != NULL) ? "entries" : "leaves", file->path);
+        st->range_off = 0;              //resent leaves can be anywhere
+        st->range_len = file->size;
+    }
+    free(mine);
+    return FTP_NO_ERROR;
+}
+
+//Collects the leaf digests the client sends, checks the file after the last
+static int server_verify(ftp_stream *st, ftp_writer *writer, ftp_pdu *hdr,
+                         const char *data, int len){
+    ftp_file *file = st->file;
+    uint32_t n = len / sizeof(uint64_t);
+    uint32_t expected;
+
+    if (file->batch != NULL)
+        expected = file->batch->complete ? file->batch->mf.num_items : 0;
+    else
+        expected = (file->fd >= 0) ? dh_num_leaves(file->size) : 0;
+    if ((st->id != 0) || (expected == 0) || (len % sizeof(uint64_t) != 0) ||
+            (hdr->offset + n > expected))
+        return FTP_ERR_PROTOCOL;
+    if (file->leaves == NULL){
+        file->num_leaves = expected;
+        file->leaves = calloc(file->num_leaves + 1, sizeof(uint64_t));
+        if (file->leaves == NULL)
+            return FTP_ERR_IO;
+    }
+    memcpy(file->leaves + hdr->offset, data, len);
+    if (!(hdr->flags & FTP_FL_LAST))
+        return FTP_NO_ERROR;
+    return server_check(st, writer);
+}
+
+/*
+ *  The network side of one server stream.  Every datagram is received
+ *  straight into a slot of the writer ring and handed to the writer thread,
+ *  so this loop only ever waits on the network (or on a completely full
+ *  ring).  Data is written at the offset the client sent it from, streams
+ *  fill in their own range of the file independently.
+ */
+int server_loop(ftp_stream *st){
+    ftp_file *file = st->file;
+    ftp_pdu hdr;
+    int rcvSz, err, resumed, delta;
+    ftp_delta_info info;
+
+    if (st->dpc->isConnected == false){
         perror("Expecting the protocol to be in connect state, but its not");
         exit(-1);
     }
+    ftp_writer *writer = ftp_writer_start(server_written, file);
+    if (writer == NULL){
+        perror("Cannot start the writer thread");
+        exit(-1);
+    }
     //Loop until a disconnect is received, or error hapens
     while(1) {
 
         //receive request from client
-        rcvSz = dprecv(dpc, rBuff, rbuff_sz);
-        if (rcvSz == DP_CONNECTION_CLOSED){
-            fclose(f);
-            printf("Client closed connection\n");
-            return DP_CONNECTION_CLOSED;
+        ftp_slot *slot = ftp_writer_slot(writer);
+        rcvSz = ftp_recv(st->dpc, &hdr, slot->data, sizeof(slot->data));
+        if (rcvSz == DP_CONNECTION_CLOSED)
+            break;
+        if (rcvSz < 0){
+            printf("WARNING: dprecv() failed with %d, skipping datagram\n", rcvSz);
+            continue;
         }
-        fwrite(rBuff, 1, rcvSz, f);
-        rcvSz = rcvSz > 50 ? 50 : rcvSz;    //Just print the first 50 characters max
 
-        printf("========================> \n%.*s\n========================> \n", 
-            rcvSz, (char *)rBuff);
+        switch(hdr.mtype){
+            case FTP_MT_OPEN:
+                if (rcvSz != sizeof(ftp_open))
+                    err = FTP_ERR_PROTOCOL;
+                else
+                    err = server_open(st, hdr.flags, (ftp_open *)slot->data);
+                if ((err == FTP_NO_ERROR) && (file->direct_fd >= 0))
+                    ftp_writer_direct(writer, file->fd, file->direct_fd);
+                resumed = (err == FTP_NO_ERROR) && (st->id == 0) &&
+                          (file->journal != NULL) && file->journal->resumed;
+                delta = (err == FTP_NO_ERROR) && (st->id == 0) && (file->delta != NULL);
+                memset(&hdr, 0, sizeof(hdr));
+                hdr.mtype = FTP_MT_OPENACK;
+                hdr.flags = resumed ? FTP_FL_RESUME : 0;
+                hdr.err_num = err;
+                hdr.offset = st->range_off;
+                if (delta){
+                    info.basis_size = file->delta->basis_size;
+                    info.block_sz = file->delta->block_sz;
+                    info.num_blocks = file->delta->num_blocks;
+                    hdr.flags |= FTP_FL_DELTA;
+                    ftp_send(st->dpc, &hdr, &info, sizeof(info));
+                    server_send_sigs(st);
+                } else {
+                    ftp_send(st->dpc, &hdr, NULL, 0);
+                }
+                if (resumed)
+                    server_send_journal(st);
+                break;
+            case FTP_MT_DATA:
+                if (!stream_in_range(st, hdr.offset, rcvSz)){
+                    printf("WARNING: stream %d data at %llu is outside of its range\n",
+                        st->id, (unsigned long long)hdr.offset);
+                    break;
+                }
+                slot->fd = file->fd;
+                slot->offset = hdr.offset;
+                slot->len = rcvSz;
+                if (file->delta != NULL)
+                    file->delta->literal += rcvSz;
+
+                rcvSz = rcvSz > 50 ? 50 : rcvSz;    //Just print the first 50 characters max
+                printf("========================> \n%.*s\n========================> \n",
+                    rcvSz, slot->data);
+                ftp_writer_commit(writer);
+                break;
+            case FTP_MT_ZDATA:
+                if (server_zdata(st, writer, &hdr, slot->data, rcvSz) != FTP_NO_ERROR){
+                    printf("WARNING: stream %d bad compressed block at %llu\n", st->id,
+                        (unsigned long long)hdr.offset);
+                    st->rc = FTP_ERR_PROTOCOL;
+                }
+                break;
+            case FTP_MT_MANIFEST:
+                //errors are held back until the client is done sending the list
+                err = server_manifest(st, &hdr, slot->data, rcvSz);
+                if (err != FTP_NO_ERROR)
+                    st->rc = err;
+                if (hdr.flags & FTP_FL_LAST){
+                    err = st->rc;
+                    if ((err == FTP_NO_ERROR) && (file->batch->failed > 0))
+                        err = file->batch->busy ? FTP_ERR_BUSY : FTP_ERR_IO;
+                    memset(&hdr, 0, sizeof(hdr));
+                    hdr.mtype = FTP_MT_OPENACK;
+                    hdr.err_num = err;
+                    ftp_send(st->dpc, &hdr, NULL, 0);
+                }
+                break;
+            case FTP_MT_RECS:
+                if (server_recs(st, writer, slot->data, rcvSz) != FTP_NO_ERROR){
+                    printf("WARNING: stream %d bad batch records\n", st->id);
+                    st->rc = FTP_ERR_PROTOCOL;
+                }
+                break;
+            case FTP_MT_HOLE:
+                if (server_hole(st, &hdr, slot->data, rcvSz) != FTP_NO_ERROR){
+                    printf("WARNING: stream %d bad hole at %llu\n", st->id,
+                        (unsigned long long)hdr.offset);
+                    st->rc = FTP_ERR_PROTOCOL;
+                }
+                break;
+            case FTP_MT_VERIFY:
+                if (server_verify(st, writer, &hdr, slot->data, rcvSz) != FTP_NO_ERROR){
+                    printf("WARNING: stream %d cannot verify the file\n", st->id);
+                    st->rc = FTP_ERR_PROTOCOL;
+                }
+                break;
+            case FTP_MT_COPY:
+                if ((file->delta == NULL) || (rcvSz != sizeof(ftp_copy)) ||
+                        (server_delta_copy(file, hdr.offset, (ftp_copy *)slot->data) != FTP_NO_ERROR)){
+                    printf("WARNING: stream %d bad copy to %llu\n", st->id,
+                        (unsigned long long)hdr.offset);
+                    st->rc = FTP_ERR_PROTOCOL;
+                }
+                break;
+            case FTP_MT_CLOSE:
+                st->closed = 1;
+                break;
+            default:
+                printf("WARNING: unexpected du-ftp message type %d\n", hdr.mtype);
+                break;
+        }
+    }
+
+    free(st->zbuf);
+    st->zbuf = NULL;
+    if (ftp_writer_finish(writer) < 0){
+        printf("ERROR:  Writing %s failed\n", file->path);
+        st->rc = FTP_ERR_IO;
+    }
+    if (!st->closed){
+        printf("WARNING: stream %d ended without a graceful close\n", st->id);
+        st->rc = FTP_ERR_PROTOCOL;
+    }
+    printf("Client closed connection\n");
+    return DP_CONNECTION_CLOSED;
+}
+
+static void *server_stream_thread(void *arg){
+    ftp_stream *st = arg;
+
+    if (dplisten(st->dpc) < 0)
+        st->rc = FTP_ERR_IO;
+    else
+        server_loop(st);
+
+    //stream 0 verifies the file once every other stream is done
+    pthread_mutex_lock(&st->file->lock);
+    st->file->streams_done++;
+    pthread_cond_broadcast(&st->file->done_cv);
+    pthread_mutex_unlock(&st->file->lock);
+    return NULL;
+}
+
+void start_server(dp_connp dpc, prog_config *cfg){
+    ftp_stream streams[FTP_MAX_STREAMS];
+    ftp_file file;
+    int i;
+
+    memset(streams, 0, sizeof(streams));
+    memset(&file, 0, sizeof(file));
+    pthread_mutex_init(&file.lock, NULL);
+    pthread_cond_init(&file.done_cv, NULL);
+    file.fd = -1;
+    file.direct_fd = -1;
+    file.num_streams = 1;
+    file.streams = streams;
+    file.cfg = cfg;
+
+    streams[0].dpc = dpc;
+    streams[0].file = &file;
+    server_loop(&streams[0]);
+
+    for (i = 1; i < file.num_streams; i++)
+        pthread_join(streams[i].thread, NULL);
+    if (file.fd >= 0)
+        close(file.fd);
+    if (file.direct_fd >= 0)
+        close(file.direct_fd);
+    if (file.batch != NULL){
+        for (i = 0; i < file.batch->num_open; i++)
+            close(file.batch->mf.items[file.batch->open[i]].fd);
+        mf_free(&file.batch->mf);
+        free(file.batch);
+    }
+    if (((file.fd >= 0) || (file.batch != NULL)) && !file.verified)
+        printf("ERROR:  %s could not be verified against the source\n", file.path);
+    if (file.delta != NULL)
+        server_delta_finish(&file, streams[0].closed && (streams[0].rc == FTP_NO_ERROR) &&
+                                   file.verified);
+    if (file.journal != NULL){
+        if (!ftp_journal_complete(file.journal))
+            printf("WARNING: %s is incomplete, %u of %u chunks received, "
+                "run the client again to resume\n", file.path,
+                file.journal->chunks_done, file.journal->hdr.num_chunks);
+        ftp_journal_close(file.journal);
+    }
+    server_release(&file);
+    free(file.leaves);
+    pthread_cond_destroy(&file.done_cv);
+    pthread_mutex_destroy(&file.lock);
+}
+
+/*
+ *  Worker loop of the concurrent server.  The kernel shards new clients
+ *  over the workers SO_REUSEPORT sockets, each accepted session gets its
+ *  own socket and runs to the end on the worker.  Threads started for the
+ *  session (writer, stream threads) inherit the CPU the worker is pinned
+ *  to, so a session stays on one core.
+ */
+static void *server_worker(void *arg){
+    ftp_worker *w = arg;
+
+    if (w->cpu >= 0){
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+            printf("WARNING: worker %d cannot be pinned to CPU %d\n", w->id, w->cpu);
+    }
+
+    while(1) {
+        dp_connp dpc = dpaccept(w->listener);
+        if (dpc == NULL)
+            continue;
+        printf("Worker %d: session %llu started\n", w->id, (unsigned long long)w->sessions);
+        setup_metrics(dpc, w->cfg, w->id);
+        setup_traffic(dpc, w->cfg);
+        start_server(dpc, w->cfg);
+        printf("Worker %d: session %llu done\n", w->id, (unsigned long long)w->sessions);
+        w->sessions++;
+    }
+    return NULL;
+}
+
+/*
+ *  Long running server, cfg->workers threads each with a listening socket
+ *  on the same port.  Workers are pinned round robin to the CPUs the
+ *  process may run on.
+ */
+void start_server_pool(prog_config *cfg){
+    ftp_worker workers[FTP_MAX_WORKERS];
+    int cpus[CPU_SETSIZE];
+    int i, num_cpus = 0;
+    cpu_set_t set;
+
+    if (cfg->workers > FTP_MAX_WORKERS)
+        cfg->workers = FTP_MAX_WORKERS;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0){
+        for (i = 0; i < CPU_SETSIZE; i++)
+            if (CPU_ISSET(i, &set))
+                cpus[num_cpus++] = i;
+    }
+
+    memset(workers, 0, sizeof(workers));
+    for (i = 0; i < cfg->workers; i++){
+        workers[i].id = i;
+        workers[i].cpu = (num_cpus > 0) ? cpus[i % num_cpus] : -1;
+        workers[i].cfg = cfg;
+        workers[i].listener = dpServerInitShared(cfg->port_number);
+        if (workers[i].listener == NULL){
+            perror("Cannot open a worker socket");
+            exit(-1);
+        }
+        if (pthread_create(&workers[i].thread, NULL, server_worker, &workers[i]) != 0){
+            perror("Cannot start a worker thread");
+            exit(-1);
+        }
+    }
+    printf("Serving on port %d with %d workers over %d CPUs\n", cfg->port_number,
+        cfg->workers, num_cpus);
+    for (i = 0; i < cfg->workers; i++)
+        pthread_join(workers[i].thread, NULL);
+}
+
+
+//// CLIENT
+
+/*
+ *  Receives the chunk bitmap of a resumed transfer
+ */
+static int client_recv_journal(ftp_stream *st, char *buff, int buff_sz){
+    ftp_file *file = st->file;
+    uint32_t c, done = 0, num_chunks = ftp_journal_chunks(file->size);
+    uint32_t map_sz = (num_chunks + 7) / 8;
+    ftp_pdu hdr;
+    int rc;
+
+    file->done_map = calloc(1, map_sz + 1);
+    if (file->done_map == NULL)
+        return FTP_ERR_IO;
+    do {
+        rc = ftp_recv(st->dpc, &hdr, buff, buff_sz);
+        if ((rc < 0) || (hdr.mtype != FTP_MT_JOURNAL) || (hdr.offset + rc > map_sz)){
+            free(file->done_map);
+            file->done_map = NULL;
+            return FTP_ERR_PROTOCOL;
+        }
+        memcpy(file->done_map + hdr.offset, buff, rc);
+    } while (!(hdr.flags & FTP_FL_LAST));
+
+    for (c = 0; c < num_chunks; c++)
+        done += FTP_CHUNK_DONE(file->done_map, c);
+    printf("Resuming %s, the server already has %u of %u chunks\n", file->name,
+        done, num_chunks);
+    return FTP_NO_ERROR;
+}
+
+/*
+ *  Receives the block checksums of the servers copy for a delta transfer
+ */
+static int client_recv_sigs(ftp_stream *st, ftp_delta_info *info, char *buff, int buff_sz){
+    ftp_file *file = st->file;
+    uint32_t received = 0;
+    ftp_delta *d;
+    ftp_pdu hdr;
+    int rc;
+
+    if ((info->block_sz < FTP_DELTA_MIN_BLOCK) || (info->block_sz > FTP_DELTA_MAX_BLOCK) ||
+            (info->num_blocks != info->basis_size / info->block_sz))
+        return FTP_ERR_PROTOCOL;
+    d = calloc(1, sizeof(ftp_delta));
+    if (d == NULL)
+        return FTP_ERR_IO;
+    d->basis_size = info->basis_size;
+    d->block_sz = info->block_sz;
+    d->num_blocks = info->num_blocks;
+    d->sigs = malloc(sizeof(ftp_sig) * (d->num_blocks + 1));
+    if (d->sigs == NULL){
+        free(d);
+        return FTP_ERR_IO;
+    }
+
+    do {
+        rc = ftp_recv(st->dpc, &hdr, buff, buff_sz);
+        if ((rc < 0) || (hdr.mtype != FTP_MT_SIGS) || (rc % sizeof(ftp_sig) != 0) ||
+                (hdr.offset != received) ||
+                (received + rc / sizeof(ftp_sig) > d->num_blocks)){
+            free(d->sigs);
+            free(d);
+            return FTP_ERR_PROTOCOL;
+        }
+        memcpy(d->sigs + received, buff, rc);
+        received += rc / sizeof(ftp_sig);
+    } while (!(hdr.flags & FTP_FL_LAST));
+
+    file->delta = d;
+    return FTP_NO_ERROR;
+}
+
+/*
+ *  Announces the stream to the server and waits for its status, the
+ *  client always offers to resume, the server decides
+ */
+static int client_open(ftp_stream *st){
+    static __thread char rBuff[FTP_MAX_DATA];
+    ftp_file *file = st->file;
+    ftp_pdu hdr = {0};
+    ftp_open req = {0};
+    int rc;
+
+    req.file_size = file->size;
+    req.file_mtime = file->mtime;
+    req.range_off = st->range_off;
+    req.range_len = st->range_len;
+    req.stream_id = st->id;
+    req.num_streams = file->num_streams;
+    strncpy(req.file_name, file->name, sizeof(req.file_name) - 1);
+
+    hdr.mtype = FTP_MT_OPEN;
+    hdr.flags = FTP_FL_RESUME | (file->sparse ? FTP_FL_SPARSE : 0);
+    if ((st->id == 0) && file->cfg->delta && (file->map != NULL))
+        hdr.flags |= FTP_FL_DELTA;
+    if (ftp_send(st->dpc, &hdr, &req, sizeof(req)) < 0)
+        return FTP_ERR_IO;
+    rc = ftp_recv(st->dpc, &hdr, rBuff, sizeof(rBuff));
+    if ((rc < 0) || (hdr.mtype != FTP_MT_OPENACK))
+        return FTP_ERR_PROTOCOL;
+    if ((hdr.err_num != FTP_NO_ERROR) && (hdr.err_num != FTP_ERR_STREAMS))
+        printf("ERROR:  Server refused stream %d of %s, error %d\n", st->id,
+            file->name, hdr.err_num);
+    else if ((hdr.flags & FTP_FL_DELTA) && (rc == sizeof(ftp_delta_info)))
+        return client_recv_sigs(st, (ftp_delta_info *)rBuff, rBuff, sizeof(rBuff));
+    else if (hdr.flags & FTP_FL_RESUME)
+        return client_recv_journal(st, rBuff, sizeof(rBuff));
+    return hdr.err_num;
+}
+
+static int client_send_hole(ftp_stream *st, uint64_t offset, uint64_t len){
+    ftp_pdu hdr = {0};
+    ftp_hole hole = { .len = len };
+
+    hdr.mtype = FTP_MT_HOLE;
+    hdr.offset = offset;
+    if (ftp_send(st->dpc, &hdr, &hole, sizeof(hole)) < 0)
+        return FTP_ERR_IO;
+    st->holes += len;
+    return FTP_NO_ERROR;
+}
+
+/*
+ *  The compression stage, sends len bytes (at most FTP_Z_BLOCK) of the file
+ *  that belong at offset.  A block is sent as ZDATA if compressing it saves
+ *  at least an eighth, otherwise as plain DATA straight from data.  Every
+ *  block that does not compress doubles the number of blocks that are sent
+ *  without trying, so an incompressible file costs next to no CPU.  A
+ *  block of zeros is sent as a HOLE instead.
+ */
+static int client_send_block(ftp_stream *st, const char *data, uint64_t offset, int len){
+    static __thread uint8_t zBuff[FTP_Z_BLOCK];
+    ftp_pdu hdr = {0};
+    int i, bytes, zlen = 0;
+
+    if (dh_all_zero((const uint8_t *)data, len))
+        return client_send_hole(st, offset, len);
+
+    st->z_raw += len;
+    if (st->file->cfg->compress){
+        if (st->z_skip > 0){
+            st->z_skip--;
+        } else {
+            zlen = lz_compress((const uint8_t *)data, len, zBuff, len - len / 8);
+            if (zlen == 0){
+                st->z_backoff = (st->z_backoff == 0) ? 1 : st->z_backoff * 2;
+                if (st->z_backoff > FTP_Z_MAX_SKIP)
+                    st->z_backoff = FTP_Z_MAX_SKIP;
+                st->z_skip = st->z_backoff;
+            } else {
+                st->z_backoff = 0;
+            }
+        }
+    }
+
+    if (zlen > 0){
+        hdr.mtype = FTP_MT_ZDATA;
+        hdr.offset = offset;
+        for (i = 0; i < zlen; i += bytes){
+            bytes = (zlen - i) < FTP_MAX_DATA ? zlen - i : FTP_MAX_DATA;
+            hdr.flags = (i + bytes == zlen) ? FTP_FL_LAST : 0;
+            if (ftp_send(st->dpc, &hdr, zBuff + i, bytes) < 0)
+                return FTP_ERR_IO;
+        }
+        st->z_sent += zlen;
+        return FTP_NO_ERROR;
+    }
+
+    hdr.mtype = FTP_MT_DATA;
+    for (i = 0; i < len; i += bytes){
+        bytes = (len - i) < FTP_MAX_DATA ? len - i : FTP_MAX_DATA;
+        hdr.offset = offset + i;
+        if (ftp_send(st->dpc, &hdr, data + i, bytes) < 0)
+            return FTP_ERR_IO;
     }
+    st->z_sent += len;
+    return FTP_NO_ERROR;
+}
+
+/*
+ *  Sends the streams range of the file.  With a mapping each message gets
+ *  its payload straight out of the page cache, du-proto hands it to the
+ *  kernel without copying.  The kernel is told the access is sequential,
+ *  the next window is prefetched as we go and pages already sent are
+ *  dropped so a multi-GB file does not pin its whole size in memory.
+ *  Files that could not be mapped are read with pread() instead.  Chunks
+ *  the server already has from an earlier attempt are skipped, and so are
+ *  the holes of a sparse file, found with SEEK_DATA/SEEK_HOLE and sent as
+ *  one HOLE each without being read.
+ */
+static int client_send_range(ftp_stream *st){
+    static __thread char sBuff[FTP_Z_BLOCK];
+    ftp_file *file = st->file;
+    uint64_t off = st->range_off;
+    uint64_t end = st->range_off + st->range_len;
+    uint64_t prefetched = off;
+    uint64_t released = off;
+    uint64_t data_end = file->sparse ? off : end;
+
+    while (off < end){
+        int bytes = (end - off) < FTP_Z_BLOCK ? (int)(end - off) : FTP_Z_BLOCK;
+        const char *data = sBuff;
+
+        if ((file->done_map != NULL) && FTP_CHUNK_DONE(file->done_map, off / FTP_JOURNAL_CHUNK)){
+            off = (off / FTP_JOURNAL_CHUNK + 1) * FTP_JOURNAL_CHUNK;
+            if (prefetched < off)
+                prefetched = off;
+            continue;
+        }
+
+        if (off >= data_end){
+            off_t next = lseek(file->fd, off, SEEK_DATA);
+            if ((next < 0) && (errno == ENXIO))
+                next = end;                     //a hole up to the end of the file
+            else if (next < 0)
+                next = off;                     //can't tell, read it
+            if ((uint64_t)next > off){
+                uint64_t stop = ((uint64_t)next < end) ? (uint64_t)next : end;
+                if (client_send_hole(st, off, stop - off) != FTP_NO_ERROR)
+                    return FTP_ERR_IO;
+                off = stop;
+                if (prefetched < off)
+                    prefetched = off;
+                released = off & ~(uint64_t)(FTP_STRIPE_ALIGN - 1);
+                continue;
+            }
+            off_t hole = lseek(file->fd, off, SEEK_HOLE);
+            data_end = ((hole < 0) || ((uint64_t)hole > end)) ? end : (uint64_t)hole;
+            if (data_end <= off)
+                data_end = end;
+        }
+        if (off + bytes > data_end)
+            bytes = data_end - off;
+
+        if (file->map != NULL){
+            if (off >= prefetched){
+                uint64_t len = end - prefetched;
+                if (len > FTP_READAHEAD_SZ)
+                    len = FTP_READAHEAD_SZ;
+                madvise(file->map + prefetched, len, MADV_WILLNEED);
+                prefetched += len;
+            }
+            data = file->map + off;
+        } else if (pread(file->fd, sBuff, bytes, off) != bytes){
+            printf("ERROR:  Cannot read %s at offset %llu\n", file->path,
+                (unsigned long long)off);
+            return FTP_ERR_IO;
+        }
 
+        if (client_send_block(st, data, off, bytes) != FTP_NO_ERROR){
+            printf("ERROR:  dpsend() failed at offset %llu\n", (unsigned long long)off);
+            return FTP_ERR_IO;
+        }
+        off += bytes;
+
+        if ((file->map != NULL) && (off - released >= FTP_READAHEAD_SZ)){
+            madvise(file->map + released, FTP_READAHEAD_SZ, MADV_DONTNEED);
+            released += FTP_READAHEAD_SZ;
+        }
+    }
+    return FTP_NO_ERROR;
 }
 
+static int client_delta_literal(void *ctx, uint64_t offset, uint64_t len){
+    ftp_stream *st = ctx;
+    ftp_file *file = st->file;
 
+    file->delta->literal += len;
+    while (len > 0){
+        int bytes = len < FTP_Z_BLOCK ? (int)len : FTP_Z_BLOCK;
+        if (client_send_block(st, file->map + offset, offset, bytes) != FTP_NO_ERROR)
+            return FTP_ERR_IO;
+        offset += bytes;
+        len -= bytes;
+    }
+    return FTP_NO_ERROR;
+}
 
-void start_client(dp_connp dpc){
-    static char sBuff[500];
+static int client_delta_copy(void *ctx, uint64_t offset, uint32_t block, uint32_t count){
+    ftp_stream *st = ctx;
+    ftp_pdu hdr = {0};
+    ftp_copy cp = { .block = block, .count = count };
+
+    st->file->delta->copied += (uint64_t)count * st->file->delta->block_sz;
+    hdr.mtype = FTP_MT_COPY;
+    hdr.offset = offset;
+    if (ftp_send(st->dpc, &hdr, &cp, sizeof(cp)) < 0)
+        return FTP_ERR_IO;
+    return FTP_NO_ERROR;
+}
+
+/*
+ *  Sends the file as a delta against the servers copy, blocks the server
+ *  already has become COPY records and only the rest goes over the wire
+ */
+static int client_send_delta(ftp_stream *st){
+    ftp_file *file = st->file;
+    ftp_delta *d = file->delta;
+    int rc;
+
+    dd_index *idx = dd_index_build(d->sigs, d->num_blocks, d->block_sz);
+    if (idx == NULL)
+        return FTP_ERR_IO;
+    rc = dd_scan(idx, (const uint8_t *)file->map, file->size,
+                 client_delta_literal, client_delta_copy, st);
+    dd_index_free(idx);
+    if (rc == FTP_NO_ERROR)
+        printf("Delta: %llu bytes matched the servers copy, %llu bytes sent\n",
+            (unsigned long long)d->copied, (unsigned long long)d->literal);
+    return rc;
+}
+
+//Leaf digests of the source, runs on its own thread while the data is sent
+static void *client_hash_main(void *arg){
+    ftp_file *file = arg;
+    uint32_t i;
+
+    if (file->map != NULL){
+        dh_leaves((const uint8_t *)file->map, file->size, file->fd, file->leaves,
+                  dh_threads(file->size));
+        return NULL;
+    }
+    char *buff = malloc(DH_LEAF_SZ);
+    for (i = 0; (buff != NULL) && (i < file->num_leaves); i++){
+        uint64_t off = (uint64_t)i * DH_LEAF_SZ;
+        ssize_t len = (file->size - off) < DH_LEAF_SZ ? file->size - off : DH_LEAF_SZ;
+        if (pread(file->fd, buff, len, off) != len)
+            break;
+        file->leaves[i] = dh_xxh64(buff, len, 0);
+    }
+    free(buff);
+    return NULL;
+}
+
+static int client_send_file(ftp_stream *st, uint32_t entry);
+static int client_flush_recs(ftp_stream *st);
+
+static int client_send_leaf(ftp_stream *st, uint32_t leaf){
+    static __thread char lBuff[FTP_Z_BLOCK];
+    ftp_file *file = st->file;
+    uint64_t off = (uint64_t)leaf * DH_LEAF_SZ;
+    uint64_t end = off + DH_LEAF_SZ;
+
+    if (end > file->size)
+        end = file->size;
+    while (off < end){
+        int bytes = (end - off) < FTP_Z_BLOCK ? (int)(end - off) : FTP_Z_BLOCK;
+        const char *data = lBuff;
+
+        if (file->map != NULL)
+            data = file->map + off;
+        else if (pread(file->fd, lBuff, bytes, off) != bytes)
+            return FTP_ERR_IO;
+        if (client_send_block(st, data, off, bytes) != FTP_NO_ERROR)
+            return FTP_ERR_IO;
+        off += bytes;
+    }
+    return FTP_NO_ERROR;
+}
+
+/*
+ *  Sends the leaf digests and resends whatever the server reports as
+ *  damaged, until the file matches or FTP_VERIFY_TRIES rounds are used up
+ */
+static int client_verify(ftp_stream *st){
+    static __thread char rBuff[FTP_MAX_DATA];
+    uint32_t per_msg = FTP_MAX_DATA / sizeof(uint64_t);
+    ftp_file *file = st->file;
+    uint32_t *bad;
+    uint64_t root[2];
+    ftp_pdu hdr;
+    int round, rc;
+
+    bad = malloc(sizeof(uint32_t) * (file->num_leaves + 1));
+    if (bad == NULL)
+        return FTP_ERR_IO;
+
+    for (round = 0; round < FTP_VERIFY_TRIES; round++){
+        uint32_t i = 0, num_bad = 0;
+
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.mtype = FTP_MT_VERIFY;
+        do {
+            uint32_t n = (file->num_leaves - i) < per_msg ? file->num_leaves - i : per_msg;
+            hdr.offset = i;
+            hdr.flags = (i + n == file->num_leaves) ? FTP_FL_LAST : 0;
+            if (ftp_send(st->dpc, &hdr, file->leaves + i, n * sizeof(uint64_t)) < 0)
+                goto fail;
+            i += n;
+        } while (i < file->num_leaves);
+
+        do {
+            rc = ftp_recv(st->dpc, &hdr, rBuff, sizeof(rBuff));
+            if ((rc < 0) || (hdr.mtype != FTP_MT_VERIFYACK) || (rc % sizeof(uint32_t) != 0))
+                goto fail;
+            for (i = 0; i < rc / sizeof(uint32_t); i++){
+                uint32_t leaf = ((uint32_t *)rBuff)[i];
+                if ((leaf < file->num_leaves) && (num_bad < file->num_leaves))
+                    bad[num_bad++] = leaf;
+            }
+        } while (!(hdr.flags & FTP_FL_LAST));
+
+        if (num_bad == 0){
+            dh_root(file->leaves, file->num_leaves, file->size, root);
+            printf("Verified %s, digest %016llx%016llx\n", file->name,
+                (unsigned long long)root[0], (unsigned long long)root[1]);
+            free(bad);
+            return FTP_NO_ERROR;
+        }
+        printf("WARNING: %u %s of %s differ on the server, sending them again\n",
+            num_bad, (file->batch != NULL) ? "entries" : "leaves", file->name);
+        for (i = 0; i < num_bad; i++){
+            rc = (file->batch != NULL) ? client_send_file(st, bad[i]) : client_send_leaf(st, bad[i]);
+            if (rc != FTP_NO_ERROR)
+                goto fail;
+        }
+        if ((file->batch != NULL) && (client_flush_recs(st) != FTP_NO_ERROR))
+            goto fail;
+    }
+    printf("ERROR:  %s still differs on the server after %d rounds\n", file->name,
+        FTP_VERIFY_TRIES);
+fail:
+    free(bad);
+    return FTP_ERR_IO;
+}
+
+static int client_close(ftp_stream *st){
+    ftp_pdu hdr = {0};
+
+    hdr.mtype = FTP_MT_CLOSE;
+    if (ftp_send(st->dpc, &hdr, NULL, 0) < 0)
+        return FTP_ERR_IO;
+    return FTP_NO_ERROR;
+}
+
+/*
+ *  Sends the manifest of a batch, packed into as few messages as possible,
+ *  the server acknowledges once it created the whole tree
+ */
+static int client_send_manifest(ftp_stream *st){
+    static __thread char mBuff[FTP_MAX_DATA];
+    ftp_manifest *mf = &st->file->batch->mf;
+    ftp_pdu hdr = {0};
+    uint32_t next = 0;
+    int rc;
+
+    hdr.mtype = FTP_MT_MANIFEST;
+    while (next < mf->num_items){
+        hdr.offset = next;
+        rc = mf_pack(mf, &next, mBuff, sizeof(mBuff));
+        hdr.flags = (next == mf->num_items) ? FTP_FL_LAST : 0;
+        if (ftp_send(st->dpc, &hdr, mBuff, rc) < 0)
+            return FTP_ERR_IO;
+    }
+    rc = ftp_recv(st->dpc, &hdr, mBuff, sizeof(mBuff));
+    if ((rc < 0) || (hdr.mtype != FTP_MT_OPENACK))
+        return FTP_ERR_PROTOCOL;
+    if (hdr.err_num != FTP_NO_ERROR)
+        printf("ERROR:  Server refused the tree %s, error %d\n", st->file->name, hdr.err_num);
+    return hdr.err_num;
+}
+
+static int client_flush_recs(ftp_stream *st){
+    ftp_batch *b = st->file->batch;
+    ftp_pdu hdr = {0};
+
+    if (b->pack_sz == 0)
+        return FTP_NO_ERROR;
+    hdr.mtype = FTP_MT_RECS;
+    if (ftp_send(st->dpc, &hdr, b->pack, b->pack_sz) < 0)
+        return FTP_ERR_IO;
+    b->pack_sz = 0;
+    b->num_msgs++;
+    return FTP_NO_ERROR;
+}
+
+/*
+ *  Appends one file of the batch to the RECS message being packed.  A file
+ *  that does not fit is split over as many messages as it needs, the next
+ *  file starts right behind its tail.  The digest for VERIFY is taken from
+ *  the same mapping.
+ */
+static int client_send_file(ftp_stream *st, uint32_t entry){
+    ftp_file *file = st->file;
+    ftp_batch *b = file->batch;
+    ftp_mf_item *it = &b->mf.items[entry];
+    char path[FTP_MF_NAME_SZ + 16];
+    const char *map = "";
+    struct stat sb;
+    uint64_t off = 0;
+    int fd, rc = FTP_NO_ERROR;
+
+    if (!S_ISREG(it->mode))
+        return FTP_NO_ERROR;
+    snprintf(path, sizeof(path), "./outfile/%s", it->name);
+    fd = open(path, O_RDONLY);
+    if ((fd < 0) || (fstat(fd, &sb) < 0) || ((uint64_t)sb.st_size != it->size)){
+        printf("ERROR:  Cannot read %s or it changed size\n", path);
+        if (fd >= 0)
+            close(fd);
+        return FTP_ERR_IO;
+    }
+    if (it->size > 0){
+        map = mmap(NULL, it->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED){
+            close(fd);
+            return FTP_ERR_IO;
+        }
+    }
+    file->leaves[entry] = dh_xxh64(map, it->size, 0);
+
+    while ((off < it->size) && (rc == FTP_NO_ERROR)){
+        int room = FTP_MAX_DATA - b->pack_sz - (int)sizeof(ftp_rec);
+        ftp_rec rec;
+
+        if ((room < FTP_REC_MIN) && ((uint64_t)room < it->size - off)){
+            rc = client_flush_recs(st);
+            continue;
+        }
+        rec.file = entry;
+        rec.len = ((uint64_t)room < it->size - off) ? (uint32_t)room : (uint32_t)(it->size - off);
+        rec.offset = off;
+        memcpy(b->pack + b->pack_sz, &rec, sizeof(rec));
+        memcpy(b->pack + b->pack_sz + sizeof(rec), map + off, rec.len);
+        b->pack_sz += sizeof(rec) + rec.len;
+        off += rec.len;
+        if (b->pack_sz > FTP_MAX_DATA - (int)sizeof(ftp_rec) - FTP_REC_MIN)
+            rc = client_flush_recs(st);
+    }
+    if (it->size > 0)
+        munmap((void *)map, it->size);
+    close(fd);
+    return rc;
+}
+
+/*
+ *  Batch mode, sends the tree below ./outfile/fname over one connection:
+ *  the manifest first, then every file back to back, then the digests
+ */
+static void start_batch_client(dp_connp dpc, prog_config *cfg){
+    ftp_stream st;
+    ftp_file file;
+    ftp_batch *b;
+    uint32_t i;
+    int rc;
+
+    memset(&st, 0, sizeof(st));
+    memset(&file, 0, sizeof(file));
+    if ((cfg->num_streams > 1) || cfg->delta || cfg->compress)
+        printf("WARNING: batch mode uses a single stream without delta or compression\n");
+    b = calloc(1, sizeof(ftp_batch));
+    if ((b == NULL) || (mf_walk(&b->mf, "./outfile", cfg->file_name) < 0)){
+        printf("ERROR:  Cannot list ./outfile/%s\n", cfg->file_name);
+        exit(-1);
+    }
+    file.cfg = cfg;
+    file.fd = -1;
+    file.batch = b;
+    file.num_streams = 1;
+    file.num_leaves = b->mf.num_items;
+    file.leaves = calloc(file.num_leaves + 1, sizeof(uint64_t));
+    if (file.leaves == NULL){
+        perror("Cannot allocate the digests");
+        exit(-1);
+    }
+    strncpy(file.name, cfg->file_name, sizeof(file.name) - 1);
+    st.dpc = dpc;
+    st.file = &file;
+    printf("Sending %s, %u files and %u directories, %llu bytes\n", file.name,
+        b->mf.num_files, b->mf.num_dirs, (unsigned long long)b->mf.bytes);
+
+    rc = client_send_manifest(&st);
+    for (i = 0; (rc == FTP_NO_ERROR) && (i < b->mf.num_items); i++)
+        rc = client_send_file(&st, i);
+    if (rc == FTP_NO_ERROR)
+        rc = client_flush_recs(&st);
+    if (rc == FTP_NO_ERROR)
+        printf("Batch: %u files in %u data messages\n", b->mf.num_files, b->num_msgs);
+    if (rc == FTP_NO_ERROR)
+        rc = client_verify(&st);
+    if (rc == FTP_NO_ERROR)
+        rc = client_close(&st);
+    dpdisconnect(dpc);
+
+    mf_free(&b->mf);
+    free(b);
+    free(file.leaves);
+    if (rc != FTP_NO_ERROR){
+        printf("ERROR:  Transfer of %s failed, error %d\n", file.name, rc);
+        exit(-1);
+    }
+}
+
+//Streams 1..n-1 run on their own thread and du-proto connection
+static void *client_stream_thread(void *arg){
+    ftp_stream *st = arg;
+    prog_config *cfg = st->file->cfg;
+
+    st->dpc = dpClientInit(cfg->svr_ip_addr, cfg->port_number + st->id);
+    if (st->dpc == NULL){
+        st->rc = FTP_ERR_IO;
+        return NULL;
+    }
+    setup_metrics(st->dpc, cfg, st->id);
+    setup_traffic(st->dpc, cfg);
+    if (dpconnect(st->dpc) < 0){
+        printf("ERROR:  Stream %d cannot connect\n", st->id);
+        st->rc = FTP_ERR_IO;
+        return NULL;
+    }
+
+    st->rc = client_open(st);
+    if (st->rc == FTP_NO_ERROR)
+        st->rc = client_send_range(st);
+    if (st->rc == FTP_NO_ERROR)
+        st->rc = client_close(st);
+    dpdisconnect(st->dpc);
+    return NULL;
+}
+
+/*
+ *  Splits the file into num_streams page aligned ranges, small files use
+ *  fewer streams so that no stream is left without data
+ */
+static int plan_stripes(ftp_file *file, ftp_stream *streams, int num_streams){
+    uint64_t stripe;
+    int i, n;
+
+    if (num_streams < 1)
+        num_streams = 1;
+    if (num_streams > FTP_MAX_STREAMS)
+        num_streams = FTP_MAX_STREAMS;
+
+    stripe = (file->size + num_streams - 1) / num_streams;
+    stripe = (stripe + FTP_STRIPE_ALIGN - 1) / FTP_STRIPE_ALIGN * FTP_STRIPE_ALIGN;
+    n = (stripe == 0) ? 1 : (int)((file->size + stripe - 1) / stripe);
+
+    for (i = 0; i < n; i++){
+        streams[i].id = i;
+        streams[i].file = file;
+        streams[i].range_off = (uint64_t)i * stripe;
+        streams[i].range_len = (i == n - 1) ? file->size - streams[i].range_off : stripe;
+    }
+    file->num_streams = n;
+    return n;
+}
+
+void start_client(dp_connp dpc, prog_config *cfg){
+    ftp_stream streams[FTP_MAX_STREAMS];
+    ftp_file file;
+    struct stat st;
+    int i, rc;
 
     if(!dpc->isConnected) {
         printf("Client not connected\n");
         return;
     }
+    if (cfg->batch){
+        start_batch_client(dpc, cfg);
+        return;
+    }
 
+    memset(streams, 0, sizeof(streams));
+    memset(&file, 0, sizeof(file));
+    file.cfg = cfg;
+    strncpy(file.name, cfg->file_name, sizeof(file.name) - 1);
+    //by default client will look for files in the ./outfile directory
+    snprintf(file.path, sizeof(file.path), "./outfile/%s", cfg->file_name);
 
-    FILE *f = fopen(full_file_path, "rb");
-    if(f == NULL){
-        printf("ERROR:  Cannot open file %s\n", full_file_path);
+    file.fd = open(file.path, O_RDONLY);
+    if(file.fd < 0){
+        printf("ERROR:  Cannot open file %s\n", file.path);
         exit(-1);
     }
-    if (dpc->isConnected == false){
-        perror("Expecting the protocol to be in connect state, but its not");
+    if ((fstat(file.fd, &st) < 0) || !S_ISREG(st.st_mode)){
+        printf("ERROR:  %s is not a regular file\n", file.path);
         exit(-1);
     }
+    file.size = st.st_size;
+    file.mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    file.sparse = ((uint64_t)st.st_blocks * 512 < file.size);
 
-    int bytes = 0;
+    //Prefer the zero copy mmap path, empty files can't be mapped
+    if (file.size > 0){
+        file.map = mmap(NULL, file.size, PROT_READ, MAP_PRIVATE, file.fd, 0);
+        if (file.map == MAP_FAILED)
+            file.map = NULL;
+        else {
+            posix_fadvise(file.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            madvise(file.map, file.size, MADV_SEQUENTIAL);
+        }
+    }
 
-    while ((bytes = fread(sBuff, 1, sizeof(sBuff), f )) > 0)
-        dpsend(dpc, sBuff, bytes);
+    if (cfg->delta && (cfg->num_streams > 1)){
+        printf("WARNING: delta mode uses a single stream\n");
+        cfg->num_streams = 1;
+    }
+    plan_stripes(&file, streams, cfg->num_streams);
+    streams[0].dpc = dpc;
 
-    fclose(f);
+    file.num_leaves = dh_num_leaves(file.size);
+    file.leaves = calloc(file.num_leaves + 1, sizeof(uint64_t));
+    if ((file.leaves == NULL) || (pthread_create(&file.hasher, NULL, client_hash_main, &file) != 0)){
+        perror("Cannot start hashing the file");
+        exit(-1);
+    }
+
+    //the server gets ready for the other streams while it handles this OPEN
+    rc = client_open(&streams[0]);
+    if ((rc == FTP_ERR_STREAMS) && (file.num_streams > 1)){
+        printf("WARNING: the server takes a single stream per upload, not striping\n");
+        plan_stripes(&file, streams, 1);
+        rc = client_open(&streams[0]);
+    }
+    if (rc == FTP_NO_ERROR){
+        for (i = 1; i < file.num_streams; i++){
+            if (pthread_create(&streams[i].thread, NULL, client_stream_thread, &streams[i]) != 0){
+                perror("Cannot start stream thread");
+                exit(-1);
+            }
+        }
+        if (file.delta != NULL)
+            rc = client_send_delta(&streams[0]);
+        else
+            rc = client_send_range(&streams[0]);
+        for (i = 1; i < file.num_streams; i++){
+            pthread_join(streams[i].thread, NULL);
+            if (streams[i].rc != FTP_NO_ERROR)
+                rc = streams[i].rc;
+        }
+    }
+    pthread_join(file.hasher, NULL);
+    if (rc == FTP_NO_ERROR)
+        rc = client_verify(&streams[0]);
+    if (rc == FTP_NO_ERROR)
+        rc = client_close(&streams[0]);
     dpdisconnect(dpc);
-}
 
-void start_server(dp_connp dpc){
-    server_loop(dpc, sbuffer, rbuffer, sizeof(sbuffer), sizeof(rbuffer));
+    uint64_t holes = 0;
+    for (i = 0; i < file.num_streams; i++)
+        holes += streams[i].holes;
+    if (holes > 0)
+        printf("Holes: %llu bytes of zeros sent as holes\n", (unsigned long long)holes);
+
+    if (cfg->compress){
+        uint64_t raw = 0, sent = 0;
+        for (i = 0; i < file.num_streams; i++){
+            raw += streams[i].z_raw;
+            sent += streams[i].z_sent;
+        }
+        printf("Compression: %llu bytes of file data sent as %llu bytes\n",
+            (unsigned long long)raw, (unsigned long long)sent);
+    }
+
+    if (file.map != NULL)
+        munmap(file.map, file.size);
+    free(file.done_map);
+    free(file.leaves);
+    if (file.delta != NULL){
+        free(file.delta->sigs);
+        free(file.delta);
+    }
+    close(file.fd);
+    if (rc != FTP_NO_ERROR){
+        printf("ERROR:  Transfer of %s failed, error %d\n", file.name, rc);
+        exit(-1);
+    }
 }
 
 
@@ -154,36 +1997,49 @@ int main(int argc, char *argv[])
     printf("MODE %d\n", cfg.prog_mode);
     printf("PORT %d\n", cfg.port_number);
     printf("FILE NAME: %s\n", cfg.file_name);
+    if (cfg.rate > 0){
+        uint64_t bytes = cfg.rate / 8;
+        cfg.bucket = dp_bucket_new(bytes, bytes * FTP_RATE_BURST_US / 1000000);
+        printf("RATE CAP: %llu bit/s\n", (unsigned long long)cfg.rate);
+    }
 
     switch(cmd){
         case PROG_MD_CLI:
-            //by default client will look for files in the ./outfile directory
-            snprintf(full_file_path, sizeof(full_file_path), "./outfile/%s", cfg.file_name);
             dpc = dpClientInit(cfg.svr_ip_addr,cfg.port_number);
+            setup_metrics(dpc, &cfg, 0);
+            setup_traffic(dpc, &cfg);
             rc = dpconnect(dpc);
             if (rc < 0) {
                 perror("Error establishing connection");
                 exit(-1);
             }
 
-            start_client(dpc);
+            start_client(dpc, &cfg);
+            dp_bucket_free(cfg.bucket);
             exit(0);
             break;
 
         case PROG_MD_SVR:
+            if (cfg.workers > 0){
+                start_server_pool(&cfg);
+                break;
+            }
             //by default server will look for files in the ./infile directory
-            snprintf(full_file_path, sizeof(full_file_path), "./infile/%s", cfg.file_name);
             dpc = dpServerInit(cfg.port_number);
+            setup_metrics(dpc, &cfg, 0);
+            setup_traffic(dpc, &cfg);
             rc = dplisten(dpc);
             if (rc < 0) {
                 perror("Error establishing connection");
                 exit(-1);
             }
 
-            start_server(dpc);
+            start_server(dpc, &cfg);
             break;
         default:
             printf("ERROR: Unknown Program Mode.  Mode set is %d\n", cmd);
             break;
     }
+    //every connection is closed by now, the worker threads joined
+    dp_bucket_free(cfg.bucket);
 }
@@ -1,15 +1,254 @@
 #pragma once
 
+#include <stdint.h>
+#include <pthread.h>
+
+#include "du-proto.h"
+#include "du-journal.h"
+#include "du-delta.h"
+#include "du-lz.h"
+#include "du-manifest.h"
+
 #define PROG_MD_CLI     0
 #define PROG_MD_SVR     1
 #define DEF_PORT_NO     2080
 #define FNAME_SZ        150
 #define PROG_DEF_FNAME  "test.c"
 #define PROG_DEF_SVR_ADDR   "127.0.0.1"
+#define PROG_METRICS_MS     1000
+#define FTP_READAHEAD_SZ    (4 * 1024 * 1024)   //mmap prefetch window
+#define FTP_MAX_STREAMS     16                  //stream i uses port + i
+#define FTP_STRIPE_ALIGN    4096                //stripe ranges start on a page
+#define FTP_Z_BLOCK         (16 * 1024)         //unit the client reads and compresses
+#define FTP_Z_MAX_SKIP      64                  //max blocks sent raw without trying
+#define FTP_VERIFY_TRIES    3                   //verify/resend rounds before giving up
+#define FTP_BATCH_MAX_OPEN  64                  //server: files kept open in a batch
+#define FTP_REC_MIN         64                  //client: least room worth a new record
+#define FTP_MAX_WORKERS     64                  //server: sessions served at once
+#define FTP_RATE_BURST_US   1000                //rate cap: bucket holds this much
 
 typedef struct prog_config{
     int     prog_mode;
     int     port_number;
     char    svr_ip_addr[16];
     char    file_name[128];
+    char    metrics_file[128];
+    int     num_streams;
+    int     delta;
+    int     compress;
+    int     batch;
+    int     workers;
+    int     direct;
+    uint64_t rate;                  //bits per second, 0 = no cap
+    int     prio;                   //DP_PRIO_*
+    int     dscp;                   //mark the priority class in the IP header
+    dp_bucket *bucket;              //shared by every connection, NULL if no cap
 } prog_config;
+
+/*
+ * du-ftp PDU
+ *
+ * Every du-proto message starts with an ftp_pdu, data_sz bytes of payload
+ * follow it.  A transfer is made of one or more streams, each one its own
+ * du-proto connection carrying a contiguous range of the file:
+ *
+ *   client                              server
+ *     OPEN (ftp_open)         ---->
+ *                             <----     OPENACK (err_num)
+ *                             <----     JOURNAL ... (resumed stream 0 only)
+ *     DATA (offset) ...       ---->
+ *     CLOSE                   ---->
+ *     dpdisconnect()          ---->
+ *
+ * Stream 0 is opened first, the server binds the ports of the other streams
+ * before it acknowledges it, then the client starts streams 1..n-1.  An
+ * OPEN with FTP_FL_RESUME asks the server to continue an earlier attempt,
+ * if it can the OPENACK carries FTP_FL_RESUME too and the chunk bitmap of
+ * the progress journal follows, the client then skips chunks already done.
+ *
+ * With FTP_FL_DELTA (single stream only) the server answers with the block
+ * checksums of the copy it already has (ftp_delta_info in the OPENACK, then
+ * SIGS messages) and the client sends COPY records for the blocks that are
+ * unchanged and DATA only for the rest.  The new version is assembled in a
+ * temporary file that replaces the old one once the stream closes cleanly.
+ *
+ * With compression on, the client sends each FTP_Z_BLOCK of the file that
+ * compresses well as ZDATA.  A ZDATA block is one LZ4 block, split over as
+ * many messages as it needs, with FTP_FL_LAST on the last of them.  Blocks
+ * that do not compress are sent as plain DATA.
+ *
+ * Before the final CLOSE the client sends the leaf digests of its file
+ * (see du-hash.h) in VERIFY messages.  The server waits for all streams
+ * to be written, hashes the file back from disk and answers with the list
+ * of leaves that differ in VERIFYACK messages.  The client sends those
+ * leaves again and repeats, up to FTP_VERIFY_TRIES rounds.
+ *
+ * A batch transfer sends a directory tree over stream 0 alone.  Instead of
+ * an OPEN the client sends the manifest of the tree (see du-manifest.h) in
+ * MANIFEST messages, the server creates every directory and file as the
+ * entries arrive and answers the last one with an OPENACK.  The contents
+ * then follow back to back in RECS messages, each one packs as many
+ * ftp_rec records as fit so a datagram can carry several small files.
+ * VERIFY and VERIFYACK work as above with one digest per manifest entry
+ * instead of one per leaf, a damaged file is sent again as a whole.
+ *
+ * Ranges of the file that are holes, or blocks that are all zero, go as a
+ * HOLE with the length in an ftp_hole instead of as data.  The server
+ * punches them out of its copy.  An OPEN with FTP_FL_SPARSE tells the
+ * server the file is sparse, it is then not preallocated.
+ */
+#define FTP_MT_OPEN         1           //start of a stream, names the file
+#define FTP_MT_OPENACK      2           //server status for an OPEN
+#define FTP_MT_DATA         3           //file bytes at offset
+#define FTP_MT_CLOSE        4           //stream finished, graceful close
+#define FTP_MT_JOURNAL      5           //journal bitmap bytes at offset
+#define FTP_MT_SIGS         6           //ftp_sig array, offset is the first block
+#define FTP_MT_COPY         7           //ftp_copy, basis blocks to offset
+#define FTP_MT_ZDATA        8           //compressed block for offset, in parts
+#define FTP_MT_VERIFY       9           //uint64_t leaf digests, offset is the first leaf
+#define FTP_MT_VERIFYACK    10          //uint32_t damaged leaves, err_num is the count
+#define FTP_MT_MANIFEST     11          //packed ftp_mf_entry list, offset is the first entry
+#define FTP_MT_RECS         12          //packed ftp_rec records
+#define FTP_MT_HOLE         13          //ftp_hole, zeros at offset
+
+#define FTP_FL_RESUME       0x01        //OPEN/OPENACK: resume a partial file
+#define FTP_FL_LAST         0x02        //JOURNAL/SIGS/ZDATA/VERIFY*/MANIFEST: last of the list
+#define FTP_FL_DELTA        0x04        //OPEN/OPENACK: delta transfer
+#define FTP_FL_SPARSE       0x08        //OPEN: the file has holes, don't preallocate
+
+#define FTP_NO_ERROR        0
+#define FTP_ERR_NOT_FOUND   -1
+#define FTP_ERR_ACCESS      -2
+#define FTP_ERR_PROTOCOL    -3
+#define FTP_ERR_IO          -4
+#define FTP_ERR_BUSY        -5          //another session is receiving the file
+#define FTP_ERR_STREAMS     -6          //server takes a single stream per upload
+
+typedef struct ftp_pdu {
+    int         mtype;
+    int         flags;
+    int         err_num;
+    int         data_sz;
+    uint64_t    offset;
+} ftp_pdu;
+
+#define FTP_MAX_DATA        (DP_MAX_BUFF_SZ - (int)sizeof(ftp_pdu))
+#define FTP_NAME_SZ         128
+
+//payload of FTP_MT_OPEN
+typedef struct ftp_open {
+    uint64_t    file_size;
+    int64_t     file_mtime;                 //ns, identifies the file version
+    uint64_t    range_off;
+    uint64_t    range_len;
+    int         stream_id;
+    int         num_streams;
+    char        file_name[FTP_NAME_SZ];
+} ftp_open;
+
+//payload of a FTP_FL_DELTA OPENACK
+typedef struct ftp_delta_info {
+    uint64_t    basis_size;
+    uint32_t    block_sz;
+    uint32_t    num_blocks;
+} ftp_delta_info;
+
+//payload of FTP_MT_COPY
+typedef struct ftp_copy {
+    uint32_t    block;
+    uint32_t    count;
+} ftp_copy;
+
+//record in a FTP_MT_RECS message, len bytes of the file follow
+typedef struct ftp_rec {
+    uint32_t    file;                       //manifest entry
+    uint32_t    len;
+    uint64_t    offset;
+} ftp_rec;
+
+//payload of FTP_MT_HOLE
+typedef struct ftp_hole {
+    uint64_t    len;
+} ftp_hole;
+
+typedef struct ftp_batch{
+    ftp_manifest    mf;
+    int             complete;               //server: whole manifest received
+    uint32_t        failed;                 //server: entries it could not create
+    int             busy;                   //server: another session has the tree
+    uint32_t        open[FTP_BATCH_MAX_OPEN];   //server: entries with an open fd
+    int             num_open;
+    char            pack[FTP_MAX_DATA];     //client: RECS message being filled
+    int             pack_sz;
+    uint32_t        num_msgs;               //client: RECS messages sent
+} ftp_batch;
+
+typedef struct ftp_delta{
+    int         basis_fd;               //server: the copy being replaced
+    char        *basis;                 //server: its mapping
+    uint64_t    basis_size;
+    uint32_t    block_sz;
+    uint32_t    num_blocks;
+    ftp_sig     *sigs;
+    char        tmp_path[FNAME_SZ + 8]; //server: new version until complete
+    uint64_t    copied;                 //bytes reused from the basis
+    uint64_t    literal;                //bytes sent over the network
+} ftp_delta;
+
+struct ftp_stream;
+
+//State of the file being transferred, shared by all of its streams
+typedef struct ftp_file{
+    pthread_mutex_t     lock;
+    int                 fd;
+    int                 direct_fd;      //server: O_DIRECT descriptor, -1 if none
+    char                *map;           //client: read only mapping
+    uint64_t            size;
+    int64_t             mtime;
+    int                 sparse;         //file has holes on disk
+    int                 num_streams;
+    ftp_journal         *journal;       //server: progress journal
+    uint8_t             *done_map;      //client: chunks the server already has
+    ftp_delta           *delta;         //delta transfer state, NULL if off
+    ftp_batch           *batch;         //directory tree transfer, NULL if off
+    uint64_t            *leaves;        //leaf (batch: file) digests of the source
+    uint32_t            num_leaves;
+    int                 verified;       //server: last VERIFY round matched
+    pthread_t           hasher;         //client: hashes while streams send
+    pthread_cond_t      done_cv;        //server: signalled as streams finish
+    int                 streams_done;
+    int                 claimed;        //server: name held against other sessions
+    char                name[FTP_NAME_SZ];
+    char                path[FNAME_SZ];
+    struct ftp_stream   *streams;
+    prog_config         *cfg;
+} ftp_file;
+
+//Server worker, accepts and serves sessions on its own SO_REUSEPORT socket
+typedef struct ftp_worker{
+    int                 id;
+    int                 cpu;            //-1 if not pinned
+    dp_connp            listener;
+    pthread_t           thread;
+    uint64_t            sessions;
+    prog_config         *cfg;
+} ftp_worker;
+
+typedef struct ftp_stream{
+    int                 id;
+    dp_connp            dpc;
+    ftp_file            *file;
+    uint64_t            range_off;
+    uint64_t            range_len;
+    pthread_t           thread;
+    int                 closed;         //graceful FTP_MT_CLOSE seen
+    int                 rc;
+    uint8_t             *zbuf;          //server: ZDATA reassembly + output
+    int                 zlen;
+    uint64_t            zoff;
+    int                 z_skip;         //client: blocks left to send raw
+    int                 z_backoff;
+    uint64_t            z_raw;          //client: file bytes handed to the stage
+    uint64_t            z_sent;         //client: bytes that went on the wire
+    uint64_t            holes;          //client: bytes sent as HOLE
+} ftp_stream;
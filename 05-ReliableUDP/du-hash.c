@@ -0,0 +1,291 @@
+#define _GNU_SOURCE     //SEEK_DATA
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "du-hash.h"
+
+/*
+ *  Scalar weak checksum, also finishes the tail the vector loop leaves
+ */
+static void weak_scalar(const uint8_t *buff, size_t len, uint32_t *a, uint32_t *b){
+    uint32_t s1 = *a, s2 = *b;
+
+    for (size_t i = 0; i < len; i++){
+        s1 += buff[i];
+        s2 += s1;
+    }
+    *a = s1;
+    *b = s2;
+}
+
+#ifdef __SSE2__
+/*
+ *  16 bytes per step, for a chunk c:  b += 16 * a + sum((16 - j) * x[j])
+ *  and a += sum(x[j]).  psadbw does the byte sums, pmaddwd the weighted
+ *  ones.  Everything is kept mod 2^32 which is fine as the result is only
+ *  used mod 2^16.
+ */
+static void weak_sse2(const uint8_t *buff, size_t len, uint32_t *a, uint32_t *b){
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i w_lo = _mm_set_epi16(9, 10, 11, 12, 13, 14, 15, 16);
+    const __m128i w_hi = _mm_set_epi16(1, 2, 3, 4, 5, 6, 7, 8);
+    __m128i v_s1 = zero, v_s2 = zero, v_ps = zero;
+    size_t chunks = len / 16;
+    uint32_t s1, s2, ps, tmp[4];
+
+    for (size_t c = 0; c < chunks; c++){
+        __m128i x = _mm_loadu_si128((const __m128i *)(buff + c * 16));
+
+        v_ps = _mm_add_epi32(v_ps, v_s1);
+        v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(x, zero));
+        v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_unpacklo_epi8(x, zero), w_lo));
+        v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_unpackhi_epi8(x, zero), w_hi));
+    }
+
+    _mm_storeu_si128((__m128i *)tmp, v_s1);
+    s1 = tmp[0] + tmp[1] + tmp[2] + tmp[3];
+    _mm_storeu_si128((__m128i *)tmp, v_s2);
+    s2 = tmp[0] + tmp[1] + tmp[2] + tmp[3];
+    _mm_storeu_si128((__m128i *)tmp, v_ps);
+    ps = tmp[0] + tmp[1] + tmp[2] + tmp[3];
+
+    //fold in the starting a and b, a was added 16 times per chunk
+    *b += (uint32_t)(chunks * 16) * *a + 16 * ps + s2;
+    *a += s1;
+    weak_scalar(buff + chunks * 16, len - chunks * 16, a, b);
+}
+#endif
+
+uint32_t dh_weak(const uint8_t *buff, size_t len){
+    uint32_t a = 0, b = 0;
+
+#ifdef __SSE2__
+    weak_sse2(buff, len, &a, &b);
+#else
+    weak_scalar(buff, len, &a, &b);
+#endif
+    return DH_WEAK(a, b);
+}
+
+/*
+ *  True if len bytes at buff are all zero.  Four vectors are ORed per step
+ *  and the loop leaves at the first step that has a set bit, so data that
+ *  is not zero costs almost nothing.
+ */
+int dh_all_zero(const uint8_t *buff, size_t len){
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; i + 64 <= len; i += 64){
+        __m128i x = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128((const __m128i *)(buff + i)),
+                         _mm_loadu_si128((const __m128i *)(buff + i + 16))),
+            _mm_or_si128(_mm_loadu_si128((const __m128i *)(buff + i + 32)),
+                         _mm_loadu_si128((const __m128i *)(buff + i + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, zero)) != 0xffff)
+            return 0;
+    }
+#else
+    for (; i + 8 <= len; i += 8){
+        uint64_t v;
+        memcpy(&v, buff + i, sizeof(v));
+        if (v != 0)
+            return 0;
+    }
+#endif
+    for (; i < len; i++)
+        if (buff[i] != 0)
+            return 0;
+    return 1;
+}
+
+
+//// XXH64
+
+#define XXH_P1  0x9E3779B185EBCA87ULL
+#define XXH_P2  0xC2B2AE3D27D4EB4FULL
+#define XXH_P3  0x165667B19E3779F9ULL
+#define XXH_P4  0x85EBCA77C2B2AE63ULL
+#define XXH_P5  0x27D4EB2F165667C5ULL
+
+static inline uint64_t xxh_rotl(uint64_t x, int r){
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh_read64(const uint8_t *p){
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t xxh_read32(const uint8_t *p){
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input){
+    acc += input * XXH_P2;
+    acc = xxh_rotl(acc, 31);
+    return acc * XXH_P1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t val){
+    acc ^= xxh_round(0, val);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+uint64_t dh_xxh64(const void *buff, size_t len, uint64_t seed){
+    const uint8_t *p = buff;
+    const uint8_t *end = p + len;
+    uint64_t h;
+
+    if (len >= 32){
+        uint64_t v1 = seed + XXH_P1 + XXH_P2;
+        uint64_t v2 = seed + XXH_P2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_P1;
+
+        do {
+            v1 = xxh_round(v1, xxh_read64(p));
+            v2 = xxh_round(v2, xxh_read64(p + 8));
+            v3 = xxh_round(v3, xxh_read64(p + 16));
+            v4 = xxh_round(v4, xxh_read64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+
+        h = xxh_rotl(v1, 1) + xxh_rotl(v2, 7) + xxh_rotl(v3, 12) + xxh_rotl(v4, 18);
+        h = xxh_merge(h, v1);
+        h = xxh_merge(h, v2);
+        h = xxh_merge(h, v3);
+        h = xxh_merge(h, v4);
+    } else {
+        h = seed + XXH_P5;
+    }
+    h += len;
+
+    while (p + 8 <= end){
+        h ^= xxh_round(0, xxh_read64(p));
+        h = xxh_rotl(h, 27) * XXH_P1 + XXH_P4;
+        p += 8;
+    }
+    if (p + 4 <= end){
+        h ^= (uint64_t)xxh_read32(p) * XXH_P1;
+        h = xxh_rotl(h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    while (p < end){
+        h ^= (*p) * XXH_P5;
+        h = xxh_rotl(h, 11) * XXH_P1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+
+//// TREE HASH
+
+typedef struct dh_job{
+    const uint8_t       *data;
+    uint64_t            size;
+    int                 fd;                 //-1, or used to find holes
+    uint64_t            zero_leaf;          //digest of a full leaf of zeros
+    uint64_t            *leaves;
+    uint32_t            num_leaves;
+    _Atomic uint32_t    next;
+} dh_job;
+
+//a full leaf with no data in it, the mapping is never touched for those
+static int dh_hole_leaf(dh_job *job, uint32_t i){
+    off_t off = (off_t)i * DH_LEAF_SZ;
+    off_t data;
+
+    if ((job->fd < 0) || (off + DH_LEAF_SZ > (off_t)job->size))
+        return 0;
+    data = lseek(job->fd, off, SEEK_DATA);
+    if (data < 0)
+        return errno == ENXIO;
+    return data >= off + DH_LEAF_SZ;
+}
+
+//workers pull leaves one at a time so uneven page cache hits balance out
+static void *dh_worker(void *arg){
+    dh_job *job = arg;
+    uint32_t i;
+
+    while ((i = atomic_fetch_add(&job->next, 1)) < job->num_leaves){
+        if (dh_hole_leaf(job, i))
+            job->leaves[i] = job->zero_leaf;
+        else
+            job->leaves[i] = dh_leaf(job->data, job->size, i);
+    }
+    return NULL;
+}
+
+/*
+ *  Leaf digests of size bytes at data.  With fd, the file data maps, the
+ *  leaves that are holes in it are found with SEEK_DATA and never read.
+ */
+void dh_leaves(const uint8_t *data, uint64_t size, int fd, uint64_t *leaves, int nthreads){
+    pthread_t threads[DH_MAX_THREADS];
+    dh_job job = { .data = data, .size = size, .fd = fd, .leaves = leaves,
+                   .num_leaves = dh_num_leaves(size) };
+    int i, started = 0;
+
+    if (fd >= 0){
+        uint8_t *zeros = calloc(1, DH_LEAF_SZ);
+        if (zeros == NULL)
+            job.fd = -1;
+        else
+            job.zero_leaf = dh_xxh64(zeros, DH_LEAF_SZ, 0);
+        free(zeros);
+    }
+    atomic_init(&job.next, 0);
+    if (nthreads > DH_MAX_THREADS)
+        nthreads = DH_MAX_THREADS;
+    for (i = 1; i < nthreads; i++){
+        if (pthread_create(&threads[started], NULL, dh_worker, &job) != 0)
+            break;
+        started++;
+    }
+    dh_worker(&job);
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+}
+
+void dh_root(const uint64_t *leaves, uint32_t num_leaves, uint64_t size, uint64_t root[2]){
+    root[0] = dh_xxh64(leaves, (size_t)num_leaves * sizeof(uint64_t), size);
+    root[1] = dh_xxh64(leaves, (size_t)num_leaves * sizeof(uint64_t), ~size);
+}
+
+/*
+ *  One thread per online CPU, but only once there are enough leaves to
+ *  keep them busy
+ */
+int dh_threads(uint64_t size){
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t leaves = dh_num_leaves(size);
+
+    if (cpus < 1)
+        cpus = 1;
+    if (cpus > DH_MAX_THREADS)
+        cpus = DH_MAX_THREADS;
+    if (leaves < 4 * (uint32_t)cpus)
+        cpus = (leaves / 4) > 0 ? leaves / 4 : 1;
+    return (int)cpus;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Checksum kernels used by du-ftp
+ *
+ * dh_weak() is the rsync style rolling checksum, a is the sum of the bytes
+ * and b the sum of the running a values, both mod 2^16.  Computing it over
+ * a whole block uses SSE2 when the compiler targets it, dh_weak_roll()
+ * slides an existing checksum one byte forward.  dh_xxh64() is XXH64, used
+ * as the strong checksum.  dh_all_zero() finds blocks that can be sent as
+ * holes.
+ *
+ * Whole files are hashed as a two level tree: every DH_LEAF_SZ leaf gets an
+ * XXH64, the root is two XXH64s (seeded with the file size and its
+ * complement) over the ordered leaf list, 128 bits in total.  Leaves are
+ * independent so dh_leaves() spreads them over several threads, and a
+ * mismatch can be narrowed down to the leaves that differ.  All zero leaves
+ * share one digest, so leaves that are holes in a sparse file are not read.
+ */
+#define DH_WEAK(a, b)       (((uint32_t)(b) << 16) | ((a) & 0xffff))
+#define DH_LEAF_SZ          (1024 * 1024)
+#define DH_MAX_THREADS      8
+
+uint32_t dh_weak(const uint8_t *buff, size_t len);
+uint64_t dh_xxh64(const void *buff, size_t len, uint64_t seed);
+int      dh_all_zero(const uint8_t *buff, size_t len);
+void     dh_leaves(const uint8_t *data, uint64_t size, int fd, uint64_t *leaves, int nthreads);
+void     dh_root(const uint64_t *leaves, uint32_t num_leaves, uint64_t size, uint64_t root[2]);
+int      dh_threads(uint64_t size);
+
+static inline uint32_t dh_num_leaves(uint64_t size){
+    return (uint32_t)((size + DH_LEAF_SZ - 1) / DH_LEAF_SZ);
+}
+
+static inline uint64_t dh_leaf(const uint8_t *data, uint64_t size, uint32_t i){
+    uint64_t off = (uint64_t)i * DH_LEAF_SZ;
+    uint64_t len = (size - off) < DH_LEAF_SZ ? size - off : DH_LEAF_SZ;
+
+    return dh_xxh64(data + off, len, 0);
+}
+
+static inline uint32_t dh_weak_roll(uint32_t weak, size_t len, uint8_t out, uint8_t in){
+    uint32_t a = weak & 0xffff;
+    uint32_t b = weak >> 16;
+
+    a = (a - out + in) & 0xffff;
+    b = (b - (uint32_t)len * out + a) & 0xffff;
+    return DH_WEAK(a, b);
+}
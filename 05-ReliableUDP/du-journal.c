@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#include "du-journal.h"
+
+/*
+ *  Loads an existing journal, returns 0 only if it describes the same
+ *  version of the file we are about to receive
+ */
+static int journal_load(ftp_journal *j){
+    ftp_journal_hdr hdr;
+
+    if (pread(j->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+        return -1;
+    if ((hdr.magic != j->hdr.magic) || (hdr.file_size != j->hdr.file_size) ||
+        (hdr.file_mtime != j->hdr.file_mtime) || (hdr.chunk_sz != j->hdr.chunk_sz) ||
+        (hdr.num_chunks != j->hdr.num_chunks))
+        return -1;
+    if (pread(j->fd, j->bitmap, j->map_sz, sizeof(hdr)) != j->map_sz)
+        return -1;
+
+    for (uint32_t c = 0; c < j->hdr.num_chunks; c++)
+        if (FTP_CHUNK_DONE(j->bitmap, c))
+            j->chunks_done++;
+    return 0;
+}
+
+int ftp_journal_exists(const char *file_path){
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s%s", file_path, FTP_JOURNAL_EXT);
+    return access(path, F_OK) == 0;
+}
+
+/*
+ *  Opens the journal for file_path.  With resume set a matching journal
+ *  from an earlier attempt is picked up, otherwise (or if it does not
+ *  match) a fresh one is started.  j->resumed tells the caller whether the
+ *  partial file has to be kept.
+ */
+ftp_journal *ftp_journal_open(const char *file_path, uint64_t file_size,
+                              int64_t file_mtime, int resume){
+    ftp_journal *j = calloc(1, sizeof(ftp_journal));
+    if (j == NULL)
+        return NULL;
+
+    j->fd = -1;
+    j->hdr.magic = FTP_JOURNAL_MAGIC;
+    j->hdr.file_size = file_size;
+    j->hdr.file_mtime = file_mtime;
+    j->hdr.chunk_sz = FTP_JOURNAL_CHUNK;
+    j->hdr.num_chunks = ftp_journal_chunks(file_size);
+    j->map_sz = (j->hdr.num_chunks + 7) / 8;
+    j->bitmap = calloc(1, j->map_sz + 1);
+    j->cover = calloc(j->hdr.num_chunks + 1, sizeof(*j->cover));
+    j->path = malloc(strlen(file_path) + sizeof(FTP_JOURNAL_EXT));
+    if ((j->bitmap == NULL) || (j->cover == NULL) || (j->path == NULL))
+        goto fail;
+    sprintf(j->path, "%s%s", file_path, FTP_JOURNAL_EXT);
+    pthread_mutex_init(&j->lock, NULL);
+
+    j->fd = open(j->path, O_RDWR | O_CREAT, 0644);
+    if (j->fd < 0)
+        goto fail;
+
+    if (resume && (journal_load(j) == 0)){
+        j->resumed = 1;
+        return j;
+    }
+
+    memset(j->bitmap, 0, j->map_sz);
+    j->chunks_done = 0;
+    if ((ftruncate(j->fd, 0) < 0) ||
+        (pwrite(j->fd, &j->hdr, sizeof(j->hdr), 0) != sizeof(j->hdr)) ||
+        (pwrite(j->fd, j->bitmap, j->map_sz, sizeof(j->hdr)) != j->map_sz))
+        goto fail;
+    return j;
+
+fail:
+    perror("du-journal: cannot open journal");
+    if (j->fd >= 0)
+        close(j->fd);
+    free(j->path);
+    free(j->bitmap);
+    free(j->cover);
+    free(j);
+    return NULL;
+}
+
+/*
+ *  Adds [start, end) to the written ranges of a chunk, merging it with the
+ *  ranges it overlaps or touches.  Returns -1 if out of memory.
+ */
+static int cover_add(ftp_journal_cover *cv, uint32_t start, uint32_t end){
+    uint32_t i = 0, k;
+
+    while ((i < cv->n) && (cv->spans[i].end < start))
+        i++;
+    for (k = i; (k < cv->n) && (cv->spans[k].start <= end); k++){
+        if (cv->spans[k].start < start)
+            start = cv->spans[k].start;
+        if (cv->spans[k].end > end)
+            end = cv->spans[k].end;
+    }
+
+    if (k == i){
+        //touches nothing, a new span at i
+        if (cv->n == cv->cap){
+            uint32_t cap = (cv->cap == 0) ? 4 : cv->cap * 2;
+            ftp_journal_span *spans = realloc(cv->spans, cap * sizeof(*spans));
+            if (spans == NULL)
+                return -1;
+            cv->spans = spans;
+            cv->cap = cap;
+        }
+        memmove(&cv->spans[i + 1], &cv->spans[i], (cv->n - i) * sizeof(*cv->spans));
+        cv->n++;
+    } else {
+        //spans i..k-1 become one
+        memmove(&cv->spans[i + 1], &cv->spans[k], (cv->n - k) * sizeof(*cv->spans));
+        cv->n -= k - i - 1;
+    }
+    cv->spans[i].start = start;
+    cv->spans[i].end = end;
+    return 0;
+}
+
+/*
+ *  Called by the writer threads after a range of the file has been
+ *  written.  The range is added to the written ranges of each chunk it
+ *  touches, when they cover a whole chunk its bit is set and that byte of
+ *  the bitmap rewritten in the journal.  The data is in the page cache at
+ *  this point, so the journal survives a dropped connection or a killed
+ *  server but is not meant to survive a power loss.
+ */
+void ftp_journal_written(ftp_journal *j, uint64_t offset, uint64_t len){
+    uint64_t end = offset + len;
+
+    pthread_mutex_lock(&j->lock);
+    while (offset < end){
+        uint32_t c = offset / FTP_JOURNAL_CHUNK;
+        uint64_t c_off = (uint64_t)c * FTP_JOURNAL_CHUNK;
+        uint64_t c_end = c_off + FTP_JOURNAL_CHUNK;
+        if (c_end > j->hdr.file_size)
+            c_end = j->hdr.file_size;
+        uint64_t stop = (end < c_end) ? end : c_end;
+        ftp_journal_cover *cv = &j->cover[c];
+
+        if (c >= j->hdr.num_chunks)
+            break;
+        if (!FTP_CHUNK_DONE(j->bitmap, c) &&
+                (cover_add(cv, offset - c_off, stop - c_off) == 0) &&
+                (cv->n == 1) && (cv->spans[0].start == 0) &&
+                (cv->spans[0].end == c_end - c_off)){
+            j->bitmap[c >> 3] |= 1 << (c & 7);
+            j->chunks_done++;
+            if (pwrite(j->fd, &j->bitmap[c >> 3], 1, sizeof(j->hdr) + (c >> 3)) != 1)
+                perror("du-journal: pwrite");
+            free(cv->spans);
+            memset(cv, 0, sizeof(*cv));
+        }
+        offset = stop;
+    }
+    pthread_mutex_unlock(&j->lock);
+}
+
+int ftp_journal_complete(ftp_journal *j){
+    return j->chunks_done == j->hdr.num_chunks;
+}
+
+/*
+ *  Closes the journal, it is only kept on disk if the file is incomplete
+ */
+void ftp_journal_close(ftp_journal *j){
+    close(j->fd);
+    if (ftp_journal_complete(j))
+        unlink(j->path);
+    pthread_mutex_destroy(&j->lock);
+    for (uint32_t c = 0; c < j->hdr.num_chunks; c++)
+        free(j->cover[c].spans);
+    free(j->path);
+    free(j->bitmap);
+    free(j->cover);
+    free(j);
+}
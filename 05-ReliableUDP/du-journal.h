@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/*
+ * Progress journal for resumable du-ftp transfers
+ *
+ * The server keeps <file>.journal next to the file it receives.  The file
+ * is split into FTP_JOURNAL_CHUNK sized chunks and the journal holds one
+ * bit per chunk, a bit is set once every byte of its chunk was written.
+ * Until then the ranges written so far are kept per chunk, so a range that
+ * is written twice (a repair, a retransmission, a HOLE over data) still
+ * counts once.
+ * When a client reconnects for the same file (same size and modification
+ * time) the server keeps the partial file, sends the bitmap back and the
+ * client only sends the chunks that are still missing.  The journal is
+ * removed once the file is complete.
+ */
+#define FTP_JOURNAL_CHUNK   (256 * 1024)
+#define FTP_JOURNAL_MAGIC   0x314A505446554400ULL       //"\0DUFTPJ1"
+#define FTP_JOURNAL_EXT     ".journal"
+
+#define FTP_CHUNK_DONE(map, c)  (((map)[(c) >> 3] >> ((c) & 7)) & 1)
+
+typedef struct ftp_journal_hdr{
+    uint64_t    magic;
+    uint64_t    file_size;
+    int64_t     file_mtime;
+    uint32_t    chunk_sz;
+    uint32_t    num_chunks;
+} ftp_journal_hdr;
+
+//bytes [start, end) of a chunk that are written
+typedef struct ftp_journal_span{
+    uint32_t    start;
+    uint32_t    end;
+} ftp_journal_span;
+
+//written ranges of a chunk that is not done yet, sorted, never touching
+typedef struct ftp_journal_cover{
+    ftp_journal_span    *spans;
+    uint32_t            n;
+    uint32_t            cap;
+} ftp_journal_cover;
+
+typedef struct ftp_journal{
+    int                 fd;
+    char                *path;
+    ftp_journal_hdr     hdr;
+    uint8_t             *bitmap;
+    uint32_t            map_sz;             //bytes in bitmap
+    uint32_t            chunks_done;
+    int                 resumed;            //bitmap came from a previous run
+    ftp_journal_cover   *cover;             //per chunk, under lock
+    pthread_mutex_t     lock;
+} ftp_journal;
+
+static inline uint32_t ftp_journal_chunks(uint64_t file_size){
+    return (uint32_t)((file_size + FTP_JOURNAL_CHUNK - 1) / FTP_JOURNAL_CHUNK);
+}
+
+int          ftp_journal_exists(const char *file_path);
+ftp_journal *ftp_journal_open(const char *file_path, uint64_t file_size,
+                              int64_t file_mtime, int resume);
+void         ftp_journal_written(ftp_journal *j, uint64_t offset, uint64_t len);
+int          ftp_journal_complete(ftp_journal *j);
+void         ftp_journal_close(ftp_journal *j);
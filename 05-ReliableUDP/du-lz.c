@@ -0,0 +1,193 @@
+#include <string.h>
+#include <stddef.h>
+
+#include "du-lz.h"
+
+#define LZ_HASH_LOG         12
+#define LZ_MIN_MATCH        4
+#define LZ_LAST_LITERALS    5           //a block always ends with literals
+#define LZ_MF_LIMIT         12          //no match may start after end - 12
+#define LZ_SKIP_TRIGGER     6           //misses before the step grows
+
+static inline uint32_t lz_read32(const uint8_t *p){
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t lz_read64(const uint8_t *p){
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v){
+    return (v * 2654435761u) >> (32 - LZ_HASH_LOG);
+}
+
+//length extension bytes of a token nibble
+static inline uint8_t *lz_put_len(uint8_t *op, size_t len){
+    while (len >= 255){
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+/*
+ *  Returns the compressed size, or 0 if it would not fit in dst_cap
+ */
+int lz_compress(const uint8_t *src, int src_sz, uint8_t *dst, int dst_cap){
+    uint32_t table[1 << LZ_HASH_LOG];
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;
+    const uint8_t *end = src + src_sz;
+    const uint8_t *mf_limit = end - LZ_MF_LIMIT;
+    const uint8_t *match_limit = end - LZ_LAST_LITERALS;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + dst_cap;
+    uint32_t misses = 0;
+    size_t lit;
+
+    if ((src_sz < 0) || (src_sz > LZ_MAX_INPUT))
+        return 0;
+    memset(table, 0, sizeof(table));
+
+    if (src_sz > LZ_MF_LIMIT){
+        ip++;
+        while (ip < mf_limit){
+            uint32_t h = lz_hash(lz_read32(ip));
+            const uint8_t *ref = src + table[h];
+
+            table[h] = ip - src;
+            if ((ref >= ip) || (lz_read32(ref) != lz_read32(ip))){
+                ip += 1 + (misses++ >> LZ_SKIP_TRIGGER);
+                continue;
+            }
+            misses = 0;
+
+            while ((ip > anchor) && (ref > src) && (ip[-1] == ref[-1])){
+                ip--;
+                ref--;
+            }
+            //extend 8 bytes at a time, on little endian the lowest set bit of the
+            //difference is the first byte that differs
+            const uint8_t *mp = ip + LZ_MIN_MATCH;
+            const uint8_t *rp = ref + LZ_MIN_MATCH;
+            while (mp + 8 <= match_limit){
+                uint64_t diff = lz_read64(mp) ^ lz_read64(rp);
+                if (diff != 0){
+                    mp += __builtin_ctzll(diff) >> 3;
+                    goto match_end;
+                }
+                mp += 8;
+                rp += 8;
+            }
+            while ((mp < match_limit) && (*mp == *rp)){
+                mp++;
+                rp++;
+            }
+match_end:
+
+            lit = ip - anchor;
+            size_t mlen = mp - ip - LZ_MIN_MATCH;
+            if (op + 1 + lit + lit / 255 + 1 + 2 + mlen / 255 + 1 + LZ_LAST_LITERALS > oend)
+                return 0;
+
+            uint8_t *token = op++;
+            *token = (lit >= 15) ? 15 << 4 : lit << 4;
+            if (lit >= 15)
+                op = lz_put_len(op, lit - 15);
+            memcpy(op, anchor, lit);
+            op += lit;
+
+            uint32_t offset = ip - ref;
+            *op++ = offset & 0xff;
+            *op++ = offset >> 8;
+            *token |= (mlen >= 15) ? 15 : mlen;
+            if (mlen >= 15)
+                op = lz_put_len(op, mlen - 15);
+
+            ip = mp;
+            anchor = ip;
+            if (ip - 2 > src)
+                table[lz_hash(lz_read32(ip - 2))] = ip - 2 - src;
+        }
+    }
+
+    lit = end - anchor;
+    if (op + 1 + lit + lit / 255 + 1 > oend)
+        return 0;
+    *op = (lit >= 15) ? 15 << 4 : lit << 4;
+    op++;
+    if (lit >= 15)
+        op = lz_put_len(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    return op - dst;
+}
+
+/*
+ *  Returns the decompressed size, or -1 if src is not a valid block or
+ *  does not fit in dst_cap
+ */
+int lz_decompress(const uint8_t *src, int src_sz, uint8_t *dst, int dst_cap){
+    const uint8_t *ip = src;
+    const uint8_t *iend = src + src_sz;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + dst_cap;
+    size_t lit, mlen, offset;
+    uint8_t b;
+
+    while (ip < iend){
+        uint8_t token = *ip++;
+
+        lit = token >> 4;
+        if (lit == 15){
+            do {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+        if ((lit > (size_t)(iend - ip)) || (lit > (size_t)(oend - op)))
+            return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend)
+            break;                      //the last sequence has no match
+
+        if (iend - ip < 2)
+            return -1;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if ((offset == 0) || (offset > (size_t)(op - dst)))
+            return -1;
+
+        mlen = token & 15;
+        if (mlen == 15){
+            do {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += LZ_MIN_MATCH;
+        if (mlen > (size_t)(oend - op))
+            return -1;
+
+        const uint8_t *ref = op - offset;
+        if (offset >= mlen){
+            memcpy(op, ref, mlen);
+            op += mlen;
+        } else {
+            while (mlen--)              //overlapping copy repeats the pattern
+                *op++ = *ref++;
+        }
+    }
+    return op - dst;
+}
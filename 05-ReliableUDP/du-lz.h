@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Small LZ4 block format codec for du-ftp
+ *
+ * Greedy single probe hash matcher, the same trade off as LZ4's fast mode:
+ * a few hundred MB/s per core and a decent ratio on text and logs.  The
+ * search step grows while nothing matches so incompressible input is
+ * skipped quickly, and lz_compress() gives up as soon as the output would
+ * not fit in dst_cap, so passing a cap below src_sz bails out early on
+ * data that does not compress well enough to be worth sending.
+ */
+#define LZ_MAX_INPUT        65536           //offsets are 16 bits
+
+int lz_compress(const uint8_t *src, int src_sz, uint8_t *dst, int dst_cap);
+int lz_decompress(const uint8_t *src, int src_sz, uint8_t *dst, int dst_cap);
@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "du-manifest.h"
+
+static int mf_add(ftp_manifest *mf, const char *name, int len, uint64_t size, uint32_t mode){
+    ftp_mf_item *it;
+
+    if (mf->num_items == mf->cap){
+        uint32_t cap = (mf->cap == 0) ? 256 : mf->cap * 2;
+        it = realloc(mf->items, sizeof(ftp_mf_item) * cap);
+        if (it == NULL)
+            return -1;
+        mf->items = it;
+        mf->cap = cap;
+    }
+    it = &mf->items[mf->num_items];
+    memset(it, 0, sizeof(*it));
+    it->name = malloc(len + 1);
+    if (it->name == NULL)
+        return -1;
+    memcpy(it->name, name, len);
+    it->name[len] = '\0';
+    it->size = S_ISREG(mode) ? size : 0;
+    it->mode = mode;
+    it->fd = -1;
+    mf->num_items++;
+
+    if (S_ISDIR(mode))
+        mf->num_dirs++;
+    else {
+        mf->num_files++;
+        mf->bytes += it->size;
+    }
+    return 0;
+}
+
+static int cmp_names(const void *a, const void *b){
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ *  Adds root/rel and, for a directory, everything below it.  Entries of a
+ *  directory are sorted so the same tree always gives the same manifest.
+ */
+static int walk(ftp_manifest *mf, const char *root, const char *rel, int depth){
+    char path[FTP_MF_NAME_SZ * 2];
+    char child[FTP_MF_NAME_SZ];
+    char **names = NULL;
+    int num = 0, cap = 0, rc = 0, i;
+    struct dirent *de;
+    struct stat sb;
+    DIR *dir;
+
+    snprintf(path, sizeof(path), "%s/%s", root, rel);
+    if (lstat(path, &sb) < 0){
+        perror(path);
+        return -1;
+    }
+    if (S_ISREG(sb.st_mode))
+        return mf_add(mf, rel, strlen(rel), sb.st_size, sb.st_mode);
+    if (!S_ISDIR(sb.st_mode)){
+        printf("WARNING: skipping %s, not a regular file or directory\n", path);
+        return 0;
+    }
+    if (depth >= FTP_MF_MAX_DEPTH){
+        printf("WARNING: skipping %s, nested too deep\n", path);
+        return 0;
+    }
+    if (mf_add(mf, rel, strlen(rel), 0, sb.st_mode) < 0)
+        return -1;
+
+    dir = opendir(path);
+    if (dir == NULL){
+        perror(path);
+        return -1;
+    }
+    while ((de = readdir(dir)) != NULL){
+        if ((strcmp(de->d_name, ".") == 0) || (strcmp(de->d_name, "..") == 0))
+            continue;
+        if (num == cap){
+            char **n = realloc(names, sizeof(char *) * (cap = (cap == 0) ? 64 : cap * 2));
+            if (n == NULL){
+                rc = -1;
+                break;
+            }
+            names = n;
+        }
+        if ((names[num] = strdup(de->d_name)) == NULL){
+            rc = -1;
+            break;
+        }
+        num++;
+    }
+    closedir(dir);
+
+    if (num > 1)
+        qsort(names, num, sizeof(char *), cmp_names);
+    for (i = 0; i < num; i++){
+        if (rc == 0){
+            if (snprintf(child, sizeof(child), "%s/%s", rel, names[i]) >= (int)sizeof(child))
+                printf("WARNING: skipping %s/%s, the name is too long\n", path, names[i]);
+            else
+                rc = walk(mf, root, child, depth + 1);
+        }
+        free(names[i]);
+    }
+    free(names);
+    return rc;
+}
+
+/*
+ *  Lists root/name into mf, names in the manifest are relative to root
+ */
+int mf_walk(ftp_manifest *mf, const char *root, const char *name){
+    int len = strlen(name);
+
+    while ((len > 1) && (name[len - 1] == '/'))
+        len--;
+    if (!mf_safe_name(name, len))
+        return -1;
+
+    char rel[FTP_MF_NAME_SZ];
+    snprintf(rel, sizeof(rel), "%.*s", len, name);
+    return walk(mf, root, rel, 0);
+}
+
+/*
+ *  A name from the wire must stay below the receivers directory: relative,
+ *  no empty, "." or ".." components
+ */
+int mf_safe_name(const char *name, int len){
+    int i, start = 0;
+
+    if ((len <= 0) || (len >= FTP_MF_NAME_SZ) || (memchr(name, '\0', len) != NULL))
+        return 0;
+    for (i = 0; i <= len; i++){
+        if ((i < len) && (name[i] != '/'))
+            continue;
+        int n = i - start;
+        if ((n == 0) || ((n == 1) && (name[start] == '.')) ||
+                ((n == 2) && (name[start] == '.') && (name[start + 1] == '.')))
+            return 0;
+        start = i + 1;
+    }
+    return 1;
+}
+
+/*
+ *  Packs entries from *next on into buff, as many as fit.  Returns the
+ *  bytes used and advances *next.
+ */
+int mf_pack(const ftp_manifest *mf, uint32_t *next, char *buff, int buff_sz){
+    int used = 0;
+
+    while (*next < mf->num_items){
+        const ftp_mf_item *it = &mf->items[*next];
+        ftp_mf_entry e = {0};
+
+        e.size = it->size;
+        e.mode = it->mode;
+        e.name_len = strlen(it->name);
+        if (used + (int)sizeof(e) + e.name_len > buff_sz)
+            break;
+        memcpy(buff + used, &e, sizeof(e));
+        memcpy(buff + used + sizeof(e), it->name, e.name_len);
+        used += sizeof(e) + e.name_len;
+        (*next)++;
+    }
+    return used;
+}
+
+/*
+ *  Appends the entries packed in buff, returns -1 if any of them is
+ *  malformed or names something outside of the transfer root
+ */
+int mf_unpack(ftp_manifest *mf, const char *buff, int len){
+    int off = 0;
+
+    while (off < len){
+        ftp_mf_entry e;
+
+        if (len - off < (int)sizeof(e))
+            return -1;
+        memcpy(&e, buff + off, sizeof(e));
+        off += sizeof(e);
+        if ((e.name_len > len - off) || !mf_safe_name(buff + off, e.name_len) ||
+                (!S_ISREG(e.mode) && !S_ISDIR(e.mode)))
+            return -1;
+        if (mf_add(mf, buff + off, e.name_len, e.size, e.mode) < 0)
+            return -1;
+        off += e.name_len;
+    }
+    return 0;
+}
+
+void mf_free(ftp_manifest *mf){
+    uint32_t i;
+
+    for (i = 0; i < mf->num_items; i++)
+        free(mf->items[i].name);
+    free(mf->items);
+    memset(mf, 0, sizeof(*mf));
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Directory tree manifests for du-ftp batch transfers
+ *
+ * mf_walk() lists a tree depth first, every directory comes before what is
+ * in it, so the receiver can create the entries in manifest order.  On the
+ * wire a manifest is a sequence of ftp_mf_entry headers, each followed by
+ * name_len bytes of the path relative to the transfer root (no '\0'),
+ * packed into as few messages as possible.  The index of an entry in the
+ * manifest is how the data records refer to its file.
+ */
+#define FTP_MF_NAME_SZ      256             //longest relative path + '\0'
+#define FTP_MF_MAX_DEPTH    64
+
+typedef struct ftp_mf_entry{
+    uint64_t    size;
+    uint32_t    mode;                       //st_mode, type and permissions
+    uint16_t    name_len;
+    uint16_t    reserved;
+} ftp_mf_entry;
+
+typedef struct ftp_mf_item{
+    char        *name;
+    uint64_t    size;
+    uint32_t    mode;
+    int         fd;                         //receiver: open while data arrives
+} ftp_mf_item;
+
+typedef struct ftp_manifest{
+    ftp_mf_item *items;
+    uint32_t    num_items;
+    uint32_t    cap;
+    uint32_t    num_files;
+    uint32_t    num_dirs;
+    uint64_t    bytes;                      //sum of the file sizes
+} ftp_manifest;
+
+int  mf_walk(ftp_manifest *mf, const char *root, const char *name);
+int  mf_safe_name(const char *name, int len);
+int  mf_pack(const ftp_manifest *mf, uint32_t *next, char *buff, int buff_sz);
+int  mf_unpack(ftp_manifest *mf, const char *buff, int len);
+void mf_free(ftp_manifest *mf);
@@ -3,15 +3,115 @@
 #include <string.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <time.h>
+#include <limits.h>
 
 #include "du-proto.h"
 
-static char _dpBuffer[DP_MAX_DGRAM_SZ];
 static int  _debugMode = 1;
 
+static const char *_dpErrNames[DP_NUM_ERR_CODES] = {
+    "none", "general", "protocol", "buff_undersized",
+    "buff_oversized", "connection_closed", "bad_dgram"
+};
+
+static uint64_t dp_now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct dp_bucket{
+    pthread_mutex_t     lock;
+    uint64_t            rate;               //bytes per second
+    uint64_t            tau_ns;             //bucket depth, as time at rate
+    uint64_t            tat_ns;             //when the bucket is next empty
+};
+
+//Counts an error against the connection and hands the code back
+static int dp_error(dp_connp dp, int errCode){
+    dp->stats.errors[DP_ERR_INDEX(errCode)]++;
+    return errCode;
+}
+
+//Called per datagram, only looks at the clock if an export is configured
+static inline void dp_stats_tick(dp_connp dp){
+    if (dp->statsOut.path == NULL)
+        return;
+    uint64_t now = dp_now_ns();
+    if (now >= dp->statsOut.next_ns){
+        dp->statsOut.next_ns = now + dp->statsOut.interval_ns;
+        dp_stats_dump(dp);
+    }
+}
+
+static void dp_rtt_sample(dp_connp dp, uint64_t rtt_ns){
+    dp_stats *st = &dp->stats;
+    uint64_t rtt = rtt_ns / 1000;
+
+    if ((st->rtt_samples == 0) || (rtt < st->rtt_min_us))
+        st->rtt_min_us = rtt;
+    if (rtt > st->rtt_max_us)
+        st->rtt_max_us = rtt;
+    //Smoothed RTT, same 1/8 gain TCP uses (RFC 6298)
+    if (st->rtt_samples == 0)
+        st->srtt_us = rtt;
+    else
+        st->srtt_us = (7 * st->srtt_us + rtt) / 8;
+    st->rtt_last_us = rtt;
+    st->rtt_sum_us += rtt;
+    st->rtt_samples++;
+}
+
+/*
+ *  Sleeps until deadline, the last DP_PACE_SPIN_NS are spun because a
+ *  sleep can overshoot by about that much (the default timer slack)
+ */
+static void dp_wait_until(uint64_t deadline){
+    uint64_t now = dp_now_ns();
+
+    if (deadline > now + DP_PACE_SPIN_NS){
+        uint64_t wake = deadline - DP_PACE_SPIN_NS;
+        struct timespec ts = { .tv_sec = wake / 1000000000ULL,
+                               .tv_nsec = wake % 1000000000ULL };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+            ;
+    }
+    while (dp_now_ns() < deadline)
+        ;
+}
+
+/*
+ *  Takes sz bytes out of the connections bucket, waiting until they are
+ *  there.  The bucket is kept as the time it is next empty (tat), a send
+ *  may go as long as that is less than a full bucket (tau) ahead of now,
+ *  and pushes it sz/rate further.  The time a send has to wait is known
+ *  up front, so the lock is not held while waiting.
+ */
+static void dp_pace(dp_connp dp, int sz){
+    dp_bucket *b = dp->bucket;
+    uint64_t now = dp_now_ns();
+    uint64_t start;
+
+    pthread_mutex_lock(&b->lock);
+    if (b->tat_ns < now)
+        b->tat_ns = now;
+    start = (b->tat_ns > now + b->tau_ns) ? b->tat_ns - b->tau_ns : now;
+    b->tat_ns += (uint64_t)sz * 1000000000ULL / b->rate;
+    pthread_mutex_unlock(&b->lock);
+
+    if (start > now){
+        dp_wait_until(start);
+        dp->stats.pace_waits++;
+        dp->stats.pace_wait_us += (start - now) / 1000;
+    }
+}
+
 static dp_connp dpinit(){
     dp_connp dpsession = malloc(sizeof(dp_connection));
     bzero(dpsession, sizeof(dp_connection));
@@ -26,6 +126,11 @@ static dp_connp dpinit(){
 }
 
 void dpclose(dp_connp dpsession) {
+    if (dpsession->statsOut.path != NULL){
+        dp_stats_dump(dpsession);
+        free(dpsession->statsOut.path);
+    }
+    close(dpsession->udp_sock);
     free(dpsession);
 }
 
@@ -33,8 +138,18 @@ int  dpmaxdgram(){
     return DP_MAX_BUFF_SZ;
 }
 
+//Turns the per PDU debug output on (1) or off (0)
+void dpsetdebug(int mode){
+    _debugMode = mode;
+}
 
-dp_connp dpServerInit(int port) {
+
+/*
+ *  Binds the server socket, a shared socket sets SO_REUSEPORT so several
+ *  of them, one per worker, can listen on the same port and the kernel
+ *  spreads the clients over them by address
+ */
+static dp_connp dp_server_socket(int port, _Bool shared) {
     struct sockaddr_in *servaddr;
     int *sock;
     int rc;
@@ -61,11 +176,11 @@ dp_connp dpServerInit(int port) {
     servaddr->sin_port = htons(port); 
 
     // Set socket options so that we dont have to wait for ports held by OS
-    // if (setsockopt(*sock, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) < 0){
-    //     perror("setsockopt(SO_REUSEADDR) failed");
-    //     close(*sock);
-    //     return NULL;
-    // }
+    if (shared && (setsockopt(*sock, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) < 0)){
+        perror("setsockopt(SO_REUSEPORT) failed");
+        close(*sock);
+        return NULL;
+    }
     if (setsockopt(*sock, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0){
         perror("setsockopt(SO_REUSEADDR) failed");
         close(*sock);
@@ -84,6 +199,14 @@ dp_connp dpServerInit(int port) {
     return dpc;
 }
 
+dp_connp dpServerInit(int port) {
+    return dp_server_socket(port, false);
+}
+
+dp_connp dpServerInitShared(int port) {
+    return dp_server_socket(port, true);
+}
+
 
 dp_connp dpClientInit(char *addr, int port) {
     struct sockaddr_in *servaddr;
@@ -118,52 +241,77 @@ dp_connp dpClientInit(char *addr, int port) {
 }
 
 
+/*
+ *  The header is scattered into a PDU on the stack and the payload lands
+ *  directly in the callers buffer, there is no intermediate copy.
+ */
 int dprecv(dp_connp dp, void *buff, int buff_sz){
+    struct iovec iov = { .iov_base = buff, .iov_len = buff_sz };
 
-    dp_pdu *inPdu;
-    int rcvLen = dprecvdgram(dp, _dpBuffer, sizeof(_dpBuffer));
+    return dprecvv(dp, &iov, 1);
+}
+
+/*
+ *  Scatter version of dprecv(), the payload is spread over the iovcnt
+ *  buffers in iov in order.  Returns the payload size.
+ */
+int dprecvv(dp_connp dp, const struct iovec *iov, int iovcnt){
+
+    dp_pdu inPdu = {0};
+
+    if((iovcnt < 0) || (iovcnt > DP_MAX_IOV))
+        return DP_ERROR_GENERAL;
+
+    int rcvLen = dprecvdgram(dp, &inPdu, iov, iovcnt);
 
     if(rcvLen == DP_CONNECTION_CLOSED)
         return DP_CONNECTION_CLOSED;
+    if(rcvLen < 0)
+        return rcvLen;
 
-    inPdu = (dp_pdu *)_dpBuffer;
-    if(rcvLen > sizeof(dp_pdu))
-        memcpy(buff, (_dpBuffer+sizeof(dp_pdu)), inPdu->dgram_sz);
-
-    return inPdu->dgram_sz;
+    //what actually arrived, dprecvdgram() made sure it is dgram_sz
+    return rcvLen - sizeof(dp_pdu);
 }
 
 
-static int dprecvdgram(dp_connp dp, void *buff, int buff_sz){
+static int dprecvdgram(dp_connp dp, dp_pdu *inPdu, const struct iovec *iov, int iovcnt){
+    struct iovec inIov[DP_MAX_IOV + 1];
     int bytesIn = 0;
     int errCode = DP_NO_ERROR;
+    int i, buff_sz = 0;
 
-    if(buff_sz > DP_MAX_DGRAM_SZ)
-        return DP_BUFF_OVERSIZED;
+    inIov[0].iov_base = inPdu;
+    inIov[0].iov_len = sizeof(dp_pdu);
+    for (i = 0; i < iovcnt; i++){
+        inIov[i + 1] = iov[i];
+        buff_sz += iov[i].iov_len;
+    }
 
-    bytesIn = dprecvraw(dp, buff, buff_sz);
+    bytesIn = dprecvrawv(dp, inIov, iovcnt + 1);
+    if (bytesIn < 0)
+        return bytesIn;
 
-    //check for some sort of error and just return it
-    if (bytesIn < sizeof(dp_pdu))
+    //check for some sort of error and just return it, a payload shorter
+    //than the header says would leave stale bytes in the callers buffer
+    if (bytesIn < (int)sizeof(dp_pdu))
         errCode = DP_ERROR_BAD_DGRAM;
-
-    dp_pdu inPdu;
-    memcpy(&inPdu, buff, sizeof(dp_pdu));
-    if (inPdu.dgram_sz > buff_sz)
+    else if (inPdu->dgram_sz > buff_sz)
         errCode = DP_BUFF_UNDERSIZED;
-
-    //Copy buffer back
-    // memcpy(buff, (_dpBuffer+sizeof(dp_pdu)), inPdu.dgram_sz);
-    
+    else if (bytesIn - (int)sizeof(dp_pdu) != inPdu->dgram_sz)
+        errCode = DP_ERROR_BAD_DGRAM;
     
     //UDPATE SEQ NUMBER AND PREPARE ACK
+    if (errCode != DP_NO_ERROR){
+        dp->stats.drops++;
+        dp_error(dp, errCode);
+    }
     if (errCode == DP_NO_ERROR){
-        if(inPdu.dgram_sz == 0)
+        if(inPdu->dgram_sz == 0)
             //Update Seq Number to just ack a control message - just got PDU
             dp->seqNum ++;
         else
             //Update Seq Number to increas by the inbound PDU dgram_sz
-            dp->seqNum += inPdu.dgram_sz;
+            dp->seqNum += inPdu->dgram_sz;
     } else {
         //Update seq number to ACK error
         dp->seqNum++;
@@ -181,63 +329,80 @@ static int dprecvdgram(dp_connp dp, void *buff, int buff_sz){
         outPdu.mtype = DP_MT_ERROR;
         actSndSz = dpsendraw(dp, &outPdu, sizeof(dp_pdu));
         if (actSndSz != sizeof(dp_pdu))
-            return DP_ERROR_PROTOCOL;
+            return dp_error(dp, DP_ERROR_PROTOCOL);
     }
 
 
-    switch(inPdu.mtype){
+    switch(inPdu->mtype){
         case DP_MT_SND:
             outPdu.mtype = DP_MT_SNDACK;
             actSndSz = dpsendraw(dp, &outPdu, sizeof(dp_pdu));
             if (actSndSz != sizeof(dp_pdu))
-                return DP_ERROR_PROTOCOL;
+                return dp_error(dp, DP_ERROR_PROTOCOL);
             break;
         case DP_MT_CLOSE:
             outPdu.mtype = DP_MT_CLOSEACK;
             actSndSz = dpsendraw(dp, &outPdu, sizeof(dp_pdu));
             if (actSndSz != sizeof(dp_pdu))
-                return DP_ERROR_PROTOCOL;
+                return dp_error(dp, DP_ERROR_PROTOCOL);
             dpclose(dp);
             return DP_CONNECTION_CLOSED;
         default:
         {
-            printf("ERROR: Unexpected or bad mtype in header %d\n", inPdu.mtype);
-            return DP_ERROR_PROTOCOL;
+            printf("ERROR: Unexpected or bad mtype in header %d\n", inPdu->mtype);
+            return dp_error(dp, DP_ERROR_PROTOCOL);
         }
     }
 
+    if (errCode != DP_NO_ERROR)
+        return errCode;
     return bytesIn;
 }
 
 
 static int dprecvraw(dp_connp dp, void *buff, int buff_sz){
+    struct iovec iov = { .iov_base = buff, .iov_len = buff_sz };
+
+    return dprecvrawv(dp, &iov, 1);
+}
+
+//iov[0] receives the dp_pdu header, the payload goes to iov[1..]
+static int dprecvrawv(dp_connp dp, struct iovec *iov, int iovcnt){
     int bytes = 0;
+    struct msghdr msg = {0};
 
     if(!dp->inSockAddr.isAddrInit) {
         perror("dprecv: dp connection not setup properly - cli struct not init");
         return -1;
     }
 
-    bytes = recvfrom(dp->udp_sock, (char *)buff, buff_sz,  
-                MSG_WAITALL, ( struct sockaddr *) &(dp->outSockAddr.addr), 
-                &(dp->outSockAddr.len)); 
+    msg.msg_name = &(dp->outSockAddr.addr);
+    msg.msg_namelen = sizeof(dp->outSockAddr.addr);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
+    bytes = recvmsg(dp->udp_sock, &msg, MSG_WAITALL);
 
     if (bytes < 0) {
         perror("dprecv: received error from recvfrom()");
-        return -1;
+        return dp_error(dp, DP_ERROR_GENERAL);
     }
+    dp->outSockAddr.len = msg.msg_namelen;
     dp->outSockAddr.isAddrInit = true;
+    dp->stats.pkts_recv++;
+    dp->stats.bytes_recv += bytes;
+    dp_stats_tick(dp);
 
     //some helper code if you want to do debugging
-    if (bytes > sizeof(dp_pdu)){
+    if ((bytes > sizeof(dp_pdu)) && (iovcnt > 1)){
         if(false) {                         //just diabling for now
-            dp_pdu *inPdu = buff;
-            char * payload = (char *)buff + sizeof(dp_pdu);
+            dp_pdu *inPdu = iov[0].iov_base;
+            char * payload = iov[1].iov_base;
             printf("DATA : %.*s\n", inPdu->dgram_sz , payload); 
         }
     }
 
-    dp_pdu *inPdu = buff;
+    dp_pdu *inPdu = iov[0].iov_base;
     print_in_pdu(inPdu);
 
     //return the number of bytes received 
@@ -257,45 +422,88 @@ int dpsend(dp_connp dp, void *sbuff, int sbuff_sz){
     return sndSz;
 }
 
+/*
+ *  Gather version of dpsend(), the payload is the concatenation of the
+ *  iovcnt buffers in iov.  The header and the caller's buffers are handed
+ *  to the kernel together, so the payload is never copied in user space.
+ */
+int dpsendv(dp_connp dp, const struct iovec *iov, int iovcnt){
+    int i, sz = 0;
+
+    if((iovcnt < 0) || (iovcnt > DP_MAX_IOV))
+        return DP_ERROR_GENERAL;
+
+    for (i = 0; i < iovcnt; i++)
+        sz += iov[i].iov_len;
+
+    if(sz > dpmaxdgram()) {
+        return DP_BUFF_UNDERSIZED;
+    }
+
+    return dpsendvdgram(dp, iov, iovcnt);
+}
+
 static int dpsenddgram(dp_connp dp, void *sbuff, int sbuff_sz){
+    struct iovec iov = { .iov_base = sbuff, .iov_len = sbuff_sz };
+
+    return dpsendvdgram(dp, &iov, 1);
+}
+
+static int dpsendvdgram(dp_connp dp, const struct iovec *iov, int iovcnt){
+    struct iovec outIov[DP_MAX_IOV + 1];
     int bytesOut = 0;
+    int i, sndSz = 0;
 
     if(!dp->outSockAddr.isAddrInit) {
         perror("dpsend:dp connection not setup properly");
         return DP_ERROR_GENERAL;
     }
 
-    if(sbuff_sz > DP_MAX_BUFF_SZ)
-        return DP_ERROR_GENERAL;
+    for (i = 0; i < iovcnt; i++)
+        sndSz += iov[i].iov_len;
 
-    //Build the PDU and out buffer
-    dp_pdu *outPdu = (dp_pdu *)_dpBuffer;
-    int    sndSz = sbuff_sz;
-    outPdu->proto_ver = DP_PROTO_VER_1;
-    outPdu->mtype = DP_MT_SND;
-    outPdu->dgram_sz = sndSz;
-    outPdu->seqnum = dp->seqNum;
+    if(sndSz > DP_MAX_BUFF_SZ)
+        return dp_error(dp, DP_ERROR_GENERAL);
 
-    memcpy((_dpBuffer + sizeof(dp_pdu)), sbuff, sndSz);
+    //Build the PDU, the payload goes out straight from the callers buffers
+    dp_pdu outPdu;
+    outPdu.proto_ver = DP_PROTO_VER_1;
+    outPdu.mtype = DP_MT_SND;
+    outPdu.dgram_sz = sndSz;
+    outPdu.seqnum = dp->seqNum;
+    outPdu.err_num = DP_NO_ERROR;
 
-    int totalSendSz = outPdu->dgram_sz + sizeof(dp_pdu);
-    bytesOut = dpsendraw(dp, _dpBuffer, totalSendSz);
+    outIov[0].iov_base = &outPdu;
+    outIov[0].iov_len = sizeof(dp_pdu);
+    memcpy(&outIov[1], iov, sizeof(struct iovec) * iovcnt);
+
+    int totalSendSz = outPdu.dgram_sz + sizeof(dp_pdu);
+    uint64_t sentAt = dp_now_ns();
+    bytesOut = dpsendrawv(dp, outIov, iovcnt + 1);
 
     if(bytesOut != totalSendSz){
         printf("Warning send %d, but expected %d!\n", bytesOut, totalSendSz);
     }
 
     //update seq number after send
-    if(outPdu->dgram_sz == 0)
+    if(outPdu.dgram_sz == 0)
         dp->seqNum++;
     else
-        dp->seqNum += outPdu->dgram_sz;
+        dp->seqNum += outPdu.dgram_sz;
 
     //need to get an ack
     dp_pdu inPdu = {0};
     int bytesIn = dprecvraw(dp, &inPdu, sizeof(dp_pdu));
-    if ((bytesIn < sizeof(dp_pdu)) && (inPdu.mtype != DP_MT_SNDACK)){
+    uint64_t rtt = dp_now_ns() - sentAt;
+    if ((bytesIn != (int)sizeof(dp_pdu)) || (inPdu.mtype != DP_MT_SNDACK)){
         printf("Expected SND/ACK but got a different mtype %d\n", inPdu.mtype);
+        dp_error(dp, DP_ERROR_PROTOCOL);
+    } else {
+        //Only a real SNDACK is a round trip
+        dp_rtt_sample(dp, rtt);
+        if (inPdu.seqnum == dp->lastAckSeq)
+            dp->stats.dup_acks++;
+        dp->lastAckSeq = inPdu.seqnum;
     }
 
     return bytesOut - sizeof(dp_pdu);
@@ -303,18 +511,41 @@ static int dpsenddgram(dp_connp dp, void *sbuff, int sbuff_sz){
 
 
 static int dpsendraw(dp_connp dp, void *sbuff, int sbuff_sz){
+    struct iovec iov = { .iov_base = sbuff, .iov_len = sbuff_sz };
+
+    return dpsendrawv(dp, &iov, 1);
+}
+
+//iov[0] must start with the dp_pdu header
+static int dpsendrawv(dp_connp dp, struct iovec *iov, int iovcnt){
     int bytesOut = 0;
-    // dp_pdu *pdu = sbuff;
+    struct msghdr msg = {0};
 
     if(!dp->outSockAddr.isAddrInit) {
         perror("dpsendraw:dp connection not setup properly");
         return -1;
     }
 
-    dp_pdu *outPdu = sbuff;
-    bytesOut = sendto(dp->udp_sock, (const char *)sbuff, sbuff_sz, 
-        0, (const struct sockaddr *) &(dp->outSockAddr.addr), 
-            dp->outSockAddr.len); 
+    dp_pdu *outPdu = iov[0].iov_base;
+    if (dp->bucket != NULL){
+        int i, sz = 0;
+        for (i = 0; i < iovcnt; i++)
+            sz += iov[i].iov_len;
+        dp_pace(dp, sz);
+    }
+    msg.msg_name = &(dp->outSockAddr.addr);
+    msg.msg_namelen = dp->outSockAddr.len;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
+    bytesOut = sendmsg(dp->udp_sock, &msg, 0);
+    if (bytesOut < 0)
+        dp_error(dp, DP_ERROR_GENERAL);
+    else {
+        dp->stats.pkts_sent++;
+        dp->stats.bytes_sent += bytesOut;
+    }
+    dp_stats_tick(dp);
 
     
     print_out_pdu(outPdu);
@@ -333,7 +564,8 @@ int dplisten(dp_connp dp) {
 
     dp_pdu pdu = {0};
 
-    printf("Waiting for a connection...\n");
+    if (_debugMode == 1)
+        printf("Waiting for a connection...\n");
     rcvSz = dprecvraw(dp, &pdu, sizeof(pdu));
     if (rcvSz != sizeof(pdu)) {
         perror("dplisten:The wrong number of bytes were received");
@@ -352,11 +584,57 @@ int dplisten(dp_connp dp) {
     }
     dp->isConnected = true; 
     //For non data transmissions, ACK of just control data increase seq # by one
-    printf("Connection established OK!\n");
+    if (_debugMode == 1)
+        printf("Connection established OK!\n");
 
     return true;
 }
 
+/*
+ *  Waits on a shared listener for the next CONNECT and gives the session a
+ *  socket of its own.  The new socket joins the same port and is connect()ed
+ *  to the client, the kernel prefers it over the listeners for that client
+ *  from then on, so the session can run on its own while the listener goes
+ *  back to accepting.  Returns NULL if the datagram was not a CONNECT.
+ */
+dp_connp dpaccept(dp_connp listener) {
+    dp_connp dpc;
+    int sndSz, rcvSz;
+
+    dp_pdu pdu = {0};
+
+    rcvSz = dprecvraw(listener, &pdu, sizeof(pdu));
+    if ((rcvSz != sizeof(pdu)) || (pdu.mtype != DP_MT_CONNECT))
+        return NULL;
+
+    dpc = dp_server_socket(ntohs(listener->inSockAddr.addr.sin_port), true);
+    if (dpc == NULL)
+        return NULL;
+    memcpy(&dpc->outSockAddr, &listener->outSockAddr, sizeof(dpc->outSockAddr));
+    if (connect(dpc->udp_sock, (struct sockaddr *)&dpc->outSockAddr.addr,
+            dpc->outSockAddr.len) < 0){
+        perror("dpaccept:connect failed");
+        dpclose(dpc);
+        return NULL;
+    }
+
+    pdu.mtype = DP_MT_CNTACK;
+    dpc->seqNum = pdu.seqnum + 1;
+    pdu.seqnum = dpc->seqNum;
+
+    sndSz = dpsendraw(dpc, &pdu, sizeof(pdu));
+    if (sndSz != sizeof(pdu)) {
+        perror("dpaccept:The wrong number of bytes were sent");
+        dpclose(dpc);
+        return NULL;
+    }
+    dpc->isConnected = true;
+    if (_debugMode == 1)
+        printf("Connection established OK!\n");
+
+    return dpc;
+}
+
 int dpconnect(dp_connp dp) {
 
     int sndSz, rcvSz;
@@ -371,6 +649,7 @@ int dpconnect(dp_connp dp) {
     pdu.seqnum = dp->seqNum;
     pdu.dgram_sz = 0;
 
+    uint64_t sentAt = dp_now_ns();
     sndSz = dpsendraw(dp, &pdu, sizeof(pdu));
     if (sndSz != sizeof(dp_pdu)) {
         perror("dpconnect:Wrong about of connection data sent");
@@ -378,6 +657,7 @@ int dpconnect(dp_connp dp) {
     }
     
     rcvSz = dprecvraw(dp, &pdu, sizeof(pdu));
+    uint64_t rtt = dp_now_ns() - sentAt;
     if (rcvSz != sizeof(dp_pdu)) {
         perror("dpconnect:Wrong about of connection data received");
         return -1;
@@ -386,11 +666,15 @@ int dpconnect(dp_connp dp) {
         perror("dpconnect:Expected CNTACT Message but didnt get it");
         return -1;
     }
+    //Only a real CNTACK is a round trip
+    dp_rtt_sample(dp, rtt);
 
     //For non data transmissions, ACK of just control data increase seq # by one
     dp->seqNum++;
+    dp->lastAckSeq = pdu.seqnum;
     dp->isConnected = true;
-    printf("Connection established OK!\n");
+    if (_debugMode == 1)
+        printf("Connection established OK!\n");
 
     return true;
 }
@@ -438,6 +722,182 @@ void * dp_prepare_send(dp_pdu *pdu_ptr, void *buff, int buff_sz) {
 }
 
 
+//// RATE CAP AND PRIORITY
+
+/*
+ *  A bucket for rate bytes per second that holds burst bytes, at least one
+ *  full datagram.  Returns NULL for a rate of 0, meaning no cap.
+ */
+dp_bucket *dp_bucket_new(uint64_t rate, uint32_t burst){
+    dp_bucket *b;
+
+    if (rate == 0)
+        return NULL;
+    b = calloc(1, sizeof(dp_bucket));
+    if (b == NULL)
+        return NULL;
+    if (burst < DP_MAX_DGRAM_SZ)
+        burst = DP_MAX_DGRAM_SZ;
+    pthread_mutex_init(&b->lock, NULL);
+    b->rate = rate;
+    b->tau_ns = (uint64_t)burst * 1000000000ULL / rate;
+    return b;
+}
+
+void dp_bucket_free(dp_bucket *b){
+    if (b == NULL)
+        return;
+    pthread_mutex_destroy(&b->lock);
+    free(b);
+}
+
+//Paces everything sent on dp through b, NULL turns pacing off
+void dp_set_bucket(dp_connp dp, dp_bucket *b){
+    dp->bucket = b;
+}
+
+/*
+ *  Puts dp in a priority class.  SO_PRIORITY picks the band of the local
+ *  queueing discipline, with dscp the class is also marked in the IP header
+ *  for the routers on the way.  IP_TOS resets the priority, so it goes first.
+ */
+int dp_set_priority(dp_connp dp, int prio, int dscp){
+    static const struct { int sockPrio; int dscp; } classes[] = {
+        [DP_PRIO_BULK]        = { 1, 8 },
+        [DP_PRIO_NORMAL]      = { 0, 0 },
+        [DP_PRIO_INTERACTIVE] = { 6, 34 },
+    };
+    int tos;
+
+    if ((prio < DP_PRIO_BULK) || (prio > DP_PRIO_INTERACTIVE))
+        return DP_ERROR_GENERAL;
+    if (dscp){
+        tos = classes[prio].dscp << 2;
+        if (setsockopt(dp->udp_sock, IPPROTO_IP, IP_TOS, &tos, sizeof(tos)) < 0){
+            perror("dp_set_priority:IP_TOS");
+            return DP_ERROR_GENERAL;
+        }
+    }
+    if (setsockopt(dp->udp_sock, SOL_SOCKET, SO_PRIORITY, &classes[prio].sockPrio,
+            sizeof(classes[prio].sockPrio)) < 0){
+        perror("dp_set_priority:SO_PRIORITY");
+        return DP_ERROR_GENERAL;
+    }
+    return DP_NO_ERROR;
+}
+
+
+//// STATISTICS
+int dp_get_stats(dp_connp dp, dp_stats *stats){
+    if ((dp == NULL) || (stats == NULL))
+        return DP_ERROR_GENERAL;
+    memcpy(stats, &dp->stats, sizeof(dp_stats));
+    return DP_NO_ERROR;
+}
+
+/*
+ *  Turns on a periodic dump of the connection statistics to path, either
+ *  as JSON or in the Prometheus text exposition format.  The file is
+ *  rewritten every interval_ms and once more when the connection closes.
+ *  Passing a NULL path turns the export off again.
+ */
+int dp_stats_export(dp_connp dp, const char *path, int format, int interval_ms){
+    free(dp->statsOut.path);
+    dp->statsOut.path = NULL;
+    if (path == NULL)
+        return DP_NO_ERROR;
+
+    dp->statsOut.path = strdup(path);
+    if (dp->statsOut.path == NULL)
+        return DP_ERROR_GENERAL;
+    dp->statsOut.format = format;
+    dp->statsOut.interval_ns = (uint64_t)(interval_ms > 0 ? interval_ms : 1000) * 1000000ULL;
+    dp->statsOut.next_ns = dp_now_ns() + dp->statsOut.interval_ns;
+    return DP_NO_ERROR;
+}
+
+static void dp_stats_write_json(dp_connp dp, FILE *f){
+    dp_stats *st = &dp->stats;
+    int i;
+
+    fprintf(f, "{\"bytes_sent\":%llu,\"pkts_sent\":%llu,"
+        "\"bytes_recv\":%llu,\"pkts_recv\":%llu,"
+        "\"dup_acks\":%llu,\"drops\":%llu,"
+        "\"rtt_samples\":%llu,\"rtt_last_us\":%llu,\"rtt_min_us\":%llu,"
+        "\"rtt_max_us\":%llu,\"rtt_avg_us\":%llu,\"srtt_us\":%llu,"
+        "\"pace_waits\":%llu,\"pace_wait_us\":%llu,\"errors\":{",
+        (unsigned long long)st->bytes_sent, (unsigned long long)st->pkts_sent,
+        (unsigned long long)st->bytes_recv, (unsigned long long)st->pkts_recv,
+        (unsigned long long)st->dup_acks, (unsigned long long)st->drops,
+        (unsigned long long)st->rtt_samples,
+        (unsigned long long)st->rtt_last_us, (unsigned long long)st->rtt_min_us,
+        (unsigned long long)st->rtt_max_us,
+        (unsigned long long)(st->rtt_samples ? st->rtt_sum_us / st->rtt_samples : 0),
+        (unsigned long long)st->srtt_us, (unsigned long long)st->pace_waits,
+        (unsigned long long)st->pace_wait_us);
+    for (i = 1; i < DP_NUM_ERR_CODES; i++)
+        fprintf(f, "%s\"%s\":%llu", (i > 1) ? "," : "", _dpErrNames[i],
+            (unsigned long long)st->errors[i]);
+    fprintf(f, "}}\n");
+}
+
+static void dp_stats_write_prom(dp_connp dp, FILE *f){
+    dp_stats *st = &dp->stats;
+    int i;
+
+    const struct { const char *name; const char *type; uint64_t val; } m[] = {
+        {"dp_bytes_sent_total",  "counter", st->bytes_sent},
+        {"dp_packets_sent_total","counter", st->pkts_sent},
+        {"dp_bytes_recv_total",  "counter", st->bytes_recv},
+        {"dp_packets_recv_total","counter", st->pkts_recv},
+        {"dp_dup_acks_total",    "counter", st->dup_acks},
+        {"dp_drops_total",       "counter", st->drops},
+        {"dp_rtt_samples_total", "counter", st->rtt_samples},
+        {"dp_rtt_sum_us_total",  "counter", st->rtt_sum_us},
+        {"dp_rtt_min_us",        "gauge",   st->rtt_min_us},
+        {"dp_rtt_max_us",        "gauge",   st->rtt_max_us},
+        {"dp_srtt_us",           "gauge",   st->srtt_us},
+        {"dp_pace_waits_total",  "counter", st->pace_waits},
+        {"dp_pace_wait_us_total","counter", st->pace_wait_us},
+    };
+    for (i = 0; i < sizeof(m) / sizeof(m[0]); i++)
+        fprintf(f, "# TYPE %s %s\n%s %llu\n", m[i].name, m[i].type,
+            m[i].name, (unsigned long long)m[i].val);
+
+    fprintf(f, "# TYPE dp_errors_total counter\n");
+    for (i = 1; i < DP_NUM_ERR_CODES; i++)
+        fprintf(f, "dp_errors_total{code=\"%s\"} %llu\n", _dpErrNames[i],
+            (unsigned long long)st->errors[i]);
+}
+
+/*
+ *  Writes the statistics to the configured export file.  The data goes to
+ *  a temporary file that is renamed over the target so readers never see
+ *  a partially written snapshot.
+ */
+int dp_stats_dump(dp_connp dp){
+    char tmpPath[PATH_MAX];
+
+    if (dp->statsOut.path == NULL)
+        return DP_ERROR_GENERAL;
+
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", dp->statsOut.path);
+    FILE *f = fopen(tmpPath, "w");
+    if (f == NULL)
+        return DP_ERROR_GENERAL;
+
+    if (dp->statsOut.format == DP_STATS_FMT_PROM)
+        dp_stats_write_prom(dp, f);
+    else
+        dp_stats_write_json(dp, f);
+    fclose(f);
+
+    if (rename(tmpPath, dp->statsOut.path) < 0)
+        return DP_ERROR_GENERAL;
+    return DP_NO_ERROR;
+}
+
+
 //// MISC HELPERS
 void print_out_pdu(dp_pdu *pdu) {
     if (_debugMode != 1)
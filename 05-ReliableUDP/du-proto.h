@@ -1,6 +1,8 @@
 #pragma once
 
+#include <stdint.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 
 
@@ -10,6 +12,59 @@ struct dp_sock{
     struct sockaddr_in addr;
 };
 
+/*
+ * Per connection counters, see dp_get_stats().  Byte and packet counts
+ * are for whole datagrams on the wire, errors[] is indexed by
+ * DP_ERR_INDEX() of the DP_ERROR_* / DP_BUFF_* code that was returned.
+ * du-proto is stop-and-wait and never retransmits, so there is no
+ * retransmission counter.
+ */
+#define DP_NUM_ERR_CODES    7
+
+typedef struct dp_stats{
+    uint64_t    bytes_sent;
+    uint64_t    pkts_sent;
+    uint64_t    bytes_recv;
+    uint64_t    pkts_recv;
+    uint64_t    dup_acks;
+    uint64_t    rtt_samples;
+    uint64_t    rtt_last_us;
+    uint64_t    rtt_min_us;
+    uint64_t    rtt_max_us;
+    uint64_t    rtt_sum_us;
+    uint64_t    srtt_us;
+    uint64_t    drops;
+    uint64_t    pace_waits;                 //datagrams the rate cap held back
+    uint64_t    pace_wait_us;               //time they were held back
+    uint64_t    errors[DP_NUM_ERR_CODES];
+} dp_stats;
+
+#define DP_STATS_FMT_JSON   0
+#define DP_STATS_FMT_PROM   1
+
+struct dp_stats_export{
+    char               *path;
+    int                format;
+    uint64_t           interval_ns;
+    uint64_t           next_ns;
+};
+
+/*
+ * Send rate cap, a token bucket (kept as the time it is next empty) that
+ * every datagram sent on the connections using it must take its size out
+ * of, see dp_bucket_new().  Connections sharing a bucket share its rate.
+ */
+typedef struct dp_bucket dp_bucket;
+
+#define DP_PACE_SPIN_NS     50000           //waits end spinning, not sleeping
+
+/*
+ * Priority classes, each one sets SO_PRIORITY and optionally the DSCP
+ */
+#define DP_PRIO_BULK        0               //CS1, lower than best effort
+#define DP_PRIO_NORMAL      1               //best effort
+#define DP_PRIO_INTERACTIVE 2               //AF41
+
 typedef struct dp_connection{
     unsigned int       seqNum;
     int                udp_sock;
@@ -17,6 +72,10 @@ typedef struct dp_connection{
     struct dp_sock     outSockAddr;
     struct dp_sock     inSockAddr;
     int                dbgMode;
+    unsigned int       lastAckSeq;
+    dp_stats           stats;
+    struct dp_stats_export statsOut;
+    dp_bucket          *bucket;
 } dp_connection;
 
 typedef struct dp_connection *dp_connp;
@@ -60,6 +119,7 @@ typedef struct dp_pdu {
 
 #define     DP_MAX_BUFF_SZ          512
 #define     DP_MAX_DGRAM_SZ         (DP_MAX_BUFF_SZ + sizeof(dp_pdu))
+#define     DP_MAX_IOV              16      //max buffers for dpsendv()/dprecvv()
 
 #define     DP_NO_ERROR             0
 #define     DP_ERROR_GENERAL        -1
@@ -69,18 +129,25 @@ typedef struct dp_pdu {
 #define     DP_CONNECTION_CLOSED    -16
 #define     DP_ERROR_BAD_DGRAM      -32
 
+//Error codes are negative powers of two, this maps them to 1..6
+#define     DP_ERR_INDEX(e)         (__builtin_ctz(-(e)) + 1)
+
 //PROTOTYPES - INTERNAL HELPERS
 static dp_connp dpinit();
 
 dp_connp dpServerInit(int port);
+dp_connp dpServerInitShared(int port);
 dp_connp dpClientInit(char *addr, int port);
 static char * pdu_msg_to_string(dp_pdu *pdu);
 
 //API Interface
 void * dp_prepare_send(dp_pdu *pdu_ptr, void *buff, int buff_sz);
 int dprecv(dp_connp dp, void *buff, int buff_sz);
+int dprecvv(dp_connp dp, const struct iovec *iov, int iovcnt);
 int dpsend(dp_connp dp, void *sbuff, int sbuff_sz);
+int dpsendv(dp_connp dp, const struct iovec *iov, int iovcnt);
 int dplisten(dp_connp dp);
+dp_connp dpaccept(dp_connp listener);
 int dpconnect(dp_connp dp);
 int dpdisconnect(dp_connp dp);
 
@@ -88,8 +155,19 @@ void dpclose(dp_connp dpsession);
 void print_out_pdu(dp_pdu *pdu);
 void print_in_pdu(dp_pdu *pdu);
 int  dpmaxdgram();
+void dpsetdebug(int mode);
+int  dp_get_stats(dp_connp dp, dp_stats *stats);
+int  dp_stats_export(dp_connp dp, const char *path, int format, int interval_ms);
+int  dp_stats_dump(dp_connp dp);
+dp_bucket *dp_bucket_new(uint64_t rate, uint32_t burst);
+void dp_bucket_free(dp_bucket *b);
+void dp_set_bucket(dp_connp dp, dp_bucket *b);
+int  dp_set_priority(dp_connp dp, int prio, int dscp);
 static void print_pdu_details(dp_pdu *pdu);
 static int dpsendraw(dp_connp dp, void *sbuff, int sbuff_sz);
 static int dprecvraw(dp_connp dp, void *buff, int buff_sz);
-static int dprecvdgram(dp_connp dp, void *buff, int buff_sz);
+static int dprecvdgram(dp_connp dp, dp_pdu *inPdu, const struct iovec *iov, int iovcnt);
+static int dprecvrawv(dp_connp dp, struct iovec *iov, int iovcnt);
 static int dpsenddgram(dp_connp dp, void *sbuff, int sbuff_sz);
+static int dpsendvdgram(dp_connp dp, const struct iovec *iov, int iovcnt);
+static int dpsendrawv(dp_connp dp, struct iovec *iov, int iovcnt);
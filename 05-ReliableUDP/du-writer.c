@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "du-writer.h"
+
+#define RING_MASK       (FTP_RING_SLOTS - 1)
+
+/*
+ *  Backoff used by both sides of the ring when there is nothing to do,
+ *  spin briefly, then yield, then sleep so an idle side costs no CPU.
+ */
+static void ring_backoff(int *spins){
+    static const struct timespec nap = { .tv_sec = 0, .tv_nsec = 50000 };
+
+    if (*spins >= 256)
+        nanosleep(&nap, NULL);
+    else if (*spins >= 64)
+        sched_yield();
+    (*spins)++;
+}
+
+/*
+ *  Writes out the stage.  A stage that starts and ends on FTP_STAGE_ALIGN
+ *  goes through the O_DIRECT descriptor when the file has one, a device
+ *  that turns it down gets buffered writes from then on.
+ */
+static int stage_write(ftp_writer *w){
+    const char *p = w->stage;
+    size_t left = w->stage_len;
+    off_t  off = w->stage_off;
+    int    fd = w->stage_fd;
+
+    if (left == 0)
+        return 0;
+    if ((w->direct_fd >= 0) && (fd == w->buffered_fd) &&
+            (off % FTP_STAGE_ALIGN == 0) && (left % FTP_STAGE_ALIGN == 0))
+        fd = w->direct_fd;
+
+    while (left > 0){
+        ssize_t rc = pwrite(fd, p, left, off);
+        if (rc < 0){
+            if (errno == EINTR)
+                continue;
+            if ((fd == w->direct_fd) && (errno == EINVAL)){
+                fprintf(stderr, "du-writer: O_DIRECT refused, using buffered writes\n");
+                w->direct_fd = -1;
+                fd = w->stage_fd;
+                continue;
+            }
+            perror("du-writer: pwrite");
+            return -1;
+        }
+        //the rest of a short direct write may no longer be aligned
+        fd = w->stage_fd;
+        p += rc;
+        off += rc;
+        left -= rc;
+    }
+    if (w->on_write != NULL)
+        w->on_write(w->cb_ctx, w->stage_fd, w->stage_off, w->stage_len);
+    w->stage_len = 0;
+    return 0;
+}
+
+/*
+ *  Moves n slots starting at sequence number first into the stage.  A slot
+ *  that does not continue the stage (another file or a gap) writes it out
+ *  first, so are stages that reach their aligned end.
+ */
+static int write_slots(ftp_writer *w, uint32_t first, uint32_t n){
+    uint32_t i;
+
+    for (i = 0; i < n; i++){
+        ftp_slot *s = &w->slots[(first + i) & RING_MASK];
+        const char *data = s->data;
+        size_t len = s->len;
+        off_t  off = s->offset;
+
+        while (len > 0){
+            if ((w->stage_len > 0) &&
+                    ((s->fd != w->stage_fd) || (off != w->stage_off + (off_t)w->stage_len)) &&
+                    (stage_write(w) < 0))
+                return -1;
+            if (w->stage_len == 0){
+                w->stage_fd = s->fd;
+                w->stage_off = off;
+                w->stage_end = (off + FTP_STAGE_SZ) / FTP_STAGE_ALIGN * FTP_STAGE_ALIGN;
+            }
+
+            size_t room = w->stage_end - (w->stage_off + w->stage_len);
+            size_t bytes = (len < room) ? len : room;
+            memcpy(w->stage + w->stage_len, data, bytes);
+            w->stage_len += bytes;
+            data += bytes;
+            off += bytes;
+            len -= bytes;
+            if ((bytes == room) && (stage_write(w) < 0))
+                return -1;
+        }
+    }
+    return 0;
+}
+
+static void *writer_main(void *arg){
+    ftp_writer *w = arg;
+    uint32_t tail = atomic_load_explicit(&w->tail, memory_order_relaxed);
+    int spins = 0;
+
+    while(1) {
+        //read the request before head, a request covers every slot committed before it
+        uint32_t req = atomic_load_explicit(&w->flush_req, memory_order_acquire);
+        uint32_t head = atomic_load_explicit(&w->head, memory_order_acquire);
+
+        if (head == tail){
+            if (atomic_load_explicit(&w->done, memory_order_acquire) &&
+                (atomic_load_explicit(&w->head, memory_order_acquire) == tail))
+                break;
+            if (req != atomic_load_explicit(&w->flush_done, memory_order_relaxed)){
+                if ((w->err == 0) && (stage_write(w) < 0))
+                    w->err = -1;
+                w->stage_len = 0;
+                atomic_store_explicit(&w->flush_done, req, memory_order_release);
+                continue;
+            }
+            ring_backoff(&spins);
+            continue;
+        }
+        spins = 0;
+
+        uint32_t n = head - tail;
+        if (n > FTP_DRAIN_BATCH)
+            n = FTP_DRAIN_BATCH;
+        if ((w->err == 0) && (write_slots(w, tail, n) < 0))
+            w->err = -1;        //keep draining so the producer never blocks
+        tail += n;
+        atomic_store_explicit(&w->tail, tail, memory_order_release);
+    }
+    if ((w->err == 0) && (stage_write(w) < 0))
+        w->err = -1;
+    return NULL;
+}
+
+ftp_writer *ftp_writer_start(ftp_write_cb on_write, void *cb_ctx){
+    ftp_writer *w = calloc(1, sizeof(ftp_writer));
+    if (w == NULL)
+        return NULL;
+    w->on_write = on_write;
+    w->cb_ctx = cb_ctx;
+
+    w->slots = malloc(sizeof(ftp_slot) * FTP_RING_SLOTS);
+    w->stage = aligned_alloc(FTP_STAGE_ALIGN, FTP_STAGE_SZ);
+    if ((w->slots == NULL) || (w->stage == NULL)){
+        free(w->slots);
+        free(w->stage);
+        free(w);
+        return NULL;
+    }
+    w->buffered_fd = -1;
+    w->direct_fd = -1;
+    atomic_init(&w->flush_req, 0);
+    atomic_init(&w->flush_done, 0);
+    atomic_init(&w->head, 0);
+    atomic_init(&w->tail, 0);
+    atomic_init(&w->done, false);
+
+    if (pthread_create(&w->thread, NULL, writer_main, w) != 0){
+        free(w->slots);
+        free(w->stage);
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+/*
+ *  Returns the next free slot for the producer, waiting for the writer if
+ *  the ring is full.  The slot is not visible to the writer until
+ *  ftp_writer_commit() is called, so it can be filled in place.
+ */
+ftp_slot *ftp_writer_slot(ftp_writer *w){
+    uint32_t head = atomic_load_explicit(&w->head, memory_order_relaxed);
+    int spins = 0;
+
+    while ((head - atomic_load_explicit(&w->tail, memory_order_acquire)) >= FTP_RING_SLOTS)
+        ring_backoff(&spins);
+
+    return &w->slots[head & RING_MASK];
+}
+
+void ftp_writer_commit(ftp_writer *w){
+    uint32_t head = atomic_load_explicit(&w->head, memory_order_relaxed);
+    atomic_store_explicit(&w->head, head + 1, memory_order_release);
+}
+
+/*
+ *  Full aligned stages for fd are written through direct_fd, an O_DIRECT
+ *  descriptor of the same file.  Must be called before the first slot for
+ *  fd is committed.
+ */
+void ftp_writer_direct(ftp_writer *w, int fd, int direct_fd){
+    w->buffered_fd = fd;
+    w->direct_fd = direct_fd;
+}
+
+/*
+ *  Waits until everything committed so far has been written, including a
+ *  partly filled stage
+ */
+void ftp_writer_flush(ftp_writer *w){
+    uint32_t req = atomic_fetch_add_explicit(&w->flush_req, 1, memory_order_release) + 1;
+    int spins = 0;
+
+    while (atomic_load_explicit(&w->flush_done, memory_order_acquire) != req)
+        ring_backoff(&spins);
+}
+
+/*
+ *  Flushes everything that was committed, stops the writer thread and
+ *  frees the ring.  Returns 0, or -1 if any write failed.
+ */
+int ftp_writer_finish(ftp_writer *w){
+    int rc;
+
+    atomic_store_explicit(&w->done, true, memory_order_release);
+    pthread_join(w->thread, NULL);
+    rc = w->err;
+
+    free(w->slots);
+    free(w->stage);
+    free(w);
+    return rc;
+}
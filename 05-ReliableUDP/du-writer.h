@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "du-proto.h"
+
+/*
+ * Asynchronous file writer for du-ftp
+ *
+ * The network thread receives straight into a slot of a single producer /
+ * single consumer ring and publishes it, a writer thread drains the ring
+ * and copies runs of slots that are contiguous in the file into a large
+ * stage buffer.  The stage is written once it reaches the next
+ * FTP_STAGE_ALIGN boundary FTP_STAGE_SZ on, so after the first one every
+ * write is a full, aligned FTP_STAGE_SZ block and the filesystem gets
+ * large extents.  Those blocks can go through an O_DIRECT descriptor, see
+ * ftp_writer_direct().  A slow disk then only fills the ring, it never
+ * holds up the ACK for the next datagram.
+ */
+#define FTP_RING_SLOTS      4096            //must be a power of two
+#define FTP_DRAIN_BATCH     256             //slots staged before they go back to the producer
+#define FTP_STAGE_SZ        (1024 * 1024)
+#define FTP_STAGE_ALIGN     4096            //O_DIRECT offset and size alignment
+
+//optional hook, called on the writer thread after each completed write
+typedef void (*ftp_write_cb)(void *ctx, int fd, off_t offset, size_t len);
+
+typedef struct ftp_slot{
+    int         fd;
+    int         len;
+    off_t       offset;
+    char        data[DP_MAX_BUFF_SZ];
+} ftp_slot;
+
+typedef struct ftp_writer{
+    ftp_slot            *slots;
+    _Atomic uint32_t    head;               //next slot the producer fills
+    _Atomic uint32_t    tail;               //next slot the writer drains
+    _Atomic bool        done;
+    pthread_t           thread;
+    int                 err;
+    char                *stage;             //FTP_STAGE_ALIGN aligned
+    int                 stage_fd;
+    off_t               stage_off;          //file offset of stage[0]
+    off_t               stage_end;          //aligned offset the stage is written at
+    size_t              stage_len;
+    int                 buffered_fd;        //writes to it may use direct_fd
+    int                 direct_fd;
+    _Atomic uint32_t    flush_req;          //producer asks for a partial stage
+    _Atomic uint32_t    flush_done;
+    ftp_write_cb        on_write;
+    void                *cb_ctx;
+} ftp_writer;
+
+ftp_writer *ftp_writer_start(ftp_write_cb on_write, void *cb_ctx);
+ftp_slot   *ftp_writer_slot(ftp_writer *w);
+void        ftp_writer_commit(ftp_writer *w);
+void        ftp_writer_direct(ftp_writer *w, int fd, int direct_fd);
+void        ftp_writer_flush(ftp_writer *w);
+int         ftp_writer_finish(ftp_writer *w);